@@ -0,0 +1,108 @@
+#pragma once
+
+#include <memory>
+#include <stddef.h>
+#include <string>
+
+// Embeddable interface to the denoiser, for applications that want to denoise
+// images they already hold in memory without going through files.
+namespace denoiser
+{
+
+enum class PixelFormat
+{
+    Float,
+    Half
+};
+
+// An image in memory owned by the caller. Only the first three channels of each pixel
+// are read or written, so other channels such as alpha are left as they are. Strides
+// are in bytes; 0 means three tightly packed channels and tightly packed rows.
+struct Image
+{
+    void* data = nullptr;
+    int width = 0;
+    int height = 0;
+    PixelFormat format = PixelFormat::Float;
+    size_t pixel_stride = 0;
+    size_t row_stride = 0;
+};
+
+struct DeviceOptions
+{
+    // 0 uses all hardware threads
+    int num_threads = 0;
+    bool affinity = false;
+};
+
+// OIDN quality presets, trading quality for speed. Default is High.
+enum class Quality
+{
+    Default,
+    Fast,
+    Balanced,
+    High
+};
+
+// What denoise() does when it misses FilterOptions::deadline_ms
+enum class OnDeadline
+{
+    // Returns false, leaving the output partly written
+    Fail,
+    // Denoises again with the fast quality preset and a new deadline, then copies the
+    // noisy color if that misses it too
+    Fast,
+    // Copies the noisy color to the output
+    Noisy
+};
+
+struct FilterOptions
+{
+    bool hdr = true;
+    bool srgb = false;
+    bool clean_aux = false;
+    // -1 uses the OIDN default
+    int max_memory_mb = -1;
+    Quality quality = Quality::Default;
+    // Path to custom trained weights (.tza), empty for the built in ones. The file is memory
+    // mapped once per process and shared by every filter using it.
+    std::string weights;
+    // Time allowed for the denoise in ms, 0 for no limit. The execution is stopped once it
+    // passes. Fallbacks other than Fail need an output separate from the color image.
+    double deadline_ms = 0.0;
+    OnDeadline on_deadline = OnDeadline::Fail;
+};
+
+// A denoiser with its own OIDN device and filter. The filter is kept between calls and
+// only set up again when the images or options change, so denoising the same buffers
+// again is cheap. Instances are independent of each other and can be used from separate
+// threads at the same time, but each instance must only be used by one thread at a time.
+class Denoiser
+{
+public:
+    Denoiser();
+    ~Denoiser();
+    Denoiser(const Denoiser&) = delete;
+    Denoiser& operator=(const Denoiser&) = delete;
+
+    // Creates the CPU device. Returns false on failure, see error().
+    bool init(const DeviceOptions& options = DeviceOptions());
+
+    // Denoises color into output, which may be the same image. albedo and normal are
+    // optional, but a normal needs an albedo. All images must be the same size.
+    // Returns false on failure, see error().
+    bool denoise(const Image& color, const Image* albedo, const Image* normal, const Image& output,
+                 const FilterOptions& options = FilterOptions());
+
+    // Whether the last denoise() missed its deadline, whatever the fallback did
+    bool missedDeadline() const;
+
+    // Describes the last failure
+    const std::string& error() const;
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+} // namespace denoiser
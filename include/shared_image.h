@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+// Layout of an image handed to the denoiser in shared memory instead of a file, e.g. by a
+// renderer. The region is a POSIX shared memory object, given as "shm:/name", or any
+// mappable file descriptor inherited by the denoiser such as a memfd, given as "fd:N". It
+// starts with this header, followed by the pixels at data_offset.
+namespace denoiser
+{
+
+const uint32_t shared_image_magic = 0x5344494f; // "OIDS"
+const uint32_t shared_image_version = 1;
+
+enum SharedPixelType : int32_t
+{
+    SharedFloat = 0,
+    SharedHalf = 1
+};
+
+struct SharedImageHeader
+{
+    uint32_t magic = shared_image_magic;
+    uint32_t version = shared_image_version;
+    int32_t width = 0;
+    int32_t height = 0;
+    // Channels per pixel, of which the first three are denoised or written. Others such
+    // as alpha are left as they are.
+    int32_t channels = 3;
+    int32_t pixel_type = SharedFloat;
+    // Bytes between the starts of rows, 0 for tightly packed rows
+    uint64_t row_stride = 0;
+    // Bytes from the start of the region to the first pixel, by default the next cache line
+    uint64_t data_offset = 64;
+};
+
+static_assert(sizeof(SharedImageHeader) <= 64, "the header must fit before the default data offset");
+
+} // namespace denoiser
@@ -0,0 +1,245 @@
+#include "benchmark.h"
+#include "log.h"
+#include "trace.h"
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <math.h>
+#include <stdlib.h>
+#include <thread>
+
+namespace
+{
+
+struct BenchmarkResult
+{
+    bool half;
+    double buffer_mb;
+    int threads;
+    int maxmem;
+    oidn::Quality quality;
+    double commit_ms;
+    TimingStats stats;
+};
+
+// Times preprocessing the beauty with the fused, threaded loop used when reading against a
+// plain scalar loop over the same pixels, each on a fresh copy of the decoded pixels
+void benchmarkPreprocess(const FrameImages& images, const PreprocessSettings& preprocess, const BenchmarkSettings& bench)
+{
+    OIIO::ROI roi = images.padded;
+    const int channels = roi.nchannels();
+    const size_t num_pixels = size_t(roi.width()) * roi.height();
+    std::vector<float> source(num_pixels * channels);
+    if (channels < 3 || !images.beauty->get_pixels(roi, OIIO::TypeDesc::FLOAT, source.data()))
+        return;
+    const PixelTransform transform = layerTransform(preprocess, InputLayer::Beauty);
+
+    std::vector<float> pixels;
+    std::vector<double> scalar_ms, fused_ms;
+    for (unsigned int i = 0; i < bench.num_runs; i++)
+    {
+        pixels = source;
+        auto start = std::chrono::steady_clock::now();
+        preprocessScalar(pixels.data(), num_pixels, channels, transform);
+        scalar_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+        pixels = source;
+        start = std::chrono::steady_clock::now();
+        preprocessPixels(pixels.data(), num_pixels, channels, transform);
+        fused_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    const TimingStats scalar = computeTimingStats(scalar_ms);
+    const TimingStats fused = computeTimingStats(fused_ms);
+    PrintInfo("Preprocessing %d channels: scalar loop median %.3f ms (%.1f Mpixels/s), vectorised median %.3f ms (%.1f Mpixels/s), %.1fx faster",
+              channels, scalar.median_ms, num_pixels / (scalar.median_ms * 1000.0), fused.median_ms,
+              num_pixels / (fused.median_ms * 1000.0), fused.median_ms > 0.0 ? scalar.median_ms / fused.median_ms : 0.0);
+}
+
+std::string jsonString(const std::string& value)
+{
+    std::string escaped = "\"";
+    for (char c : value)
+    {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped + "\"";
+}
+
+bool endsWith(const std::string& value, const std::string& suffix)
+{
+    return value.size() >= suffix.size() && value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool writeResults(const std::string& path, const FrameJob& job, const DenoiseBuffers& buffers, const std::string& version,
+                  const BenchmarkSettings& bench, const std::vector<BenchmarkResult>& results)
+{
+    std::ofstream file(path);
+    if (!file)
+        return false;
+    char line[1024];
+    if (endsWith(path, ".csv"))
+    {
+        file << "oidn_version,image,width,height,albedo,normal,warmup,runs,precision,buffer_mb,threads,maxmem_mb,quality,commit_ms,min_ms,median_ms,p95_ms,max_ms,mean_ms\n";
+        for (const BenchmarkResult& result : results)
+        {
+            snprintf(line, sizeof(line), "%s,%s,%d,%d,%d,%d,%u,%d,%s,%.1f,%d,%d,%s,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                     version.c_str(), job.beauty.c_str(), buffers.width, buffers.height, int(buffers.has_albedo),
+                     int(buffers.has_normal), bench.num_warmup, result.stats.runs, result.half ? "half" : "float",
+                     result.buffer_mb, result.threads, result.maxmem, qualityName(result.quality),
+                     result.commit_ms, result.stats.min_ms, result.stats.median_ms, result.stats.p95_ms,
+                     result.stats.max_ms, result.stats.mean_ms);
+            file << line;
+        }
+    }
+    else
+    {
+        file << "{\n";
+        file << "  \"oidn_version\": " << jsonString(version) << ",\n";
+        file << "  \"image\": " << jsonString(job.beauty) << ",\n";
+        snprintf(line, sizeof(line), "  \"width\": %d,\n  \"height\": %d,\n  \"albedo\": %s,\n  \"normal\": %s,\n"
+                 "  \"hardware_threads\": %u,\n  \"warmup\": %u,\n  \"runs\": %u,\n",
+                 buffers.width, buffers.height, buffers.has_albedo ? "true" : "false", buffers.has_normal ? "true" : "false",
+                 std::thread::hardware_concurrency(), bench.num_warmup, bench.num_runs);
+        file << line;
+        file << "  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const BenchmarkResult& result = results[i];
+            snprintf(line, sizeof(line), "    {\"precision\": \"%s\", \"buffer_mb\": %.1f, \"threads\": %d, \"maxmem_mb\": %d, \"quality\": \"%s\", \"commit_ms\": %.3f, \"min_ms\": %.3f, "
+                     "\"median_ms\": %.3f, \"p95_ms\": %.3f, \"max_ms\": %.3f, \"mean_ms\": %.3f}%s\n",
+                     result.half ? "half" : "float", result.buffer_mb, result.threads, result.maxmem, qualityName(result.quality), result.commit_ms, result.stats.min_ms, result.stats.median_ms,
+                     result.stats.p95_ms, result.stats.max_ms, result.stats.mean_ms, (i + 1 < results.size()) ? "," : "");
+            file << line;
+        }
+        file << "  ]\n}\n";
+    }
+    return bool(file);
+}
+
+} // namespace
+
+TimingStats computeTimingStats(std::vector<double> times_ms)
+{
+    TimingStats stats;
+    stats.runs = int(times_ms.size());
+    if (times_ms.empty())
+        return stats;
+    std::sort(times_ms.begin(), times_ms.end());
+    const size_t count = times_ms.size();
+    stats.min_ms = times_ms.front();
+    stats.max_ms = times_ms.back();
+    stats.median_ms = (count % 2) ? times_ms[count / 2] : 0.5 * (times_ms[count / 2 - 1] + times_ms[count / 2]);
+    // Nearest rank percentile
+    stats.p95_ms = times_ms[size_t(ceil(0.95 * count)) - 1];
+    for (double ms : times_ms)
+        stats.mean_ms += ms;
+    stats.mean_ms /= count;
+    return stats;
+}
+
+std::vector<double> timeExecute(oidn::FilterRef& filter, unsigned int num_warmup, unsigned int num_runs)
+{
+    for (unsigned int i = 0; i < num_warmup; i++)
+    {
+        PrintInfo("Warming up...");
+        TraceScope trace("execute (warmup)");
+        filter.execute();
+    }
+
+    std::vector<double> times_ms;
+    for (unsigned int i = 0; i < num_runs; i++)
+    {
+        PrintInfo("Denoising...");
+        std::chrono::duration<double, std::milli> time_span;
+        {
+            TraceScope trace("execute");
+            auto start = std::chrono::steady_clock::now();
+            filter.execute();
+            time_span = std::chrono::steady_clock::now() - start;
+        }
+        times_ms.push_back(time_span.count());
+        if (num_runs > 1)
+            PrintInfo("Denoising run %d complete in %.3f seconds", i+1, times_ms.back() / 1000.0);
+        else
+            PrintInfo("Denoising complete in %.3f seconds", times_ms.back() / 1000.0);
+    }
+    return times_ms;
+}
+
+int runBenchmark(const FrameJob& job, const BenchmarkSettings& bench, const FilterSettings& settings, bool affinity)
+{
+    int width, height;
+    FrameImages images;
+    DenoiseBuffers buffers;
+    if (!openFrame(job, images, width, height))
+        return EXIT_FAILURE;
+
+    const std::vector<PixelPrecision> precisions = bench.precision.empty() ? std::vector<PixelPrecision>{ settings.precision } : bench.precision;
+    const std::vector<int> threads = bench.threads.empty() ? std::vector<int>{ 0 } : bench.threads;
+    const std::vector<int> maxmem = bench.maxmem.empty() ? std::vector<int>{ settings.maxmem } : bench.maxmem;
+    const std::vector<oidn::Quality> qualities = bench.quality.empty() ? std::vector<oidn::Quality>{ settings.quality } : bench.quality;
+
+    if (settings.preprocess.enabled())
+        benchmarkPreprocess(images, settings.preprocess, bench);
+
+    std::string version;
+    std::vector<BenchmarkResult> results;
+    try
+    {
+        for (PixelPrecision precision : precisions)
+        {
+            FilterSettings read_settings = settings;
+            read_settings.precision = precision;
+            if (!readFrame(images, buffers, false, read_settings))
+                return EXIT_FAILURE;
+            const double buffer_mb = bufferBytes(buffers) / (1024.0 * 1024.0);
+            for (int num_threads : threads)
+            {
+                // Threads are a device setting, so each count needs its own device
+                oidn::DeviceRef device = createDevice(num_threads, affinity);
+                version = std::to_string(device.get<int>("versionMajor")) + "." + std::to_string(device.get<int>("versionMinor")) +
+                          "." + std::to_string(device.get<int>("versionPatch"));
+                for (int mem : maxmem)
+                {
+                    for (oidn::Quality quality : qualities)
+                    {
+                        FilterSettings filter_settings = settings;
+                        filter_settings.maxmem = mem;
+                        filter_settings.quality = quality;
+                        oidn::FilterRef filter = createFilter(device, filter_settings);
+
+                        auto commit_start = std::chrono::steady_clock::now();
+                        buffers.dirty = true;
+                        bindFilter(filter, buffers);
+                        std::chrono::duration<double, std::milli> commit_span = std::chrono::steady_clock::now() - commit_start;
+
+                        BenchmarkResult result = { buffers.half, buffer_mb, num_threads, mem, quality, commit_span.count(),
+                                                   computeTimingStats(timeExecute(filter, bench.num_warmup, bench.num_runs)) };
+                        results.push_back(result);
+                        PrintInfo("%s (%.1f MB), threads %3d, maxmem %6d MB, quality %-8s: commit %.3f ms, min %.3f, median %.3f, p95 %.3f, max %.3f ms",
+                                  result.half ? "half " : "float", buffer_mb, num_threads, mem, qualityName(quality), result.commit_ms,
+                                  result.stats.min_ms, result.stats.median_ms, result.stats.p95_ms, result.stats.max_ms);
+                    }
+                }
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        PrintError("[OIDN]: %s", e.what());
+        return EXIT_FAILURE;
+    }
+
+    if (!bench.output.empty())
+    {
+        if (!writeResults(bench.output, job, buffers, version, bench, results))
+        {
+            PrintError("Could not write benchmark results to %s", bench.output.c_str());
+            return EXIT_FAILURE;
+        }
+        PrintInfo("Benchmark results written to %s", bench.output.c_str());
+    }
+    return EXIT_SUCCESS;
+}
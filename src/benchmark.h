@@ -0,0 +1,42 @@
+#pragma once
+
+#include "frame.h"
+#include <string>
+#include <vector>
+
+// Summary of a set of timed runs, in milliseconds
+struct TimingStats
+{
+    int runs = 0;
+    double min_ms = 0.0;
+    double median_ms = 0.0;
+    double p95_ms = 0.0;
+    double max_ms = 0.0;
+    double mean_ms = 0.0;
+};
+
+TimingStats computeTimingStats(std::vector<double> times_ms);
+
+// Executes the filter num_warmup times untimed, then num_runs times timed with a
+// monotonic wall clock. Returns the time of each timed run in milliseconds.
+// Throws on OIDN errors.
+std::vector<double> timeExecute(oidn::FilterRef& filter, unsigned int num_warmup, unsigned int num_runs);
+
+struct BenchmarkSettings
+{
+    // Thread counts and maxMemoryMB values to sweep. 0 threads and -1 MB are the OIDN defaults.
+    std::vector<int> threads;
+    std::vector<int> maxmem;
+    // Pixel precisions to sweep, to compare the half and float data paths
+    std::vector<PixelPrecision> precision;
+    // Quality presets to sweep, to compare their latency
+    std::vector<oidn::Quality> quality;
+    unsigned int num_warmup = 1;
+    unsigned int num_runs = 10;
+    // Results are written as CSV if the path ends in .csv, otherwise as JSON
+    std::string output;
+};
+
+// Benchmarks denoising a frame for every combination of precision, thread count, memory limit and quality.
+// Returns the process exit code.
+int runBenchmark(const FrameJob& job, const BenchmarkSettings& bench, const FilterSettings& settings, bool affinity);
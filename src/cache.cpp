@@ -0,0 +1,219 @@
+#include "cache.h"
+#include "frame.h"
+#include "log.h"
+#include "parallel.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <tuple>
+
+namespace
+{
+
+// Pixels are hashed in fixed size chunks so the key doesn't depend on the thread count
+const size_t hash_chunk = 1 << 20;
+
+const char* result_name = "result";
+
+// Seed of the second hash of a result's pixels, unrelated to the FNV offset basis of the first
+const uint64_t check_seed = 0x9e3779b97f4a7c15ull;
+
+size_t resultBytes(const DenoiseBuffers& buffers)
+{
+    return size_t(buffers.width) * buffers.height * 3 * (buffers.half ? sizeof(uint16_t) : sizeof(float));
+}
+
+// Removes the least recently used results until the directory fits in max_mb. The
+// result just stored is kept, as file times can be coarser than the time between frames.
+void trimResults(const ResultCache& cache, const std::string& stored)
+{
+    namespace fs = std::filesystem;
+    std::vector<std::tuple<fs::file_time_type, uintmax_t, fs::path>> files;
+    uintmax_t total = 0;
+    std::error_code error;
+    for (fs::directory_iterator it(cache.dir, error), end; !error && it != end; it.increment(error))
+    {
+        if (it->path().extension() != std::string(".") + result_name || it->path() == fs::path(stored))
+            continue;
+        std::error_code file_error;
+        const uintmax_t size = it->file_size(file_error);
+        const fs::file_time_type time = it->last_write_time(file_error);
+        if (file_error)
+            continue;
+        files.emplace_back(time, size, it->path());
+        total += size;
+    }
+    std::error_code stored_error;
+    total += fs::file_size(stored, stored_error);
+    const uintmax_t limit = uintmax_t(std::max<int64_t>(cache.max_mb, 0)) * 1024 * 1024;
+    if (total <= limit)
+        return;
+    std::sort(files.begin(), files.end());
+    int removed = 0;
+    for (size_t i = 0; i < files.size() && total > limit; i++)
+    {
+        // Another process may have removed it already
+        fs::remove(std::get<2>(files[i]), error);
+        total -= std::get<1>(files[i]);
+        removed++;
+    }
+    if (verbosity >= 2)
+        PrintInfo("Removed %d old results from the result cache", removed);
+}
+
+} // namespace
+
+uint64_t hashBytes(const unsigned char* data, size_t size, uint64_t hash)
+{
+    // The high bits are folded down after each word
+    const uint64_t prime = 1099511628211ull;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 32;
+    }
+    for (; i < size; i++)
+        hash = (hash ^ data[i]) * prime;
+    return hash;
+}
+
+uint64_t hashPixels(const std::vector<unsigned char>& pixels, uint64_t hash, uint64_t chunk_seed)
+{
+    const size_t num_chunks = (pixels.size() + hash_chunk - 1) / hash_chunk;
+    std::vector<uint64_t> chunk_hashes(num_chunks);
+    parallelFor(0, num_chunks, [&](size_t begin, size_t end)
+    {
+        for (size_t c = begin; c < end; c++)
+        {
+            const size_t offset = c * hash_chunk;
+            chunk_hashes[c] = hashBytes(pixels.data() + offset, std::min(hash_chunk, pixels.size() - offset), chunk_seed);
+        }
+    }, 1);
+    return hashBytes((const unsigned char*)chunk_hashes.data(), num_chunks * sizeof(uint64_t), hash);
+}
+
+std::string cachePath(const std::string& dir, uint64_t hash, const char* name)
+{
+    char file[64];
+    snprintf(file, sizeof(file), "%016llx.%s", (unsigned long long)hash, name);
+    return (std::filesystem::path(dir) / file).string();
+}
+
+bool readCache(const std::string& path, std::vector<unsigned char>& pixels)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file || size_t(file.tellg()) != pixels.size())
+        return false;
+    // Read to the side so a short read leaves pixels intact
+    std::vector<unsigned char> cached(pixels.size());
+    file.seekg(0);
+    if (!file.read((char*)cached.data(), cached.size()))
+        return false;
+    memcpy(pixels.data(), cached.data(), cached.size());
+    return true;
+}
+
+void writeCache(const std::string& path, const std::vector<unsigned char>& pixels)
+{
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+    const std::string temp_path = path + "." + std::to_string(std::random_device()()) + ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary);
+        if (!file || !file.write((const char*)pixels.data(), pixels.size()))
+        {
+            PrintError("Could not write cache file %s", temp_path.c_str());
+            remove(temp_path.c_str());
+            return;
+        }
+    }
+    std::filesystem::rename(temp_path, path, error);
+    if (error)
+    {
+        PrintError("Could not write cache file %s", path.c_str());
+        remove(temp_path.c_str());
+    }
+}
+
+ResultKey resultKey(const ResultCache& cache, const DenoiseBuffers& buffers, const FilterSettings& settings)
+{
+    // maxmem only changes how the filter tiles the image, not its result
+    ResultKey key;
+    const int32_t params[12] = { buffers.width, buffers.height, buffers.beauty_channels, int32_t(buffers.half),
+                                 int32_t(buffers.has_albedo), int32_t(buffers.has_normal), int32_t(settings.hdr),
+                                 int32_t(settings.srgb), int32_t(settings.clean_aux), int32_t(settings.quality),
+                                 cache.version, 0 };
+    memcpy(key.params, params, sizeof(params));
+    // The contents of the weights the filter was created with, so retrained weights give new keys
+    key.weights = cache.weights;
+    uint64_t hash = hashBytes((const unsigned char*)key.params, sizeof(key.params));
+    hash = hashBytes((const unsigned char*)&key.weights, sizeof(key.weights), hash);
+    uint64_t check = check_seed;
+    for (const std::vector<unsigned char>* pixels : { &buffers.beauty, &buffers.albedo, &buffers.normal })
+    {
+        if ((pixels == &buffers.albedo && !buffers.has_albedo) || (pixels == &buffers.normal && !buffers.has_normal))
+            continue;
+        hash = hashPixels(*pixels, hash);
+        check = hashPixels(*pixels, check, check_seed);
+    }
+    key.hash = hash;
+    key.pixels = check;
+    return key;
+}
+
+bool loadResult(ResultCache& cache, const ResultKey& key, DenoiseBuffers& buffers)
+{
+    const std::string path = cachePath(cache.dir, key.hash, result_name);
+    std::vector<unsigned char> entry(sizeof(ResultKey) + resultBytes(buffers));
+    if (!readCache(path, entry) || memcmp(entry.data(), &key, sizeof(key)) != 0)
+        return false;
+    const unsigned char* result = entry.data() + sizeof(ResultKey);
+    if (!buffers.in_place)
+        memcpy(buffers.output.data(), result, resultBytes(buffers));
+    else
+    {
+        // Results are stored as packed RGB, the beauty keeps its other channels
+        const size_t rgb_bytes = resultBytes(buffers) / (size_t(buffers.width) * buffers.height);
+        const size_t beauty_bytes = rgb_bytes / 3 * buffers.beauty_channels;
+        parallelFor(0, size_t(buffers.width) * buffers.height, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+                memcpy(&buffers.beauty[i * beauty_bytes], &result[i * rgb_bytes], rgb_bytes);
+        });
+    }
+
+    // Used results are touched so the least recently used are removed first
+    std::error_code error;
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+    if (verbosity >= 2)
+        PrintInfo("Loaded the denoised result from %s", path.c_str());
+    return true;
+}
+
+void storeResult(ResultCache& cache, const ResultKey& key, const DenoiseBuffers& buffers)
+{
+    const std::string path = cachePath(cache.dir, key.hash, result_name);
+    std::vector<unsigned char> entry(sizeof(ResultKey) + resultBytes(buffers));
+    memcpy(entry.data(), &key, sizeof(key));
+    unsigned char* result = entry.data() + sizeof(ResultKey);
+    if (!buffers.in_place)
+        memcpy(result, buffers.output.data(), resultBytes(buffers));
+    else
+    {
+        const size_t rgb_bytes = resultBytes(buffers) / (size_t(buffers.width) * buffers.height);
+        const size_t beauty_bytes = rgb_bytes / 3 * buffers.beauty_channels;
+        parallelFor(0, size_t(buffers.width) * buffers.height, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+                memcpy(&result[i * rgb_bytes], &buffers.beauty[i * beauty_bytes], rgb_bytes);
+        });
+    }
+    writeCache(path, entry);
+    trimResults(cache, path);
+}
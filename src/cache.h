@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct DenoiseBuffers;
+struct FilterSettings;
+
+// On-disk caches keyed by a hash of the pixels they were computed from. Files are
+// written under a temporary name then renamed, so several processes can share a cache.
+
+// FNV-1a over 8 byte words, continuing from hash
+uint64_t hashBytes(const unsigned char* data, size_t size, uint64_t hash = 14695981039346656037ull);
+
+// Hashes pixels in parallel, continuing from hash. The result doesn't depend on the thread count.
+// Each chunk of the pixels is hashed starting from chunk_seed.
+uint64_t hashPixels(const std::vector<unsigned char>& pixels, uint64_t hash,
+                    uint64_t chunk_seed = 14695981039346656037ull);
+
+// Path of the file holding name for hash in dir
+std::string cachePath(const std::string& dir, uint64_t hash, const char* name);
+
+// Fills pixels from the file at path, only if it holds exactly pixels.size() bytes
+bool readCache(const std::string& path, std::vector<unsigned char>& pixels);
+
+void writeCache(const std::string& path, const std::vector<unsigned char>& pixels);
+
+// Denoised results keyed by the pixels given to the filter and every parameter that
+// changes its output, so unchanged frames are copied from the cache instead of denoised.
+// The least recently used results are removed once the directory passes max_mb.
+struct ResultCache
+{
+    std::string dir;
+    int64_t max_mb = 4096;
+    // OIDN version of the device, as other versions give other results
+    int version = 0;
+    // Hash of the custom weights the filter was created with, 0 for the built in ones
+    uint64_t weights = 0;
+    int hits = 0;
+    int misses = 0;
+};
+
+// What a result depends on. hash names its file, and the whole key is stored at the start
+// of the file and compared on lookup, so results whose hashes collide aren't mixed up.
+// The pixels are too large to store, so they are checked by a second hash, seeded
+// differently down to each chunk.
+struct ResultKey
+{
+    uint64_t hash = 0;
+    int32_t params[12] = {};
+    uint64_t weights = 0;
+    uint64_t pixels = 0;
+};
+
+// Key of the result of denoising buffers, which must hold the frame as the filter is given it
+ResultKey resultKey(const ResultCache& cache, const DenoiseBuffers& buffers, const FilterSettings& settings);
+
+// Copies the cached result for key to the output of buffers. Returns false on a miss.
+bool loadResult(ResultCache& cache, const ResultKey& key, DenoiseBuffers& buffers);
+
+// Saves the denoised result in buffers for key, then trims the cache to its size limit
+void storeResult(ResultCache& cache, const ResultKey& key, const DenoiseBuffers& buffers);
@@ -0,0 +1,246 @@
+#include "channels.h"
+#include "frame.h"
+#include "log.h"
+#include <OpenImageIO/imagebufalgo.h>
+#include <OpenImageIO/imagecache.h>
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <sstream>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+
+// Position of the last component of a channel name in RGBA or XYZ order, so the
+// channels of a layer can be sorted from the alphabetical order of an EXR
+int componentRank(const std::string& name)
+{
+    size_t dot = name.find_last_of('.');
+    const std::string component = (dot == std::string::npos) ? name : name.substr(dot + 1);
+    const char* order = "RGBAXYZ";
+    const char* found = (component.size() == 1) ? strchr(order, toupper(component[0])) : nullptr;
+    if (!found || !*found)
+        return 4;
+    const int rank = int(found - order);
+    return (rank < 4) ? rank : rank - 4;
+}
+
+// Appends the channels named prefix.*
+bool layerChannels(const OIIO::ImageSpec& spec, const std::string& prefix, std::vector<int>& channels)
+{
+    for (int c = 0; c < spec.nchannels; c++)
+    {
+        const std::string name = spec.channel_name(c);
+        if (name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0)
+            channels.push_back(c);
+    }
+    std::stable_sort(channels.begin(), channels.end(), [&spec](int a, int b)
+    {
+        return componentRank(spec.channel_name(a)) < componentRank(spec.channel_name(b));
+    });
+    return !channels.empty();
+}
+
+} // namespace
+
+void splitChannelSelector(const std::string& path, std::string& file, std::string& selector)
+{
+    // A colon after a drive letter or followed by more of the path isn't a selector
+    size_t colon = path.find_last_of(':');
+    if (colon == std::string::npos || colon < 2 || colon + 1 >= path.size() ||
+        path.find_first_of("/\\", colon) != std::string::npos)
+    {
+        file = path;
+        selector.clear();
+        return;
+    }
+    file = path.substr(0, colon);
+    selector = path.substr(colon + 1);
+}
+
+bool hasChannelSelector(const std::string& path)
+{
+    std::string file, selector;
+    splitChannelSelector(path, file, selector);
+    return !selector.empty();
+}
+
+bool selectChannels(const OIIO::ImageSpec& spec, const std::string& selector, std::vector<int>& channels)
+{
+    channels.clear();
+    if (selector.find(',') != std::string::npos)
+    {
+        std::stringstream list(selector);
+        std::string name;
+        while (std::getline(list, name, ','))
+        {
+            int c = spec.channelindex(name);
+            if (c < 0)
+                return false;
+            channels.push_back(c);
+        }
+        return !channels.empty();
+    }
+    if (selector.size() > 2 && selector.compare(selector.size() - 2, 2, ".*") == 0)
+        return layerChannels(spec, selector.substr(0, selector.size() - 1), channels);
+    int c = spec.channelindex(selector);
+    if (c >= 0)
+    {
+        channels.push_back(c);
+        return true;
+    }
+    if (layerChannels(spec, selector + ".", channels))
+        return true;
+    for (char letter : selector)
+    {
+        c = spec.channelindex(std::string(1, letter));
+        if (c < 0)
+        {
+            channels.clear();
+            return false;
+        }
+        channels.push_back(c);
+    }
+    return !channels.empty();
+}
+
+bool writeLayerCopy(const std::string& path, const std::vector<std::string>& layers,
+                    const std::vector<const OIIO::ImageBuf*>& denoised, const OIIO::ImageBuf& source,
+                    const OutputSettings& settings)
+{
+    // Name the denoised channels after their layer, keeping their last component e.g. "diffuse.R" -> "layer.R"
+    std::vector<std::unique_ptr<OIIO::ImageBuf>> renamed;
+    std::vector<std::string> added;
+    for (size_t l = 0; l < layers.size(); l++)
+    {
+        std::vector<int> order;
+        std::vector<std::string> names;
+        for (int c = 0; c < denoised[l]->nchannels(); c++)
+        {
+            const std::string name = denoised[l]->spec().channel_name(c);
+            size_t dot = name.find_last_of('.');
+            order.push_back(c);
+            names.push_back(layers[l] + "." + ((dot == std::string::npos) ? name : name.substr(dot + 1)));
+        }
+        renamed.emplace_back(new OIIO::ImageBuf());
+        if (!OIIO::ImageBufAlgo::channels(*renamed[l], *denoised[l], int(order.size()), order, {}, names))
+        {
+            PrintError("Could not add the %s channels", layers[l].c_str());
+            PrintError("[OIIO]: %s", OIIO::geterror().c_str());
+            return false;
+        }
+        added.insert(added.end(), names.begin(), names.end());
+    }
+    auto isAdded = [&added](const std::string& name)
+    {
+        return std::find(added.begin(), added.end(), name) != added.end();
+    };
+    std::vector<int> kept;
+    for (int c = 0; c < source.nchannels(); c++)
+    {
+        if (!isAdded(source.spec().channel_name(c)))
+            kept.push_back(c);
+    }
+    OIIO::ImageBuf merged;
+    if (!OIIO::ImageBufAlgo::channels(merged, source, int(kept.size()), kept))
+    {
+        PrintError("Could not copy the channels of %s", source.name().c_str());
+        PrintError("[OIIO]: %s", OIIO::geterror().c_str());
+        return false;
+    }
+
+    // Layers saved to the file since source was read, or by earlier runs, are kept. It is
+    // read as it is now, not as OIIO's cache may still hold it.
+    std::error_code exists_error;
+    if (std::filesystem::exists(path, exists_error))
+    {
+        OIIO::ImageCache::create(true)->invalidate(OIIO::ustring(path));
+        OIIO::ImageBuf current(path);
+        const OIIO::ROI current_roi = OIIO::get_roi(current.spec());
+        const OIIO::ROI source_roi = OIIO::get_roi(source.spec());
+        std::vector<int> carried;
+        if (current.read(0, 0, true) && current_roi.xbegin == source_roi.xbegin && current_roi.xend == source_roi.xend &&
+            current_roi.ybegin == source_roi.ybegin && current_roi.yend == source_roi.yend)
+        {
+            for (int c = 0; c < current.nchannels(); c++)
+            {
+                const std::string name = current.spec().channel_name(c);
+                if (source.spec().channelindex(name) < 0 && !isAdded(name))
+                    carried.push_back(c);
+            }
+        }
+        OIIO::ImageBuf layer, appended;
+        if (!carried.empty() &&
+            (!OIIO::ImageBufAlgo::channels(layer, current, int(carried.size()), carried) ||
+             !OIIO::ImageBufAlgo::channel_append(appended, merged, layer)))
+        {
+            PrintError("Could not keep the layers already in %s", path.c_str());
+            PrintError("[OIIO]: %s", OIIO::geterror().c_str());
+            return false;
+        }
+        if (!carried.empty())
+            merged.swap(appended);
+    }
+    for (size_t l = 0; l < layers.size(); l++)
+    {
+        OIIO::ImageBuf appended;
+        if (!OIIO::ImageBufAlgo::channel_append(appended, merged, *renamed[l]))
+        {
+            PrintError("Could not add the %s channels", layers[l].c_str());
+            PrintError("[OIIO]: %s", OIIO::geterror().c_str());
+            return false;
+        }
+        merged.swap(appended);
+    }
+
+    // The other parts of a multi-part file are copied unchanged
+    std::vector<OIIO::ImageSpec> specs = { merged.spec() };
+    applyOutputSettings(specs[0], settings);
+    std::vector<std::unique_ptr<OIIO::ImageBuf>> parts;
+    for (int i = 1; i < source.nsubimages(); i++)
+    {
+        parts.emplace_back(new OIIO::ImageBuf(source.name(), i));
+        if (!parts.back()->read(i, 0, true))
+        {
+            PrintError("Could not read part %d of %s", i, source.name().c_str());
+            PrintError("[OIIO]: %s", parts.back()->geterror().c_str());
+            return false;
+        }
+        specs.push_back(parts.back()->spec());
+    }
+
+    auto output = OIIO::ImageOutput::create(path);
+    if (!output)
+    {
+        PrintError("Could not save file %s", path.c_str());
+        PrintError("[OIIO]: %s", OIIO::geterror().c_str());
+        return false;
+    }
+    if (specs.size() > 1 && !output->supports("multiimage"))
+    {
+        PrintInfo("%s can't hold several parts, only the first is saved", output->format_name());
+        specs.resize(1);
+        parts.clear();
+    }
+
+    // Written under a temporary name so the copy can replace the file it was read from
+    const std::string temp_path = path + ".tmp";
+    bool success = output->open(temp_path, int(specs.size()), specs.data()) && merged.write(output.get());
+    for (size_t i = 0; success && i < parts.size(); i++)
+        success = output->open(temp_path, specs[i + 1], OIIO::ImageOutput::AppendSubimage) && parts[i]->write(output.get());
+    success = output->close() && success;
+    std::error_code error;
+    if (success)
+        std::filesystem::rename(temp_path, path, error);
+    if (!success || error)
+    {
+        PrintError("Could not save file %s", path.c_str());
+        PrintError("[OIIO]: %s", output->geterror().c_str());
+        remove(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
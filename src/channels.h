@@ -0,0 +1,31 @@
+#pragma once
+
+#include <OpenImageIO/imagebuf.h>
+#include <string>
+#include <vector>
+
+struct OutputSettings;
+
+// Images can be given as "file.exr:selector" to use some of the channels of a
+// multi-channel file, e.g. "render.exr:RGB", "render.exr:albedo.*" or "render.exr:N".
+// Outputs can be given as "file.exr:layer" to save the result as new channels of a copy
+// of the file the beauty was selected from.
+
+// Splits a path into the file and the channel selector, which is empty if there is none
+void splitChannelSelector(const std::string& path, std::string& file, std::string& selector);
+
+bool hasChannelSelector(const std::string& path);
+
+// Finds the channels of spec named by selector. The selector can be a comma separated list
+// of channel names, a layer name with or without ".*" (e.g. "albedo.*" or "N"), or a run of
+// single letter channel names (e.g. "RGB"). The channels of a layer are ordered RGBA or XYZ.
+bool selectChannels(const OIIO::ImageSpec& spec, const std::string& selector, std::vector<int>& channels);
+
+// Saves a copy of source with the channels of each denoised image added as layer.R, layer.G, ...
+// under the matching name in layers, replacing any channels of the same name. Layers already
+// in the file at path that source doesn't have, such as ones saved by earlier calls, are kept.
+// The other parts of a multi-part file are copied unchanged. path may be the file source was
+// read from. settings sets the compression and data format of the part holding the layers.
+bool writeLayerCopy(const std::string& path, const std::vector<std::string>& layers,
+                    const std::vector<const OIIO::ImageBuf*>& denoised, const OIIO::ImageBuf& source,
+                    const OutputSettings& settings);
@@ -0,0 +1,205 @@
+#include "deadline.h"
+#include "log.h"
+#include "parallel.h"
+#include "resample.h"
+#include "trace.h"
+#include <algorithm>
+#include <sstream>
+#include <string.h>
+
+namespace
+{
+
+void denoiseFast(DeadlineFallbacks& deadlines, const FilterSettings& settings, DenoiseBuffers& buffers)
+{
+    if (!deadlines.fast_filter || !sameFilterParams(settings, deadlines.fast_settings))
+    {
+        deadlines.fast_filter = createFilter(deadlines.device, settings, &deadlines.control);
+        deadlines.fast_filter.set("quality", oidn::Quality::Fast);
+        deadlines.fast_settings = settings;
+        deadlines.fast_images.clear();
+    }
+    // Only committed again when the buffers moved or changed size
+    const std::vector<const void*> images = { buffers.beauty.data(), buffers.has_albedo ? buffers.albedo.data() : nullptr,
+                                              buffers.has_normal ? buffers.normal.data() : nullptr, buffers.output.data() };
+    if (images != deadlines.fast_images || deadlines.fast_width != buffers.width || deadlines.fast_height != buffers.height ||
+        deadlines.fast_channels != buffers.beauty_channels || deadlines.fast_half != buffers.half)
+    {
+        setFilterImages(deadlines.fast_filter, buffers);
+        TraceScope trace("filter commit (fast)");
+        deadlines.fast_filter.commit();
+        deadlines.fast_images = images;
+        deadlines.fast_width = buffers.width;
+        deadlines.fast_height = buffers.height;
+        deadlines.fast_channels = buffers.beauty_channels;
+        deadlines.fast_half = buffers.half;
+    }
+    TraceScope trace("execute (fast)");
+    deadlines.fast_filter.execute();
+}
+
+void denoiseLowRes(DeadlineFallbacks& deadlines, const FilterSettings& settings, DenoiseBuffers& buffers)
+{
+    const int width = (buffers.width + 1) / 2;
+    const int height = (buffers.height + 1) / 2;
+    std::vector<float> full;
+    {
+        TraceScope trace("downsample");
+        readFloat3(buffers.beauty, buffers.beauty_channels, buffers, full);
+        downsample(full, buffers.width, buffers.height, 2, deadlines.lowres_beauty, width, height);
+        if (buffers.has_albedo)
+        {
+            readFloat3(buffers.albedo, 3, buffers, full);
+            downsample(full, buffers.width, buffers.height, 2, deadlines.lowres_albedo_pixels, width, height);
+        }
+        if (buffers.has_normal)
+        {
+            readFloat3(buffers.normal, 3, buffers, full);
+            downsample(full, buffers.width, buffers.height, 2, deadlines.lowres_normal_pixels, width, height);
+        }
+        deadlines.lowres_output.resize(deadlines.lowres_beauty.size());
+    }
+
+    if (!deadlines.lowres_filter || !sameFilterParams(settings, deadlines.lowres_settings))
+    {
+        deadlines.lowres_filter = createFilter(deadlines.device, settings, &deadlines.control);
+        deadlines.lowres_settings = settings;
+        deadlines.lowres_width = 0;
+    }
+    // The buffers keep their allocation at the same size, so only a new size needs a commit
+    if (deadlines.lowres_width != width || deadlines.lowres_height != height ||
+        deadlines.lowres_albedo != buffers.has_albedo || deadlines.lowres_normal != buffers.has_normal)
+    {
+        oidn::FilterRef& filter = deadlines.lowres_filter;
+        filter.setImage("color", deadlines.lowres_beauty.data(), oidn::Format::Float3, width, height);
+        filter.setImage("output", deadlines.lowres_output.data(), oidn::Format::Float3, width, height);
+        if (buffers.has_albedo)
+            filter.setImage("albedo", deadlines.lowres_albedo_pixels.data(), oidn::Format::Float3, width, height);
+        else
+            filter.unsetImage("albedo");
+        if (buffers.has_normal)
+            filter.setImage("normal", deadlines.lowres_normal_pixels.data(), oidn::Format::Float3, width, height);
+        else
+            filter.unsetImage("normal");
+        TraceScope trace("filter commit (lowres)");
+        filter.commit();
+        deadlines.lowres_width = width;
+        deadlines.lowres_height = height;
+        deadlines.lowres_albedo = buffers.has_albedo;
+        deadlines.lowres_normal = buffers.has_normal;
+    }
+    {
+        TraceScope trace("execute (lowres)");
+        deadlines.lowres_filter.execute();
+    }
+    TraceScope trace("upsample");
+    upsample(deadlines.lowres_output, width, height, 2, buffers.width, buffers.height, full);
+    writeOutput(full, buffers);
+}
+
+// Copies the colour channels of the noisy beauty to the output
+void copyNoisy(DenoiseBuffers& buffers)
+{
+    const size_t channel_size = buffers.half ? sizeof(uint16_t) : sizeof(float);
+    const size_t in_pixel = buffers.beauty_channels * channel_size;
+    const size_t out_pixel = 3 * channel_size;
+    parallelFor(0, size_t(buffers.width) * buffers.height, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+            memcpy(&buffers.output[i * out_pixel], &buffers.beauty[i * in_pixel], out_pixel);
+    });
+}
+
+} // namespace
+
+bool parseFallbacks(const std::string& list, std::vector<Fallback>& fallbacks)
+{
+    fallbacks.clear();
+    std::stringstream stream(list);
+    std::string value;
+    while (std::getline(stream, value, ','))
+    {
+        if (value == "fast")
+            fallbacks.push_back(Fallback::Fast);
+        else if (value == "lowres")
+            fallbacks.push_back(Fallback::LowRes);
+        else if (value == "noisy")
+            fallbacks.push_back(Fallback::Noisy);
+        else if (value != "none")
+            return false;
+    }
+    return true;
+}
+
+const char* fallbackName(Fallback fallback)
+{
+    switch (fallback)
+    {
+        case Fallback::Fast: return "fast quality";
+        case Fallback::LowRes: return "half resolution";
+        default: return "noisy input";
+    }
+}
+
+double fallbackReserve(const DeadlineFallbacks& deadlines, const FilterSettings& settings)
+{
+    for (Fallback fallback : settings.fallbacks)
+    {
+        if (fallback == Fallback::Noisy)
+            continue;
+        const double last_ms = (fallback == Fallback::Fast) ? deadlines.fast_ms : deadlines.lowres_ms;
+        return std::min(last_ms > 0.0 ? last_ms : settings.deadline_ms / 4.0, settings.deadline_ms / 2.0);
+    }
+    return 0.0;
+}
+
+bool runFallbacks(DeadlineFallbacks& deadlines, const FilterSettings& settings, DenoiseBuffers& buffers,
+                  long long frame_deadline_ns, double& denoise_ms)
+{
+    for (Fallback fallback : settings.fallbacks)
+    {
+        if (fallback != Fallback::Noisy)
+        {
+            deadlines.control.deadline_ns = frame_deadline_ns;
+            if (deadlines.control.expired())
+            {
+                deadlines.control.clearDeadline();
+                PrintInfo("No time left for the %s fallback", fallbackName(fallback));
+                continue;
+            }
+        }
+        auto start = std::chrono::high_resolution_clock::now();
+        bool finished = true;
+        try
+        {
+            if (fallback == Fallback::Fast)
+                denoiseFast(deadlines, settings, buffers);
+            else if (fallback == Fallback::LowRes)
+                denoiseLowRes(deadlines, settings, buffers);
+            else
+                copyNoisy(buffers);
+        }
+        catch (const DenoiseCancelled&)
+        {
+            if (deadlines.control.cancel || !deadlines.control.expired())
+                throw;
+            finished = false;
+        }
+        deadlines.control.clearDeadline();
+        const double attempt_ms = elapsedMilliseconds(start);
+        if (finished)
+        {
+            PrintInfo("Finished with the %s fallback in %.3f seconds", fallbackName(fallback), attempt_ms / 1000.0);
+            if (fallback == Fallback::Fast)
+                deadlines.fast_ms = attempt_ms;
+            else if (fallback == Fallback::LowRes)
+                deadlines.lowres_ms = attempt_ms;
+            denoise_ms = attempt_ms;
+            return true;
+        }
+        PrintInfo("The %s fallback missed the deadline too, stopped after %.3f seconds", fallbackName(fallback),
+                  attempt_ms / 1000.0);
+    }
+    PrintError("No fallback finished within the deadline");
+    return false;
+}
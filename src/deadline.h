@@ -0,0 +1,53 @@
+#pragma once
+
+#include "frame.h"
+#include <string>
+#include <vector>
+
+// Parses a comma separated list of fallbacks e.g. "fast,lowres,noisy"
+bool parseFallbacks(const std::string& list, std::vector<Fallback>& fallbacks);
+const char* fallbackName(Fallback fallback);
+
+// Finishes frames whose denoise missed its deadline with cheaper paths. The main filter is
+// created with control so its executions stop at the deadline. The fallback filters are
+// created when first needed and kept for later frames.
+struct DeadlineFallbacks
+{
+    oidn::DeviceRef device;
+    ExecutionControl control;
+    // Fast quality filter sharing the frame's buffers, and the images it was committed with
+    oidn::FilterRef fast_filter;
+    FilterSettings fast_settings;
+    std::vector<const void*> fast_images;
+    int fast_width = 0;
+    int fast_height = 0;
+    int fast_channels = 0;
+    bool fast_half = false;
+    // Half resolution filter and its float buffers
+    oidn::FilterRef lowres_filter;
+    FilterSettings lowres_settings;
+    int lowres_width = 0;
+    int lowres_height = 0;
+    bool lowres_albedo = false;
+    bool lowres_normal = false;
+    std::vector<float> lowres_beauty;
+    std::vector<float> lowres_albedo_pixels;
+    std::vector<float> lowres_normal_pixels;
+    std::vector<float> lowres_output;
+    // How long each denoising fallback last took to finish, 0 until it has
+    double fast_ms = 0.0;
+    double lowres_ms = 0.0;
+};
+
+// Time in ms kept back from the main filter's share of the deadline so the first denoising
+// fallback has time to finish: what it took last time, or a quarter of the deadline before
+// it has run. Never more than half the deadline, and 0 if only the noisy input is left.
+double fallbackReserve(const DeadlineFallbacks& deadlines, const FilterSettings& settings);
+
+// Fills buffers.output, which must be separate from the beauty, using each of settings.fallbacks
+// in turn until one finishes. They share what is left of the frame's deadline, frame_deadline_ns
+// as set by ExecutionControl::startDeadline, and those that would start after it are skipped,
+// apart from the noisy input which can't miss it. denoise_ms is set to the time of the one that
+// finished. Returns false if none did. Throws on OIDN errors and when cancelled through control.
+bool runFallbacks(DeadlineFallbacks& deadlines, const FilterSettings& settings, DenoiseBuffers& buffers,
+                  long long frame_deadline_ns, double& denoise_ms);
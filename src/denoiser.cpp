@@ -0,0 +1,315 @@
+#include "denoiser.h"
+#include "frame.h"
+#include "weights.h"
+#include <OpenImageIO/imageio.h>
+#include <exception>
+#include <string.h>
+
+namespace denoiser
+{
+
+namespace
+{
+
+// An image as last given to the filter
+struct Binding
+{
+    const void* data = nullptr;
+    int width = 0;
+    int height = 0;
+    PixelFormat format = PixelFormat::Float;
+    size_t pixel_stride = 0;
+    size_t row_stride = 0;
+
+    bool operator==(const Binding& other) const
+    {
+        return data == other.data && width == other.width && height == other.height && format == other.format &&
+               pixel_stride == other.pixel_stride && row_stride == other.row_stride;
+    }
+    bool operator!=(const Binding& other) const { return !(*this == other); }
+};
+
+Binding bindingOf(const Image* image)
+{
+    Binding binding;
+    if (image)
+    {
+        binding.data = image->data;
+        binding.width = image->width;
+        binding.height = image->height;
+        binding.format = image->format;
+        binding.pixel_stride = image->pixel_stride;
+        binding.row_stride = image->row_stride;
+    }
+    return binding;
+}
+
+bool validImage(const Image& image, const Image& color)
+{
+    return image.data && image.width == color.width && image.height == color.height;
+}
+
+void setImage(oidn::FilterRef& filter, const char* name, const Image& image)
+{
+    const oidn::Format format = (image.format == PixelFormat::Half) ? oidn::Format::Half3 : oidn::Format::Float3;
+    filter.setImage(name, image.data, format, image.width, image.height, 0, image.pixel_stride, image.row_stride);
+}
+
+oidn::Quality oidnQuality(Quality quality)
+{
+    switch (quality)
+    {
+        case Quality::Fast: return oidn::Quality::Fast;
+        case Quality::Balanced: return oidn::Quality::Balanced;
+        case Quality::High: return oidn::Quality::High;
+        default: return oidn::Quality::Default;
+    }
+}
+
+// A filter and what it was last set up with
+struct BoundFilter
+{
+    oidn::FilterRef filter;
+    FilterOptions options;
+    Binding color;
+    Binding albedo;
+    Binding normal;
+    Binding output;
+};
+
+// Stops executions at the deadline, without the logging of the app's callback
+bool deadlineCallback(void* userPtr, double /*n*/)
+{
+    return !((const ExecutionControl*)userPtr)->stopped();
+}
+
+// Sets up the filter for the options and images and commits it, only if something changed
+// since last time as committing is what rebuilds the network
+void bindImages(oidn::DeviceRef& device, BoundFilter& bound, const Image& color, const Image* albedo,
+                const Image* normal, const Image& output, const FilterOptions& options, ExecutionControl& control,
+                bool fast)
+{
+    const bool new_filter = !bound.filter;
+    if (new_filter)
+    {
+        bound.filter = device.newFilter("RT");
+        bound.filter.setProgressMonitorFunction((oidn::ProgressMonitorFunction)deadlineCallback, &control);
+        if (fast)
+            bound.filter.set("quality", oidn::Quality::Fast);
+    }
+    oidn::FilterRef& filter = bound.filter;
+
+    bool changed = new_filter;
+    if (new_filter || options.hdr != bound.options.hdr || options.srgb != bound.options.srgb ||
+        options.clean_aux != bound.options.clean_aux || options.max_memory_mb != bound.options.max_memory_mb ||
+        options.quality != bound.options.quality || options.weights != bound.options.weights)
+    {
+        filter.set("hdr", options.hdr);
+        filter.set("srgb", options.srgb);
+        filter.set("cleanAux", options.clean_aux);
+        if (options.max_memory_mb >= 0)
+            filter.set("maxMemoryMB", options.max_memory_mb);
+        if (!fast)
+            filter.set("quality", oidnQuality(options.quality));
+        if (!options.weights.empty())
+        {
+            WeightsBlob weights = mapWeights(options.weights);
+            filter.setData("weights", (void*)weights.data, weights.size);
+        }
+        else if (!new_filter)
+            filter.unsetData("weights");
+        bound.options = options;
+        changed = true;
+    }
+    if (new_filter || bindingOf(&color) != bound.color)
+    {
+        setImage(filter, "color", color);
+        bound.color = bindingOf(&color);
+        changed = true;
+    }
+    if (new_filter || bindingOf(albedo) != bound.albedo)
+    {
+        if (albedo)
+            setImage(filter, "albedo", *albedo);
+        else
+            filter.unsetImage("albedo");
+        bound.albedo = bindingOf(albedo);
+        changed = true;
+    }
+    if (new_filter || bindingOf(normal) != bound.normal)
+    {
+        if (normal)
+            setImage(filter, "normal", *normal);
+        else
+            filter.unsetImage("normal");
+        bound.normal = bindingOf(normal);
+        changed = true;
+    }
+    if (new_filter || bindingOf(&output) != bound.output)
+    {
+        setImage(filter, "output", output);
+        bound.output = bindingOf(&output);
+        changed = true;
+    }
+    if (changed)
+        filter.commit();
+}
+
+// Executes the filter, returning false if it was stopped at the deadline
+bool executeWithin(oidn::FilterRef& filter, ExecutionControl& control, double deadline_ms)
+{
+    if (deadline_ms > 0.0)
+        control.startDeadline(deadline_ms);
+    else
+        control.clearDeadline();
+    try
+    {
+        filter.execute();
+    }
+    catch (const DenoiseCancelled&)
+    {
+        control.clearDeadline();
+        return false;
+    }
+    control.clearDeadline();
+    return true;
+}
+
+size_t pixelStride(const Image& image)
+{
+    const size_t channel_size = (image.format == PixelFormat::Half) ? 2 : sizeof(float);
+    return image.pixel_stride ? image.pixel_stride : 3 * channel_size;
+}
+
+// Copies the first three channels of each pixel of color to output
+void copyColor(const Image& color, const Image& output)
+{
+    const OIIO::TypeDesc in_type = (color.format == PixelFormat::Half) ? OIIO::TypeDesc::HALF : OIIO::TypeDesc::FLOAT;
+    const OIIO::TypeDesc out_type = (output.format == PixelFormat::Half) ? OIIO::TypeDesc::HALF : OIIO::TypeDesc::FLOAT;
+    const size_t in_pixel = pixelStride(color);
+    const size_t out_pixel = pixelStride(output);
+    const size_t in_row = color.row_stride ? color.row_stride : in_pixel * color.width;
+    const size_t out_row = output.row_stride ? output.row_stride : out_pixel * output.width;
+    for (int y = 0; y < color.height; y++)
+    {
+        const unsigned char* in = (const unsigned char*)color.data + y * in_row;
+        unsigned char* out = (unsigned char*)output.data + y * out_row;
+        for (int x = 0; x < color.width; x++)
+        {
+            if (in_type == out_type)
+                memcpy(out + x * out_pixel, in + x * in_pixel, 3 * out_type.size());
+            else
+                OIIO::convert_pixel_values(in_type, in + x * in_pixel, out_type, out + x * out_pixel, 3);
+        }
+    }
+}
+
+} // namespace
+
+struct Denoiser::State
+{
+    oidn::DeviceRef device;
+    BoundFilter main;
+    // Fast quality filter for the OnDeadline::Fast fallback, created when first needed
+    BoundFilter fast;
+    ExecutionControl control;
+    bool missed_deadline = false;
+    std::string error;
+};
+
+Denoiser::Denoiser()
+    : state(new State())
+{
+}
+
+Denoiser::~Denoiser() = default;
+
+bool Denoiser::init(const DeviceOptions& options)
+{
+    try
+    {
+        state->main = BoundFilter();
+        state->fast = BoundFilter();
+        state->device = createDevice(options.num_threads, options.affinity);
+    }
+    catch (const std::exception& e)
+    {
+        state->error = e.what();
+        return false;
+    }
+    return true;
+}
+
+bool Denoiser::denoise(const Image& color, const Image* albedo, const Image* normal, const Image& output,
+                       const FilterOptions& options)
+{
+    if (!state->device)
+    {
+        state->error = "init() has not been called";
+        return false;
+    }
+    if (!color.data || color.width <= 0 || color.height <= 0)
+    {
+        state->error = "invalid color image";
+        return false;
+    }
+    if ((albedo && !validImage(*albedo, color)) || (normal && !validImage(*normal, color)) || !validImage(output, color))
+    {
+        state->error = "images must all be valid and the same size";
+        return false;
+    }
+    if (normal && !albedo)
+    {
+        state->error = "a normal image needs an albedo image";
+        return false;
+    }
+
+    const bool fallback = options.deadline_ms > 0.0 && options.on_deadline != OnDeadline::Fail;
+    if (fallback && output.data == color.data)
+    {
+        state->error = "a deadline fallback needs an output separate from the color image";
+        return false;
+    }
+
+    state->missed_deadline = false;
+    try
+    {
+        bindImages(state->device, state->main, color, albedo, normal, output, options, state->control, false);
+        if (executeWithin(state->main.filter, state->control, options.deadline_ms))
+            return true;
+        state->missed_deadline = true;
+        if (!fallback)
+        {
+            state->error = "missed the deadline";
+            return false;
+        }
+        if (options.on_deadline == OnDeadline::Fast)
+        {
+            bindImages(state->device, state->fast, color, albedo, normal, output, options, state->control, true);
+            if (executeWithin(state->fast.filter, state->control, options.deadline_ms))
+                return true;
+        }
+        copyColor(color, output);
+    }
+    catch (const std::exception& e)
+    {
+        // Start again with new filters next time
+        state->main = BoundFilter();
+        state->fast = BoundFilter();
+        state->error = e.what();
+        return false;
+    }
+    return true;
+}
+
+bool Denoiser::missedDeadline() const
+{
+    return state->missed_deadline;
+}
+
+const std::string& Denoiser::error() const
+{
+    return state->error;
+}
+
+} // namespace denoiser
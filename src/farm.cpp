@@ -0,0 +1,225 @@
+#include "farm.h"
+#include "log.h"
+#include "trace.h"
+#include "writer.h"
+#include <algorithm>
+#include <deque>
+#include <math.h>
+#include <stdint.h>
+
+namespace
+{
+
+// OIDN works on blocks of this many pixels, so tiles starting on them denoise exactly as the whole frame
+const int tile_alignment = 16;
+
+int alignedSplit(int size, int index, int count)
+{
+    if (index >= count)
+        return size;
+    return std::min(size, (int(int64_t(size) * index / count) / tile_alignment) * tile_alignment);
+}
+
+// Cuts the frame into a grid of about num_tiles tiles of a similar shape to the frame,
+// each padded by margin within the frame
+std::vector<FrameTile> cutTiles(int width, int height, int num_tiles, int margin)
+{
+    const int cols = std::clamp(int(lround(sqrt(double(num_tiles) * width / height))), 1, num_tiles);
+    const int rows = std::max(int(lround(double(num_tiles) / cols)), 1);
+    std::vector<FrameTile> tiles;
+    for (int r = 0; r < rows; r++)
+    {
+        for (int c = 0; c < cols; c++)
+        {
+            FrameTile tile;
+            tile.x = alignedSplit(width, c, cols);
+            tile.y = alignedSplit(height, r, rows);
+            tile.width = alignedSplit(width, c + 1, cols) - tile.x;
+            tile.height = alignedSplit(height, r + 1, rows) - tile.y;
+            if (tile.width <= 0 || tile.height <= 0)
+                continue;
+            tile.padded_x = std::max(tile.x - margin, 0);
+            tile.padded_y = std::max(tile.y - margin, 0);
+            tile.padded_width = std::min(tile.x + tile.width + margin, width) - tile.padded_x;
+            tile.padded_height = std::min(tile.y + tile.height + margin, height) - tile.padded_y;
+            tiles.push_back(tile);
+        }
+    }
+    return tiles;
+}
+
+struct WorkerStats
+{
+    int tiles = 0;
+    double busy_ms = 0.0;
+};
+
+// Denoises the tiles on the running workers of transport, handing each worker the next tile
+// as it finishes. The tiles of a worker that dies are given to the others.
+bool denoiseTiles(TileTransport& transport, int num_workers, const std::vector<FrameTile>& tiles, int margin,
+                  std::vector<WorkerStats>& stats)
+{
+    stats.assign(num_workers, WorkerStats());
+    std::deque<int> pending;
+    for (int t = 0; t < int(tiles.size()); t++)
+        pending.push_back(t);
+    std::vector<bool> alive(num_workers, true);
+    std::vector<bool> busy(num_workers, false);
+    int num_busy = 0;
+    int num_done = 0;
+    bool warned = false;
+    auto assignIdle = [&]()
+    {
+        for (int w = 0; w < num_workers && !pending.empty(); w++)
+        {
+            if (!alive[w] || busy[w])
+                continue;
+            if (transport.send(w, pending.front(), tiles[pending.front()]))
+            {
+                pending.pop_front();
+                busy[w] = true;
+                num_busy++;
+            }
+            else
+                alive[w] = false;
+        }
+    };
+    assignIdle();
+
+    while (num_busy)
+    {
+        TileResult result = { -1, -1, 0, 0, 0.0 };
+        const bool received = transport.receive(result);
+        if (result.worker < 0)
+            return false;
+        busy[result.worker] = false;
+        num_busy--;
+        if (!received)
+        {
+            PrintError("Worker %d exited while denoising tile %d", result.worker, result.tile);
+            alive[result.worker] = false;
+            pending.push_back(result.tile);
+        }
+        else if (!result.success)
+        {
+            PrintError("Worker %d failed to denoise tile %d", result.worker, result.tile);
+            return false;
+        }
+        else
+        {
+            num_done++;
+            stats[result.worker].tiles++;
+            stats[result.worker].busy_ms += result.busy_ms;
+            if (result.overlap > margin && !warned)
+            {
+                PrintInfo("The filter's receptive field of %d pixels is wider than the %d pixel tile margin, so tiles may not join seamlessly",
+                          result.overlap, margin);
+                warned = true;
+            }
+        }
+        assignIdle();
+    }
+    return num_done == int(tiles.size());
+}
+
+} // namespace
+
+int runTileFarm(const std::vector<FrameJob>& jobs, const FarmSettings& farm, const FilterSettings& settings,
+                const OutputSettings& output)
+{
+    const int num_workers = std::max(farm.num_workers, 1);
+    const int num_tiles = (farm.num_tiles > 0) ? farm.num_tiles : 2 * num_workers;
+    // The tile margin is the tile overlap of the workers' filters, known once they have started
+    int margin = 0;
+
+    // The workers are kept from frame to frame, so only the first pays for starting them
+    std::unique_ptr<TileTransport> transport = createProcessTransport(num_workers);
+    std::unique_ptr<TileTransport> single;
+
+    FrameWriter writer(output, false);
+    int num_failed = 0;
+    for (size_t f = 0; f < jobs.size(); f++)
+    {
+        const FrameJob& job = jobs[f];
+        if (jobs.size() > 1)
+            PrintInfo("Frame %d/%d: %s", int(f+1), int(jobs.size()), job.beauty.c_str());
+        TraceScope trace("frame", job.beauty);
+        int width, height;
+        FrameImages images;
+        DenoiseBuffers buffers;
+        if (!openFrame(job, images, width, height))
+        {
+            num_failed++;
+            continue;
+        }
+        // A region is read with enough margin for its edges, once the filter's overlap is known
+        if (images.region != OIIO::get_roi(images.beauty->spec()))
+            padRegion(images, margin > 0 ? margin : default_overlap);
+        if (!readFrame(images, buffers, false, settings))
+        {
+            num_failed++;
+            continue;
+        }
+
+        const int num_started = transport ? transport->start(buffers, settings, margin) : 0;
+        if (!num_started)
+        {
+            PrintError("No workers could be started");
+            num_failed += int(jobs.size() - f);
+            break;
+        }
+        const std::vector<FrameTile> tiles = cutTiles(buffers.width, buffers.height, num_tiles, margin);
+        PrintInfo("Denoising %dx%d in %d tiles on %d workers", buffers.width, buffers.height, int(tiles.size()), num_started);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<WorkerStats> stats;
+        bool success;
+        {
+            TraceScope trace_tiles("tiles");
+            success = denoiseTiles(*transport, num_workers, tiles, margin, stats);
+        }
+        const double farm_ms = elapsedMilliseconds(start);
+        if (!success)
+        {
+            PrintError("Frame %d failed: %s", int(f+1), job.beauty.c_str());
+            num_failed++;
+            // Workers may still be busy with tiles of this frame, so the next one starts afresh
+            transport = createProcessTransport(num_workers);
+            continue;
+        }
+        transport->finish(buffers);
+        PrintInfo("Denoised %d tiles in %.3f seconds", int(tiles.size()), farm_ms / 1000.0);
+        for (int w = 0; w < num_workers; w++)
+        {
+            if (stats[w].tiles)
+                PrintInfo("Worker %d: %d tiles, %.0f%% utilisation", w, stats[w].tiles,
+                          farm_ms > 0.0 ? 100.0 * stats[w].busy_ms / farm_ms : 0.0);
+        }
+
+        // The same frame as one tile in one worker using every core, through the same path
+        if (farm.baseline)
+        {
+            if (!single)
+                single = createProcessTransport(1);
+            const std::vector<FrameTile> whole = cutTiles(buffers.width, buffers.height, 1, 0);
+            std::vector<WorkerStats> single_stats;
+            int single_overlap = 0;
+            bool single_success = single && single->start(buffers, settings, single_overlap) == 1;
+            auto single_start = std::chrono::high_resolution_clock::now();
+            if (single_success && denoiseTiles(*single, 1, whole, 0, single_stats))
+            {
+                const double single_ms = elapsedMilliseconds(single_start);
+                const double speedup = single_ms / farm_ms;
+                PrintInfo("Single process: %.3f seconds, speedup %.2fx on %d workers, %.0f%% scaling efficiency",
+                          single_ms / 1000.0, speedup, num_started, 100.0 * speedup / num_started);
+            }
+            else
+                PrintError("The single process baseline failed");
+        }
+
+        if (!writeFrame(job, images, buffers, &writer))
+            num_failed++;
+    }
+    num_failed += writer.finish();
+    return num_failed;
+}
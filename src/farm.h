@@ -0,0 +1,64 @@
+#pragma once
+
+#include "frame.h"
+#include <memory>
+#include <vector>
+
+// A tile of a frame's buffers: the region a worker denoises and saves, and the padded
+// region around it that is read so its edges match a denoise of the whole frame
+struct FrameTile
+{
+    int x, y, width, height;
+    int padded_x, padded_y, padded_width, padded_height;
+};
+
+// Sent back by a worker after each tile
+struct TileResult
+{
+    int worker;
+    int tile;
+    int success;
+    // tileOverlap of the worker's filter, to check the tiles were padded enough
+    int overlap;
+    double busy_ms;
+};
+
+// Carries tiles to a pool of workers and the denoised pixels back. The workers may share
+// the frame's buffers, as the local processes do, or be sent the pixels they need.
+class TileTransport
+{
+public:
+    virtual ~TileTransport() = default;
+
+    // Gives the workers the frame in buffers, starting them if they aren't running yet. They
+    // are kept for later frames, which must use the same settings. Returns the number
+    // running, and sets overlap to the tile overlap of their filters, the margin tiles need
+    // to join without seams.
+    virtual int start(const DenoiseBuffers& buffers, const FilterSettings& settings, int& overlap) = 0;
+    // Hands a tile to an idle worker. Returns false if the worker has gone.
+    virtual bool send(int worker, int index, const FrameTile& tile) = 0;
+    // Waits for a busy worker to finish its tile. Returns false if the worker died, with
+    // result.worker and result.tile still set.
+    virtual bool receive(TileResult& result) = 0;
+    // Copies the denoised tiles into buffers.output
+    virtual void finish(DenoiseBuffers& buffers) = 0;
+};
+
+// Worker processes on this machine, each pinned to its own share of the cores, reading and
+// writing the frame through shared memory
+std::unique_ptr<TileTransport> createProcessTransport(int num_workers);
+
+struct FarmSettings
+{
+    int num_workers = 0;
+    // Number of tiles to cut each frame into, 0 for twice the number of workers
+    int num_tiles = 0;
+    // Also denoise each frame in a single process to report the scaling efficiency
+    bool baseline = false;
+};
+
+// Denoises each frame by cutting it into overlapping tiles and denoising them in parallel on
+// the workers of a transport. Tiles are padded by the network's receptive field so they join
+// without seams. Returns the number of failed frames.
+int runTileFarm(const std::vector<FrameJob>& jobs, const FarmSettings& farm, const FilterSettings& settings,
+                const OutputSettings& output);
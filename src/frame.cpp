@@ -0,0 +1,1015 @@
+#include "frame.h"
+#include "benchmark.h"
+#include "cache.h"
+#include "channels.h"
+#include "deadline.h"
+#include "log.h"
+#include "parallel.h"
+#include "prefilter.h"
+#include "trace.h"
+#include "weights.h"
+#include "writer.h"
+#include <atomic>
+#include <filesystem>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <OpenImageIO/imagebufalgo.h>
+#include <OpenImageIO/imagecache.h>
+#include <thread>
+#include <stdexcept>
+#include <string.h>
+
+bool convertToFormat(void* in_ptr, void* out_ptr, unsigned int in_channels, unsigned int out_channels,
+                     size_t channel_size)
+{
+    switch (in_channels)
+    {
+        case(1):
+        {
+            switch (out_channels)
+            {
+                case(1):
+                case(2):
+                case(3):
+                case(4): memcpy(out_ptr, in_ptr, channel_size); return true;
+                default: return false; // How has this happened?
+            }
+        }
+        case(2):
+        {
+            switch (out_channels)
+            {
+                case(1): memcpy(out_ptr, in_ptr, channel_size); return true;
+                case(2):
+                case(3):
+                case(4): memcpy(out_ptr, in_ptr, 2 * channel_size);return true;
+                default: return false; // How has this happened?
+            }
+        }
+        case(3):
+        {
+            switch (out_channels)
+            {
+                case(1): memcpy(out_ptr, in_ptr, 1 * channel_size);return true;
+                case(2): memcpy(out_ptr, in_ptr, 2 * channel_size); return true;
+                case(3):
+                case(4): memcpy(out_ptr, in_ptr, 3 * channel_size); return true;
+                default: return false; // How has this happened?
+            }
+        }
+        case(4):
+        {
+            switch (out_channels)
+            {
+                case(1): memcpy(out_ptr, in_ptr, 1 * channel_size); return true;
+                case(2): memcpy(out_ptr, in_ptr, 2 * channel_size); return true;
+                case(3): memcpy(out_ptr, in_ptr, 3 * channel_size); return true;
+                case(4): memcpy(out_ptr, in_ptr, 4 * channel_size); return true;
+                default: return false; // How has this happened?
+            }
+        }
+        default: return false; // How has this happened?
+    }
+    return false; // some unsupported conversion
+}
+
+bool parsePrecision(const std::string& value, PixelPrecision& precision)
+{
+    if (value == "auto")
+        precision = PixelPrecision::Auto;
+    else if (value == "float")
+        precision = PixelPrecision::Float;
+    else if (value == "half")
+        precision = PixelPrecision::Half;
+    else
+        return false;
+    return true;
+}
+
+const char* precisionName(PixelPrecision precision)
+{
+    switch (precision)
+    {
+        case PixelPrecision::Float: return "float";
+        case PixelPrecision::Half: return "half";
+        default: return "auto";
+    }
+}
+
+bool parseQuality(const std::string& value, oidn::Quality& quality)
+{
+    if (value == "default")
+        quality = oidn::Quality::Default;
+    else if (value == "fast")
+        quality = oidn::Quality::Fast;
+    else if (value == "balanced")
+        quality = oidn::Quality::Balanced;
+    else if (value == "high")
+        quality = oidn::Quality::High;
+    else
+        return false;
+    return true;
+}
+
+const char* qualityName(oidn::Quality quality)
+{
+    switch (quality)
+    {
+        case oidn::Quality::Fast: return "fast";
+        case oidn::Quality::Balanced: return "balanced";
+        case oidn::Quality::High: return "high";
+        default: return "default";
+    }
+}
+
+bool sameFilterParams(const FilterSettings& a, const FilterSettings& b)
+{
+    return a.hdr == b.hdr && a.srgb == b.srgb && a.clean_aux == b.clean_aux && a.maxmem == b.maxmem &&
+           a.quality == b.quality && a.weights == b.weights;
+}
+
+bool parseOutputFormat(const std::string& value, OIIO::TypeDesc& format)
+{
+    if (value == "half")
+        format = OIIO::TypeDesc::HALF;
+    else if (value == "float")
+        format = OIIO::TypeDesc::FLOAT;
+    else if (value == "uint8")
+        format = OIIO::TypeDesc::UINT8;
+    else if (value == "uint16")
+        format = OIIO::TypeDesc::UINT16;
+    else
+        return false;
+    return true;
+}
+
+void applyOutputSettings(OIIO::ImageSpec& spec, const OutputSettings& output)
+{
+    if (output.preview > 0)
+        spec.attribute("denoiser:preview", output.preview);
+    if (output.format != OIIO::TypeDesc::UNKNOWN)
+        spec.set_format(output.format);
+    std::string compression = output.compression;
+    if (compression.empty() && output.compression_level >= 0)
+    {
+        // A level on its own applies to the input's compression
+        compression = spec.get_string_attribute("compression");
+        compression = compression.substr(0, compression.find(':'));
+    }
+    if (compression.empty())
+        return;
+    if (output.compression_level >= 0)
+        compression += ":" + std::to_string(output.compression_level);
+    spec.attribute("compression", compression);
+}
+
+bool parseRegion(const std::string& value, OIIO::ROI& roi)
+{
+    int x, y, w, h;
+    char end;
+    if (sscanf(value.c_str(), "%d,%d,%d,%d%c", &x, &y, &w, &h, &end) != 4 || w <= 0 || h <= 0)
+        return false;
+    roi = OIIO::ROI(x, x + w, y, y + h);
+    return true;
+}
+
+size_t bufferBytes(const DenoiseBuffers& buffers)
+{
+    return buffers.beauty.size() + buffers.albedo.size() + buffers.normal.size() + buffers.output.size();
+}
+
+void errorCallback(void* userPtr, oidn::Error error, const char* message)
+{
+    if (error == oidn::Error::Cancelled)
+        throw DenoiseCancelled(message);
+    throw std::runtime_error(message);
+}
+
+bool progressCallback(void* userPtr, double n)
+{
+    traceCounter("OIDN progress (%)", n*100.0);
+    if (verbosity >= 2)
+        PrintInfo("%d%% complete", (int)(n*100.0));
+    const ExecutionControl* control = (const ExecutionControl*)userPtr;
+    return !(control && control->stopped());
+}
+
+oidn::DeviceRef createDevice(int num_threads, bool affinity)
+{
+    // Create our device. We explicitly request the CPU device: the app feeds
+    // OIDN shared images backed by host (OIIO) memory, which GPU devices can't
+    // access. OIDN >= 2.0 would otherwise auto-select a GPU back-end if present.
+    TraceScope trace("device commit");
+    oidn::DeviceRef device = oidn::newDevice(oidn::DeviceType::CPU);
+    const char* errorMessage;
+    if (device.getError(errorMessage) != oidn::Error::None)
+       throw std::runtime_error(errorMessage);
+    device.setErrorFunction(errorCallback);
+    // Set our device parameters
+    if (num_threads)
+        device.set("numThreads", num_threads);
+    if (affinity)
+        device.set("setAffinity", affinity);
+
+    // Commit the changes to the device
+    device.commit();
+    traceCounter("OIDN threads", num_threads ? num_threads : double(std::thread::hardware_concurrency()));
+    return device;
+}
+
+oidn::FilterRef createFilter(oidn::DeviceRef& device, const FilterSettings& settings,
+                             const ExecutionControl* control, WeightsBlob* weights)
+{
+    // Create the AI filter
+    oidn::FilterRef filter = device.newFilter("RT");
+
+    // Set our progress callback
+    filter.setProgressMonitorFunction((oidn::ProgressMonitorFunction)progressCallback, (void*)control);
+
+    // Set our filter paramaters
+    filter.set("hdr", settings.hdr);
+    filter.set("srgb", settings.srgb);
+    if (settings.maxmem >= 0)
+        filter.set("maxMemoryMB", settings.maxmem);
+    filter.set("cleanAux", settings.clean_aux);
+    if (settings.quality != oidn::Quality::Default)
+        filter.set("quality", settings.quality);
+    if (!settings.weights.empty())
+    {
+        // OIDN reads the weights in place rather than copying them
+        WeightsBlob blob = mapWeights(settings.weights);
+        filter.setData("weights", (void*)blob.data, blob.size);
+        if (verbosity >= 2)
+            PrintInfo("Using weights %s (%.1f MB)", settings.weights.c_str(), blob.size / (1024.0 * 1024.0));
+        if (weights)
+            *weights = blob;
+    }
+    return filter;
+}
+
+// Modification time of a file, false if it can't be checked
+bool fileTime(const std::string& path, long long& time)
+{
+    std::error_code error;
+    auto write_time = std::filesystem::last_write_time(path, error);
+    if (error)
+        return false;
+    time = (long long)write_time.time_since_epoch().count();
+    return true;
+}
+
+// Copies the selected channels of a multi-channel file into a new image
+bool selectImage(std::unique_ptr<OIIO::ImageBuf>& image, const std::string& file, const std::string& selector, const char* name,
+                 SourceFiles& sources)
+{
+    // The time is taken before reading, so a file changing during the read is read again next time
+    long long mtime = 0;
+    const bool checked = fileTime(file, mtime);
+    SourceFile& entry = sources[file];
+    if (!entry.image || !checked || entry.mtime != mtime)
+    {
+        TraceScope trace("read", file);
+        entry.image.reset(new OIIO::ImageBuf(file));
+        entry.mtime = checked ? mtime : 0;
+        if (!entry.image->read(0, 0, true))
+        {
+            PrintError("Failed to load %s image", name);
+            PrintError("[OIIO]: %s", entry.image->geterror().c_str());
+            sources.erase(file);
+            return false;
+        }
+    }
+    else if (verbosity >= 2)
+        PrintInfo("Reusing %s, already read", file.c_str());
+    const OIIO::ImageBuf* source = entry.image.get();
+    std::vector<int> channels;
+    if (!selectChannels(source->spec(), selector, channels))
+    {
+        PrintError("No %s channels matching %s in %s", name, selector.c_str(), file.c_str());
+        return false;
+    }
+    image.reset(new OIIO::ImageBuf());
+    if (!OIIO::ImageBufAlgo::channels(*image, *source, int(channels.size()), channels))
+    {
+        PrintError("Failed to select the %s channels", name);
+        PrintError("[OIIO]: %s", image->geterror().c_str());
+        return false;
+    }
+    if (verbosity >= 2)
+        PrintInfo("Selected %d channels", int(channels.size()));
+    return true;
+}
+
+bool loadImage(std::unique_ptr<OIIO::ImageBuf>& image, const std::string& path, const char* name, SourceFiles& sources)
+{
+    if (verbosity >= 2)
+        PrintInfo("%s image: %s", name, path.c_str());
+    std::string file, selector;
+    splitChannelSelector(path, file, selector);
+    if (!selector.empty())
+        return selectImage(image, file, selector, name, sources);
+    TraceScope trace("init_spec", path);
+    image.reset(new OIIO::ImageBuf(path));
+    if (!image->init_spec(path, 0, 0))
+    {
+        PrintError("Failed to load %s image", name);
+        PrintError("[OIIO]: %s", image->geterror().c_str());
+        return false;
+    }
+    if (verbosity >= 2)
+        PrintInfo("Loaded successfully");
+    return true;
+}
+
+// Converts interleaved pixels between channel counts, split across threads
+bool convertPixels(const void* in, void* out, size_t num_pixels, unsigned int in_channels, unsigned int out_channels,
+                   size_t channel_size)
+{
+    TraceScope trace("convert");
+    const unsigned char* in_bytes = (const unsigned char*)in;
+    unsigned char* out_bytes = (unsigned char*)out;
+    const size_t in_pixel = in_channels * channel_size;
+    const size_t out_pixel = out_channels * channel_size;
+    std::atomic<bool> success(true);
+    parallelFor(0, num_pixels, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            if (!convertToFormat((void*)(in_bytes + i * in_pixel), (void*)(out_bytes + i * out_pixel),
+                                 in_channels, out_channels, channel_size))
+            {
+                success = false;
+                return;
+            }
+        }
+    });
+    return success;
+}
+
+// Reads pixels as float and applies transform, fused with the conversion to the buffer's
+// channel count and format so the pixels are only passed over once after decoding
+bool readPreprocessed(OIIO::ImageBuf* image, OIIO::ROI roi, OIIO::TypeDesc format, const PixelTransform& transform,
+                      std::vector<unsigned char>& pixels, int channels, const char* name)
+{
+    const size_t num_pixels = size_t(roi.width()) * roi.height();
+    pixels.resize(num_pixels * channels * format.size());
+    std::vector<float> temp;
+    float* read = (float*)pixels.data();
+    if (format != OIIO::TypeDesc::FLOAT || roi.nchannels() != channels)
+    {
+        temp.resize(num_pixels * roi.nchannels());
+        read = temp.data();
+    }
+    if (!image->get_pixels(roi, OIIO::TypeDesc::FLOAT, read))
+    {
+        PrintError("Failed to read %s pixels", name);
+        PrintError("[OIIO]: %s", image->geterror().c_str());
+        return false;
+    }
+    if (temp.empty())
+        preprocessPixels(read, num_pixels, channels, transform);
+    else
+        preprocessConvert(read, pixels.data(), num_pixels, roi.nchannels(), channels, format, transform);
+    return true;
+}
+
+// Reads the pixels of an image for the filter. Images with at least three channels are
+// read in their original interleaved layout (only the first three channels unless
+// all_channels is set) and given to OIDN with a pixel stride, so no repacking is needed.
+// Images with fewer channels are converted to three channels. channels is set to the number
+// of values per pixel in the returned buffer, which holds values of the given format.
+bool readPixels(OIIO::ImageBuf* image, OIIO::ROI roi, bool all_channels, OIIO::TypeDesc format,
+                const PixelTransform& transform, std::vector<unsigned char>& pixels, int& channels, const char* name)
+{
+    TraceScope trace("get_pixels", name);
+    const size_t num_pixels = size_t(roi.width()) * roi.height();
+    const size_t channel_size = format.size();
+    if (roi.nchannels() >= 3 && !all_channels)
+        roi.chend = roi.chbegin + 3;
+    if (!transform.identity())
+    {
+        channels = std::max(roi.nchannels(), 3);
+        return readPreprocessed(image, roi, format, transform, pixels, channels, name);
+    }
+    if (roi.nchannels() >= 3)
+    {
+        channels = roi.nchannels();
+        pixels.resize(num_pixels * channels * channel_size);
+        if (!image->get_pixels(roi, format, &pixels[0]))
+        {
+            PrintError("Failed to read %s pixels", name);
+            PrintError("[OIIO]: %s", image->geterror().c_str());
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<unsigned char> temp(num_pixels * roi.nchannels() * channel_size);
+    if (!image->get_pixels(roi, format, &temp[0]))
+    {
+        PrintError("Failed to read %s pixels", name);
+        PrintError("[OIIO]: %s", image->geterror().c_str());
+        return false;
+    }
+    channels = 3;
+    pixels.assign(num_pixels * 3 * channel_size, 0);
+    if (!convertPixels(temp.data(), pixels.data(), num_pixels, roi.nchannels(), 3, channel_size))
+    {
+        PrintError("Failed to convert %s to three channels", name);
+        return false;
+    }
+    return true;
+}
+
+// Reads the pixels of a layer and logs how long it took. Layers are read concurrently.
+bool readLayer(OIIO::ImageBuf* image, OIIO::ROI roi, bool all_channels, OIIO::TypeDesc format,
+               PixelTransform transform, std::vector<unsigned char>& pixels, int& channels, const char* name)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    if (!readPixels(image, roi, all_channels, format, transform, pixels, channels, name))
+        return false;
+    if (verbosity >= 2)
+        PrintInfo("Read %s pixels in %.3f seconds", name, elapsedMilliseconds(start) / 1000.0);
+    return true;
+}
+
+// Whether to denoise the loaded frame in half precision. Auto only picks half when
+// every layer is stored as half, so converting never loses precision.
+bool useHalf(const FrameImages& images, PixelPrecision precision)
+{
+    if (precision != PixelPrecision::Auto)
+        return precision == PixelPrecision::Half;
+    for (const OIIO::ImageBuf* image : { images.beauty.get(), images.albedo.get(), images.normal.get() })
+    {
+        if (image && image->spec().format != OIIO::TypeDesc::HALF)
+            return false;
+    }
+    return true;
+}
+
+// Identifies an image by its path, channel selector included, and the modification time of
+// its file. Empty if the file can't be checked.
+std::string imageSource(const std::string& path)
+{
+    std::string file, selector;
+    splitChannelSelector(path, file, selector);
+    long long mtime = 0;
+    if (!fileTime(file, mtime))
+        return std::string();
+    return path + "|" + std::to_string(mtime);
+}
+
+// Identifies the AOVs of the loaded frame. Empty if there are no AOVs or a file can't be checked.
+std::string auxSource(const FrameImages& images)
+{
+    if ((images.albedo && images.albedo_source.empty()) || (images.normal && images.normal_source.empty()))
+        return std::string();
+    return images.albedo_source + "|" + images.normal_source + "|";
+}
+
+bool openFrame(const FrameJob& job, FrameImages& images, int& width, int& height, SourceFiles* sources)
+{
+    const bool a_loaded = !job.albedo.empty();
+    const bool n_loaded = !job.normal.empty();
+
+    // If a normal AOV is loaded then we also require an albedo AOV
+    if (n_loaded && !a_loaded)
+    {
+        PrintError("You cannot use a normal AOV without an albedo");
+        return false;
+    }
+
+    // Check for a file extension. Benchmarks don't save their output.
+    std::string output_file, output_layer;
+    splitChannelSelector(job.output, output_file, output_layer);
+    int x = (int)output_file.find_last_of(".");
+    x++;
+    const char* ext_c = output_file.c_str()+x;
+    std::string ext(ext_c);
+    if (!job.output.empty() && !ext.size())
+    {
+        PrintError("No output file extension");
+        return false;
+    }
+    std::string beauty_file, beauty_selector;
+    splitChannelSelector(job.beauty, beauty_file, beauty_selector);
+    if (!output_layer.empty() && beauty_selector.empty())
+    {
+        PrintError("Saving the output as a layer needs the input to be channels of a file e.g. -i render.exr:RGB");
+        return false;
+    }
+
+    images = FrameImages();
+    SourceFiles frame_sources;
+    if (!sources)
+        sources = &frame_sources;
+    std::string albedo_file, normal_file, selector;
+    splitChannelSelector(job.albedo, albedo_file, selector);
+    splitChannelSelector(job.normal, normal_file, selector);
+    // An input this job also saves to is changed by the writer, so it's always read fresh
+    if (!output_file.empty() &&
+        (output_file == beauty_file || output_file == albedo_file || output_file == normal_file))
+    {
+        if (sources->erase(output_file) && verbosity >= 2)
+            PrintInfo("Reading %s again, it's also the output", output_file.c_str());
+        OIIO::ImageCache::create(true)->invalidate(OIIO::ustring(output_file));
+    }
+    // Taken before the AOVs are read, so AOVs changing during the read are read again next time
+    if (a_loaded)
+        images.albedo_source = imageSource(job.albedo);
+    if (n_loaded)
+        images.normal_source = imageSource(job.normal);
+    if (!loadImage(images.beauty, job.beauty, "Input", *sources))
+        return false;
+    if (a_loaded && !loadImage(images.albedo, job.albedo, "Albedo", *sources))
+        return false;
+    if (n_loaded && !loadImage(images.normal, job.normal, "Normal", *sources))
+        return false;
+    // Keep the beauty's file to add the denoised layer to
+    if (!output_layer.empty())
+        images.source = (*sources)[beauty_file].image;
+
+    // Only the files of this frame are kept for the next
+    for (auto it = sources->begin(); it != sources->end();)
+    {
+        if (it->first != beauty_file && it->first != albedo_file && it->first != normal_file)
+            it = sources->erase(it);
+        else
+            ++it;
+    }
+
+    OIIO::ROI beauty_roi, albedo_roi, normal_roi;
+    beauty_roi = OIIO::get_roi_full(images.beauty->spec());
+    int b_width = beauty_roi.width();
+    int b_height = beauty_roi.height();
+    if (a_loaded)
+    {
+        albedo_roi = OIIO::get_roi_full(images.albedo->spec());
+        if (n_loaded)
+            normal_roi = OIIO::get_roi_full(images.normal->spec());
+    }
+
+    // Check that our feature buffers are the same resolution as our beauty
+    if (a_loaded)
+    {
+        if (albedo_roi.width() != b_width || albedo_roi.height() != b_height)
+        {
+            PrintError("Aldedo image not same resolution as beauty");
+            return false;
+        }
+    }
+
+    if (n_loaded)
+    {
+        if (normal_roi.width() != b_width || normal_roi.height() != b_height)
+        {
+            PrintError("Normal image not same resolution as beauty");
+            return false;
+        }
+    }
+
+    // Denoise the data window, or the part of it in the requested region
+    const OIIO::ImageSpec& spec = images.beauty->spec();
+    images.region = OIIO::get_roi(spec);
+    if (job.roi.defined())
+    {
+        OIIO::ROI requested = job.roi;
+        requested.xbegin += spec.full_x;
+        requested.xend += spec.full_x;
+        requested.ybegin += spec.full_y;
+        requested.yend += spec.full_y;
+        images.region = OIIO::roi_intersection(images.region, requested);
+        if (!images.region.defined() || images.region.width() <= 0 || images.region.height() <= 0)
+        {
+            PrintError("The region to denoise is outside the image");
+            return false;
+        }
+    }
+    images.region.chbegin = 0;
+    images.region.chend = spec.nchannels;
+    images.padded = images.region;
+    if (verbosity >= 2 && (images.region.width() != b_width || images.region.height() != b_height))
+        PrintInfo("Denoising region %d,%d %dx%d of %dx%d", images.region.xbegin - spec.full_x,
+                  images.region.ybegin - spec.full_y, images.region.width(), images.region.height(), b_width, b_height);
+    width = images.region.width();
+    height = images.region.height();
+    return true;
+}
+
+// Adds a margin of overlap pixels around the region, within the data window
+void padRegion(FrameImages& images, int overlap)
+{
+    const OIIO::ROI data = OIIO::get_roi(images.beauty->spec());
+    images.padded = images.region;
+    images.padded.xbegin = std::max(images.region.xbegin - overlap, data.xbegin);
+    images.padded.xend = std::min(images.region.xend + overlap, data.xend);
+    images.padded.ybegin = std::max(images.region.ybegin - overlap, data.ybegin);
+    images.padded.yend = std::min(images.region.yend + overlap, data.yend);
+}
+
+bool readFrame(const FrameImages& images, DenoiseBuffers& buffers, bool in_place, const FilterSettings& settings)
+{
+    const bool a_loaded = images.albedo != nullptr;
+    const bool n_loaded = images.normal != nullptr;
+
+    // Only the padded region is read, so the time taken scales with its size
+    OIIO::ROI beauty_roi, albedo_roi, normal_roi;
+    beauty_roi = images.padded;
+    int b_width = beauty_roi.width();
+    int b_height = beauty_roi.height();
+    if (a_loaded)
+    {
+        albedo_roi = images.padded;
+        albedo_roi.chend = images.albedo->spec().nchannels;
+    }
+    if (n_loaded)
+    {
+        normal_roi = images.padded;
+        normal_roi.chend = images.normal->spec().nchannels;
+    }
+
+    const bool half = useHalf(images, settings.precision);
+    const PreprocessSettings& preprocess = settings.preprocess;
+    const OIIO::TypeDesc format = half ? OIIO::TypeDesc::HALF : OIIO::TypeDesc::FLOAT;
+    if (verbosity >= 2)
+        PrintInfo("Denoising in %s precision", half ? "half" : "float");
+
+    // Get our pixel data. The buffers keep their allocation between frames of the
+    // same resolution and layout so the pointers given to the filter stay valid.
+    // Each layer is decoded on its own thread. AOVs from the same unchanged files as the
+    // previous frame, e.g. for light groups sharing one albedo and normal, are kept.
+    auto read_start = std::chrono::high_resolution_clock::now();
+    std::string aux_source = auxSource(images);
+    if (!aux_source.empty())
+        aux_source += std::to_string(beauty_roi.xbegin) + "," + std::to_string(beauty_roi.ybegin) + "," +
+                      std::to_string(b_width) + "," + std::to_string(b_height) + "|" +
+                      std::to_string(int(preprocess.sanitize)) + std::to_string(int(preprocess.normal_remap));
+    const bool read_aux = aux_source.empty() || aux_source != buffers.aux_source || half != buffers.half;
+    if (read_aux)
+    {
+        buffers.aux_source.clear();
+        buffers.aux_prefiltered = false;
+    }
+    else if (verbosity >= 2)
+        PrintInfo("Reusing the AOVs of the previous frame");
+    int beauty_channels = 0, albedo_channels = 0, normal_channels = 0;
+    std::future<bool> albedo_read, normal_read;
+    if (a_loaded && read_aux)
+        albedo_read = std::async(std::launch::async, readLayer, images.albedo.get(), albedo_roi, false, format,
+                                 layerTransform(preprocess, InputLayer::Albedo), std::ref(buffers.albedo),
+                                 std::ref(albedo_channels), "albedo");
+    if (n_loaded && read_aux)
+        normal_read = std::async(std::launch::async, readLayer, images.normal.get(), normal_roi, false, format,
+                                 layerTransform(preprocess, InputLayer::Normal), std::ref(buffers.normal),
+                                 std::ref(normal_channels), "normal");
+    bool read_success = readLayer(images.beauty.get(), beauty_roi, true, format, layerTransform(preprocess, InputLayer::Beauty),
+                                  buffers.beauty, beauty_channels, "beauty");
+    if (albedo_read.valid() && !albedo_read.get())
+        read_success = false;
+    if (normal_read.valid() && !normal_read.get())
+        read_success = false;
+    if (!read_success)
+        return false;
+    if (read_aux)
+        buffers.aux_source = aux_source;
+    if (verbosity >= 2 && read_aux && (a_loaded || n_loaded))
+        PrintInfo("Read all layers in %.3f seconds", elapsedMilliseconds(read_start) / 1000.0);
+
+    // OIDN supports in-place filtering, so when the beauty is kept in its original
+    // layout the result is written straight back over its colour channels (leaving
+    // any alpha untouched). Otherwise it needs a separate three channel output buffer.
+    in_place = in_place && beauty_roi.nchannels() >= 3;
+    if (in_place)
+        buffers.output = std::vector<unsigned char>();
+    else
+        buffers.output.resize(size_t(b_width) * b_height * 3 * format.size());
+    if (verbosity >= 2)
+        PrintInfo("Pixel buffers use %.1f MB", bufferBytes(buffers) / (1024.0 * 1024.0));
+
+    if (buffers.width != b_width || buffers.height != b_height || buffers.channels != beauty_roi.nchannels() ||
+        buffers.beauty_channels != beauty_channels || buffers.in_place != in_place ||
+        buffers.has_albedo != a_loaded || buffers.has_normal != n_loaded || buffers.half != half)
+    {
+        buffers.width = b_width;
+        buffers.height = b_height;
+        buffers.channels = beauty_roi.nchannels();
+        buffers.beauty_channels = beauty_channels;
+        buffers.in_place = in_place;
+        buffers.has_albedo = a_loaded;
+        buffers.has_normal = n_loaded;
+        buffers.half = half;
+        buffers.dirty = true;
+    }
+    return true;
+}
+
+void setFilterImages(oidn::FilterRef& filter, const DenoiseBuffers& buffers)
+{
+    const int b_width = buffers.width;
+    const int b_height = buffers.height;
+    const oidn::Format format = buffers.half ? oidn::Format::Half3 : oidn::Format::Float3;
+    const size_t beauty_stride = buffers.beauty_channels * (buffers.half ? sizeof(uint16_t) : sizeof(float));
+    filter.setImage("color", (void*)&buffers.beauty[0], format, b_width, b_height, 0, beauty_stride);
+    if (buffers.has_albedo)
+        filter.setImage("albedo", (void*)&buffers.albedo[0], format, b_width, b_height);
+    else
+        filter.unsetImage("albedo");
+    if (buffers.has_normal)
+        filter.setImage("normal", (void*)&buffers.normal[0], format, b_width, b_height);
+    else
+        filter.unsetImage("normal");
+    if (buffers.in_place)
+        filter.setImage("output", (void*)&buffers.beauty[0], format, b_width, b_height, 0, beauty_stride);
+    else
+        filter.setImage("output", (void*)&buffers.output[0], format, b_width, b_height);
+}
+
+void bindFilter(oidn::FilterRef& filter, DenoiseBuffers& buffers)
+{
+    if (!buffers.dirty)
+        return;
+
+    // Set our the filter images
+    setFilterImages(filter, buffers);
+
+    // Commit changes to the filter
+    TraceScope trace("filter commit");
+    filter.commit();
+    buffers.overlap = filter.get<int>("tileOverlap");
+    buffers.dirty = false;
+}
+
+// A denoised frame handed to a background writer, which holds its own copy of the pixels
+struct FrameToSave
+{
+    FrameImages images;
+    std::unique_ptr<OIIO::ImageBuf> existing;
+};
+
+// Logs a save, with the throughput of the uncompressed pixels so it shows the cost of the compression
+void logSaved(const std::string& path, const std::string& file, double write_ms, double pixel_bytes)
+{
+    const double write_s = write_ms / 1000.0;
+    const double pixel_mb = pixel_bytes / (1024.0 * 1024.0);
+    std::error_code error;
+    const double file_mb = double(std::filesystem::file_size(file, error)) / (1024.0 * 1024.0);
+    PrintInfo("Saved %s in %.3f seconds (%.1f MB/s, %.1f MB on disk)", path.c_str(), write_s,
+              write_s > 0.0 ? pixel_mb / write_s : 0.0, error ? 0.0 : file_mb);
+    PrintInfo("Done!");
+}
+
+// Saves target as the output image
+bool saveFrame(const std::string& path, OIIO::ImageBuf& target, const OutputSettings& output)
+{
+    TraceScope trace("write", path);
+    auto start = std::chrono::high_resolution_clock::now();
+    // If the image already exists delete it
+    remove(path.c_str());
+    OIIO::ImageSpec spec = target.spec();
+    applyOutputSettings(spec, output);
+    auto out = OIIO::ImageOutput::create(path);
+    bool success = out && out->open(path, spec);
+    success = success && target.write(out.get());
+    success = success && out->close();
+    if (!success)
+    {
+        PrintError("Could not save file %s", path.c_str());
+        PrintError("[OIIO]: %s", out ? out->geterror().c_str() : OIIO::geterror().c_str());
+        return false;
+    }
+    logSaved(path, path, elapsedMilliseconds(start), double(target.spec().image_bytes()));
+    return true;
+}
+
+bool saveLayers(const LayerFile& file, const OutputSettings& output)
+{
+    TraceScope trace("write", file.path);
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<const OIIO::ImageBuf*> layers;
+    std::string label = file.path;
+    double pixel_bytes = 0.0;
+    for (size_t l = 0; l < file.layers.size(); l++)
+    {
+        layers.push_back(file.layers[l].get());
+        label += (l ? "," : ":") + file.names[l];
+        pixel_bytes += double(file.layers[l]->spec().image_bytes());
+    }
+    if (!writeLayerCopy(file.path, file.names, layers, *file.source, output))
+        return false;
+    logSaved(label, file.path, elapsedMilliseconds(start), pixel_bytes);
+    return true;
+}
+
+bool writeFrame(const FrameJob& job, FrameImages& images, DenoiseBuffers& buffers, FrameWriter* writer)
+{
+    std::string output_file, output_layer;
+    splitChannelSelector(job.output, output_file, output_layer);
+
+    // Set our OIIO pixels, converting the image back to the original format if needed
+    // The image keeps the format it was loaded with, so half inputs are saved as half
+    const OIIO::TypeDesc format = buffers.half ? OIIO::TypeDesc::HALF : OIIO::TypeDesc::FLOAT;
+    std::vector<unsigned char> beauty_pixels;
+    unsigned char* result = buffers.beauty.data();
+    if (!buffers.in_place)
+    {
+        // Images read in their original layout are updated in place so their alpha is kept
+        if (buffers.beauty_channels != buffers.channels)
+        {
+            beauty_pixels.resize(size_t(buffers.width) * buffers.height * buffers.channels * format.size());
+            result = beauty_pixels.data();
+        }
+        if (!convertPixels(buffers.output.data(), result, size_t(buffers.width) * buffers.height, 3, buffers.channels,
+                           format.size()))
+        {
+            PrintError("Failed to convert output to original format");
+            return false;
+        }
+    }
+
+    // Only the region is saved, without the margin. A region that doesn't cover the
+    // image is composited into the existing output, if there is one.
+    OIIO::ImageBuf* target = images.beauty.get();
+    std::unique_ptr<OIIO::ImageBuf> existing;
+    const OIIO::ROI& region = images.region;
+    if (output_layer.empty() && region != OIIO::get_roi(images.beauty->spec()))
+    {
+        existing.reset(new OIIO::ImageBuf(output_file));
+        if (existing->read(0, 0, true) && existing->nchannels() == buffers.channels &&
+            OIIO::roi_intersection(region, OIIO::get_roi(existing->spec())) == region)
+            target = existing.get();
+        else
+            PrintInfo("No existing output to add the region to, the rest of the image is saved as it was");
+    }
+    {
+        TraceScope trace("set_pixels");
+        const size_t pixel_bytes = buffers.channels * format.size();
+        const size_t row_bytes = pixel_bytes * buffers.width;
+        const unsigned char* start = result + (region.ybegin - images.padded.ybegin) * row_bytes +
+                                     (region.xbegin - images.padded.xbegin) * pixel_bytes;
+        if (!target->set_pixels(region, format, start, pixel_bytes, row_bytes))
+            PrintError("Something went wrong setting pixels");
+    }
+
+    PrintInfo("Saving to: %s", job.output.c_str());
+    if (!output_layer.empty())
+    {
+        // The beauty now holds the denoised layer, and is kept by the writer until its file is saved
+        std::shared_ptr<OIIO::ImageBuf> layer(std::move(images.beauty));
+        if (writer)
+            return writer->addLayer(output_file, output_layer, images.source, layer);
+        LayerFile file;
+        file.path = output_file;
+        file.source = images.source;
+        file.names.push_back(output_layer);
+        file.layers.push_back(layer);
+        return saveLayers(file, OutputSettings());
+    }
+    if (!writer)
+        return saveFrame(output_file, *target, OutputSettings());
+    if (!writer->background())
+        return saveFrame(output_file, *target, writer->settings());
+
+    // The pixels are now held by the images, so buffers can be reused while the file is saved
+    auto frame = std::make_shared<FrameToSave>();
+    frame->images = std::move(images);
+    frame->existing = std::move(existing);
+    const OutputSettings output = writer->settings();
+    return writer->submit([frame, target, output_file, output]()
+    {
+        return saveFrame(output_file, *target, output);
+    });
+}
+
+bool denoiseFrame(const FrameJob& job, FrameImages& images, oidn::FilterRef& filter, DenoiseBuffers& buffers, const FilterSettings& settings,
+                  unsigned int num_runs, unsigned int num_warmup, double& denoise_ms,
+                  AuxPrefilter* prefilter, FrameWriter* writer, DeadlineFallbacks* deadlines, ResultCache* results)
+{
+    // The deadline covers reading the frame as well as denoising it
+    auto frame_start = std::chrono::high_resolution_clock::now();
+    const bool deadline = deadlines && settings.deadline_ms > 0.0;
+    long long frame_deadline_ns = 0;
+    if (deadline)
+    {
+        // The fallbacks share the one budget, so the main filter stops early enough to leave
+        // the first of them time to finish
+        deadlines->control.startDeadline(settings.deadline_ms);
+        frame_deadline_ns = deadlines->control.deadline_ns;
+        deadlines->control.deadline_ns = frame_deadline_ns - (long long)(fallbackReserve(*deadlines, settings) * 1e6);
+    }
+    else if (deadlines)
+        deadlines->control.clearDeadline();
+
+    // A region is read with enough margin for its edges, once the filter's overlap is known
+    if (images.region != OIIO::get_roi(images.beauty->spec()))
+        padRegion(images, buffers.overlap > 0 ? buffers.overlap : default_overlap);
+
+    // Repeated runs need the input left unmodified so each run denoises the same image,
+    // as do the fallbacks after a missed deadline
+    if (!readFrame(images, buffers, num_runs + num_warmup == 1 && !deadline, settings))
+        return false;
+
+    // Catch exceptions
+    try
+    {
+        // Past the deadline the prefilters and the execution stop and a fallback finishes the frame
+        bool missed = false;
+        if (prefilter)
+        {
+            try
+            {
+                prefilterAux(*prefilter, buffers);
+            }
+            catch (const DenoiseCancelled&)
+            {
+                if (!deadline || deadlines->control.cancel || !deadlines->control.expired())
+                    throw;
+                // The AOVs are left partly prefiltered, so they are read again for the next frame
+                buffers.aux_source.clear();
+                missed = true;
+            }
+        }
+
+        // Timed runs always execute the filter. A cached result doesn't need the filter committed.
+        const bool use_results = results && num_runs + num_warmup == 1;
+        ResultKey result_key;
+        bool cached = false;
+        if (use_results && !missed)
+        {
+            auto load_start = std::chrono::high_resolution_clock::now();
+            result_key = resultKey(*results, buffers, settings);
+            cached = loadResult(*results, result_key, buffers);
+            if (cached)
+            {
+                results->hits++;
+                denoise_ms = elapsedMilliseconds(load_start);
+                if (deadline)
+                    deadlines->control.clearDeadline();
+            }
+            else
+                results->misses++;
+        }
+
+        if (!cached)
+        {
+            // Execute denoise
+            std::vector<double> run_ms;
+            if (!missed)
+            {
+                bindFilter(filter, buffers);
+                try
+                {
+                    run_ms = timeExecute(filter, num_warmup, num_runs);
+                }
+                catch (const DenoiseCancelled&)
+                {
+                    if (!deadline || deadlines->control.cancel || !deadlines->control.expired())
+                        throw;
+                    missed = true;
+                }
+            }
+            if (deadline)
+                deadlines->control.clearDeadline();
+            if (missed)
+            {
+                PrintInfo("Stopped after %.3f seconds to keep within the deadline of %.0f ms",
+                          elapsedMilliseconds(frame_start) / 1000.0, settings.deadline_ms);
+                if (!runFallbacks(*deadlines, settings, buffers, frame_deadline_ns, denoise_ms))
+                    return false;
+            }
+            else
+            {
+                TimingStats stats = computeTimingStats(run_ms);
+                denoise_ms = stats.median_ms;
+                if (num_runs > 1)
+                    PrintInfo("Denoising %d runs: min %.3f, median %.3f, p95 %.3f, max %.3f, mean %.3f seconds", stats.runs,
+                              stats.min_ms / 1000.0, stats.median_ms / 1000.0, stats.p95_ms / 1000.0,
+                              stats.max_ms / 1000.0, stats.mean_ms / 1000.0);
+                if (deadline && verbosity >= 2)
+                    PrintInfo("Denoised within the deadline in %.3f seconds", elapsedMilliseconds(frame_start) / 1000.0);
+                // Results of the fallbacks are not kept
+                if (use_results)
+                    storeResult(*results, result_key, buffers);
+            }
+        }
+    }
+    catch (const DenoiseCancelled&)
+    {
+        PrintInfo("Denoising cancelled");
+        // The filter stays committed, but the AOVs may have been partly prefiltered
+        buffers.aux_source.clear();
+        return false;
+    }
+    catch (const std::exception& e)
+    {
+        PrintError("[OIDN]: %s", e.what());
+        // Force the images to be set again and the AOVs read again on the next frame
+        buffers.dirty = true;
+        buffers.aux_source.clear();
+        return false;
+    }
+
+    return writeFrame(job, images, buffers, writer);
+}
@@ -0,0 +1,266 @@
+#pragma once
+
+#include "preprocess.h"
+#include <OpenImageDenoise/oidn.hpp>
+#include <OpenImageIO/imagebuf.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// A single frame of work: input paths and where to save the result
+struct FrameJob
+{
+    std::string beauty;
+    std::string albedo;
+    std::string normal;
+    std::string output;
+    // Region to denoise, in pixels from the top left of the display window. The whole
+    // data window is denoised when this is undefined.
+    OIIO::ROI roi;
+};
+
+struct AuxPrefilter;
+struct DeadlineFallbacks;
+struct ResultCache;
+struct WeightsBlob;
+class FrameWriter;
+
+// Margin of context used around bands and regions until the filter reports its tileOverlap
+const int default_overlap = 128;
+
+// The images of a frame opened with openFrame
+struct FrameImages
+{
+    std::unique_ptr<OIIO::ImageBuf> beauty;
+    std::unique_ptr<OIIO::ImageBuf> albedo;
+    std::unique_ptr<OIIO::ImageBuf> normal;
+    // The multi-channel file the beauty was selected from, when the output is saved as a layer of it
+    std::shared_ptr<OIIO::ImageBuf> source;
+    // The albedo and normal paths with the modification times of their files, so unchanged
+    // AOVs aren't read again. Empty when a file can't be checked.
+    std::string albedo_source;
+    std::string normal_source;
+    // The part of the image to denoise and save, and the part read for it, which has a
+    // margin around the region so its edges denoise as they would in the whole image
+    OIIO::ROI region;
+    OIIO::ROI padded;
+};
+
+// A multi-channel file read for some of its channels, and its modification time
+struct SourceFile
+{
+    std::shared_ptr<OIIO::ImageBuf> image;
+    long long mtime = 0;
+};
+
+// The multi-channel files of the last frame opened, so layers selecting channels of the
+// same file only decode it once. Files are read again when they change on disk.
+typedef std::map<std::string, SourceFile> SourceFiles;
+
+// Pixel format the images are given to OIDN in. Auto keeps half inputs as
+// half (Half3) and uses float (Float3) for everything else.
+enum class PixelPrecision
+{
+    Auto,
+    Float,
+    Half
+};
+
+// Cheaper ways to finish a frame that missed its deadline: the fast quality preset,
+// denoising at half resolution, or saving the noisy input
+enum class Fallback
+{
+    Fast,
+    LowRes,
+    Noisy
+};
+
+// Parameters of the RT filter
+struct FilterSettings
+{
+    bool hdr = true;
+    bool srgb = false;
+    bool clean_aux = false;
+    int maxmem = -1;
+    // OIDN quality preset, trading quality for speed
+    oidn::Quality quality = oidn::Quality::Default;
+    // Custom weights (.tza) used instead of the built in ones, empty for none
+    std::string weights;
+    PixelPrecision precision = PixelPrecision::Auto;
+    // Applied to the inputs as they are read
+    PreprocessSettings preprocess;
+    // Time allowed to denoise a frame in ms, 0 for no limit, and the fallbacks to try in order when it is missed
+    double deadline_ms = 0.0;
+    std::vector<Fallback> fallbacks = { Fallback::Noisy };
+};
+
+// Stops running executions from the progress callback, when cancelled from another
+// thread or once a deadline has passed
+struct ExecutionControl
+{
+    std::atomic<bool> cancel{false};
+    // steady_clock time in nanoseconds after which executions stop, 0 for none
+    std::atomic<long long> deadline_ns{0};
+
+    void startDeadline(double ms)
+    {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        deadline_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() + (long long)(ms * 1e6);
+    }
+    void clearDeadline() { deadline_ns = 0; }
+    bool expired() const
+    {
+        const long long deadline = deadline_ns;
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return deadline && std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() > deadline;
+    }
+    bool stopped() const { return cancel || expired(); }
+};
+
+// How output images are encoded. Unset values keep those of the input beauty.
+struct OutputSettings
+{
+    // OIIO compression name e.g. "zip", "piz", "dwaa" or "none"
+    std::string compression;
+    // e.g. 1-9 for zip or the dwaa/dwab quality level, -1 for the default
+    int compression_level = -1;
+    OIIO::TypeDesc format = OIIO::TypeDesc::UNKNOWN;
+    // Downscale factor of previews, saved as the "denoiser:preview" attribute so they
+    // can't be mistaken for final frames. 0 for full resolution frames.
+    int preview = 0;
+};
+
+// Pixel buffers shared with the OIDN filter. These persist between frames so
+// that a sequence of same sized images can reuse the committed filter.
+// The beauty is kept in its original interleaved layout (beauty_channels values
+// per pixel) and denoised in place; output is only used for images with fewer
+// than three channels, which have to be converted to three channels, or for repeated runs.
+// Pixels are stored as half when half is set, otherwise as float.
+struct DenoiseBuffers
+{
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    int beauty_channels = 0;
+    // tileOverlap of the filter after its last commit, 0 until known
+    int overlap = 0;
+    bool in_place = false;
+    bool has_albedo = false;
+    bool has_normal = false;
+    bool half = false;
+    // The AOV files albedo and normal were read from, so they are only read again when they change
+    std::string aux_source;
+    bool aux_prefiltered = false;
+    // Set when the layout changed and the filter needs its images set again
+    bool dirty = true;
+    std::vector<unsigned char> beauty;
+    std::vector<unsigned char> albedo;
+    std::vector<unsigned char> normal;
+    std::vector<unsigned char> output;
+};
+
+// Parses "auto", "float" or "half"
+bool parsePrecision(const std::string& value, PixelPrecision& precision);
+const char* precisionName(PixelPrecision precision);
+
+// Parses "default", "fast", "balanced" or "high"
+bool parseQuality(const std::string& value, oidn::Quality& quality);
+const char* qualityName(oidn::Quality quality);
+
+// Whether filters created with a and b are set up the same way
+bool sameFilterParams(const FilterSettings& a, const FilterSettings& b);
+
+// Parses "half", "float", "uint8" or "uint16"
+bool parseOutputFormat(const std::string& value, OIIO::TypeDesc& format);
+
+// Sets the compression, data format and preview tag of spec from output
+void applyOutputSettings(OIIO::ImageSpec& spec, const OutputSettings& output);
+
+// Parses a region given as "x,y,w,h"
+bool parseRegion(const std::string& value, OIIO::ROI& roi);
+
+// Total size of the pixel buffers in bytes
+size_t bufferBytes(const DenoiseBuffers& buffers);
+
+bool convertToFormat(void* in_ptr, void* out_ptr, unsigned int in_channels, unsigned int out_channels,
+                     size_t channel_size = sizeof(float));
+
+// Thrown by the error callback when an execution was cancelled from the progress callback
+struct DenoiseCancelled : std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+void errorCallback(void* userPtr, oidn::Error error, const char* message);
+// userPtr is an optional ExecutionControl which stops the execution
+bool progressCallback(void* userPtr, double n);
+
+// Creates and commits a CPU device. Throws on failure.
+oidn::DeviceRef createDevice(int num_threads, bool affinity);
+
+// Creates an RT filter with our progress callback and the given parameters. Custom weights
+// are memory mapped and shared by every filter using them. Throws on failure.
+// Executions are stopped by control, if given. weights, if given, is set to the custom
+// weights given to the filter, or left empty for the built in ones.
+oidn::FilterRef createFilter(oidn::DeviceRef& device, const FilterSettings& settings,
+                             const ExecutionControl* control = nullptr, WeightsBlob* weights = nullptr);
+
+// Opens the images of a frame and checks they can be denoised together. Images given as
+// "file:channels" are selected from a multi-channel file, which is only read once.
+// On success images holds the frame and width/height the size of the region to denoise.
+// With sources given the files read are kept there for the next frame.
+bool openFrame(const FrameJob& job, FrameImages& images, int& width, int& height, SourceFiles* sources = nullptr);
+
+// Adds a margin of overlap pixels around the region to be read, within the data window
+void padRegion(FrameImages& images, int overlap);
+
+// Reads the pixels of a frame previously opened with openFrame into buffers. When
+// in_place is false the result goes to a separate buffer so the input is preserved.
+// The pixels are read as half or float as chosen by settings.precision and preprocessed
+// as set by settings.preprocess.
+bool readFrame(const FrameImages& images, DenoiseBuffers& buffers, bool in_place, const FilterSettings& settings);
+
+// Sets the images in buffers on the filter, without committing it
+void setFilterImages(oidn::FilterRef& filter, const DenoiseBuffers& buffers);
+
+// Gives the filter the images in buffers and commits it, if they changed since it was last bound.
+// Throws on OIDN errors.
+void bindFilter(oidn::FilterRef& filter, DenoiseBuffers& buffers);
+
+// Denoised layers bound for one file, saved together as a copy of source, the multi-channel
+// file the first of them was selected from, with all of them added
+struct LayerFile
+{
+    std::string path;
+    std::shared_ptr<OIIO::ImageBuf> source;
+    std::vector<std::string> names;
+    std::vector<std::shared_ptr<OIIO::ImageBuf>> layers;
+};
+
+// Saves the layers of file, keeping layers saved to it before
+bool saveLayers(const LayerFile& file, const OutputSettings& output);
+
+// Saves the denoised frame in the format of the input beauty, or as set by the writer's
+// output settings. An output given as a layer is handed to the writer, which saves the
+// layers for one file together. With a background writer the pixels are copied out of
+// buffers and the file is saved later, taking over images; the return value then only
+// covers the copy.
+bool writeFrame(const FrameJob& job, FrameImages& images, DenoiseBuffers& buffers, FrameWriter* writer = nullptr);
+
+// Denoises and saves a frame previously opened with openFrame. The filter is only given
+// new images and recommitted when the resolution or set of AOVs differs from the previous frame.
+// The filter is executed num_warmup untimed times then num_runs timed times, and
+// denoise_ms is set to the median time. If prefilter is given the AOVs are prefiltered first.
+// A cancelled execution leaves the filter bound and returns false without saving.
+// With deadlines given and settings.deadline_ms set, the filter must have been created with
+// deadlines->control; a frame that misses the deadline is finished by settings.fallbacks.
+// With results given a single run is copied from the result cache when it holds the frame,
+// and its result is stored otherwise.
+bool denoiseFrame(const FrameJob& job, FrameImages& images, oidn::FilterRef& filter, DenoiseBuffers& buffers, const FilterSettings& settings,
+                  unsigned int num_runs, unsigned int num_warmup, double& denoise_ms,
+                  AuxPrefilter* prefilter = nullptr, FrameWriter* writer = nullptr,
+                  DeadlineFallbacks* deadlines = nullptr, ResultCache* results = nullptr);
@@ -0,0 +1,840 @@
+#include "instances.h"
+#include "deadline.h"
+#include "farm.h"
+#include "log.h"
+#include "writer.h"
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#ifdef _WIN32
+
+int runInstances(const std::vector<FrameJob>& jobs, int num_instances, const FilterSettings& settings,
+                 const OutputSettings& output)
+{
+    PrintError("Multiple instances are not supported on this platform");
+    return int(jobs.size());
+}
+
+std::unique_ptr<TileTransport> createProcessTransport(int num_workers)
+{
+    PrintError("Worker processes are not supported on this platform");
+    return nullptr;
+}
+
+#else
+
+namespace
+{
+
+// The cores an instance is pinned to. node is -1 when they span NUMA nodes or none are known.
+struct CoreSet
+{
+    std::vector<int> cpus;
+    int node = -1;
+    int num_threads = 0;
+};
+
+// Sent from a worker to the coordinator after each frame
+struct FrameResult
+{
+    int index;
+    int success;
+    double busy_ms;
+};
+
+// Parses a sysfs cpu list such as "0-15,32-47"
+std::vector<int> parseCpuList(const std::string& list)
+{
+    std::vector<int> cpus;
+    std::stringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ','))
+    {
+        try
+        {
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        }
+        catch (const std::exception&)
+        {
+        }
+    }
+    return cpus;
+}
+
+std::string readLine(const std::string& path)
+{
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+// Splits the cores this process may run on between the instances. Each NUMA node is
+// shared by the instances assigned to it, and hyper-threads of a core are kept together.
+std::vector<CoreSet> partitionCores(int num_instances)
+{
+    const int num_cpus = std::max<int>(std::thread::hardware_concurrency(), 1);
+    std::vector<CoreSet> sets(num_instances);
+
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        std::map<int, int> cpu_nodes;
+        for (int n = 0; ; n++)
+        {
+            std::string list = readLine("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+            if (list.empty())
+                break;
+            for (int cpu : parseCpuList(list))
+                cpu_nodes[cpu] = n;
+        }
+
+        // Group the allowed cpus by node, ordered so that sibling hyper-threads are adjacent
+        std::map<int, std::vector<std::pair<int, int>>> nodes;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (!CPU_ISSET(cpu, &allowed))
+                continue;
+            auto node_it = cpu_nodes.find(cpu);
+            int node = (node_it != cpu_nodes.end()) ? node_it->second : -1;
+            std::vector<int> siblings = parseCpuList(readLine("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list"));
+            int core = siblings.empty() ? cpu : siblings[0];
+            nodes[node].push_back(std::make_pair(core, cpu));
+        }
+        for (auto& node : nodes)
+            std::sort(node.second.begin(), node.second.end());
+
+        if (num_instances >= int(nodes.size()))
+        {
+            // Instances are dealt out to the nodes in turn and split the cores of their node
+            std::vector<std::vector<int>> node_instances(nodes.size());
+            for (int i = 0; i < num_instances; i++)
+                node_instances[i % nodes.size()].push_back(i);
+            int n = 0;
+            for (auto& node : nodes)
+            {
+                const std::vector<int>& instances = node_instances[n++];
+                const size_t count = node.second.size();
+                for (size_t j = 0; j < instances.size(); j++)
+                {
+                    CoreSet& set = sets[instances[j]];
+                    set.node = node.first;
+                    for (size_t c = j * count / instances.size(); c < (j + 1) * count / instances.size(); c++)
+                        set.cpus.push_back(node.second[c].second);
+                }
+            }
+        }
+        else
+        {
+            // Fewer instances than nodes, so some instances span several nodes
+            std::vector<int> cpus;
+            for (auto& node : nodes)
+                for (auto& cpu : node.second)
+                    cpus.push_back(cpu.second);
+            for (int i = 0; i < num_instances; i++)
+                for (size_t c = i * cpus.size() / num_instances; c < (i + 1) * cpus.size() / num_instances; c++)
+                    sets[i].cpus.push_back(cpus[c]);
+        }
+    }
+#endif
+
+    for (int i = 0; i < num_instances; i++)
+        sets[i].num_threads = sets[i].cpus.empty() ? std::max(num_cpus / num_instances, 1) : int(sets[i].cpus.size());
+    return sets;
+}
+
+std::string describeCores(const CoreSet& set)
+{
+    if (set.cpus.empty())
+        return "unpinned";
+    std::string description = "cpus " + std::to_string(set.cpus.front());
+    for (size_t c = 1; c < set.cpus.size(); c++)
+        description += "," + std::to_string(set.cpus[c]);
+    if (set.node >= 0)
+        description += " (node " + std::to_string(set.node) + ")";
+    return description;
+}
+
+bool readAll(int fd, void* data, size_t size)
+{
+    char* bytes = (char*)data;
+    while (size)
+    {
+        ssize_t n = read(fd, bytes, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        bytes += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+bool writeAll(int fd, const void* data, size_t size)
+{
+    const char* bytes = (const char*)data;
+    while (size)
+    {
+        ssize_t n = write(fd, bytes, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        bytes += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+void pinProcess(const CoreSet& cores)
+{
+#ifdef __linux__
+    if (!cores.cpus.empty())
+    {
+        // Pinning the whole process before OIDN starts also confines its worker threads
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cores.cpus)
+            CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+            PrintError("Could not set the affinity of an instance");
+    }
+#endif
+}
+
+// Body of a worker process: pins itself, creates its own device and filter, then
+// denoises the frames it is sent until it reads a negative index.
+void runWorker(const std::vector<FrameJob>& jobs, const CoreSet& cores, const FilterSettings& settings,
+               const OutputSettings& output, int job_fd, int result_fd)
+{
+    pinProcess(cores);
+
+    oidn::DeviceRef device;
+    oidn::FilterRef filter;
+    DeadlineFallbacks deadlines;
+    try
+    {
+        device = createDevice(cores.num_threads, false);
+        filter = createFilter(device, settings, &deadlines.control);
+        deadlines.device = device;
+    }
+    catch (const std::exception& e)
+    {
+        PrintError("[OIDN]: %s", e.what());
+        _exit(EXIT_FAILURE);
+    }
+
+    // Frames are saved before their result is sent, so the busy time includes the write
+    DenoiseBuffers buffers;
+    FrameWriter writer(output, false);
+    int index;
+    while (readAll(job_fd, &index, sizeof(index)) && index >= 0)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        double denoise_ms = 0.0;
+        int width, height;
+        FrameImages images;
+        FrameResult result;
+        result.index = index;
+        result.success = openFrame(jobs[index], images, width, height) &&
+                         denoiseFrame(jobs[index], images, filter, buffers, settings, 1, 0, denoise_ms,
+                                      nullptr, &writer, &deadlines) &&
+                         writer.flushLayers();
+        result.busy_ms = elapsedMilliseconds(start);
+        if (!writeAll(result_fd, &result, sizeof(result)))
+            break;
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+// Where a frame's images are in the memory shared with the tile workers. The workers inherit
+// the mapping when forked and are sent the layout with each tile, so later frames that fit in
+// the mapping are denoised by the same workers.
+struct FrameLayout
+{
+    size_t beauty = 0;
+    size_t albedo = 0;
+    size_t normal = 0;
+    size_t output = 0;
+    int width = 0;
+    int height = 0;
+    int beauty_channels = 0;
+    bool half = false;
+    bool has_albedo = false;
+    bool has_normal = false;
+};
+
+// Sent from the coordinator to a tile worker, with a negative index to stop it
+struct TileMessage
+{
+    int index;
+    FrameTile tile;
+    FrameLayout frame;
+};
+
+// Body of a tile worker process: denoises the padded region of each tile it is sent from
+// the shared frame, then copies the tile itself to the shared output. Tiles never overlap
+// there, so the workers don't need to coordinate.
+void runTileWorker(unsigned char* shared, const CoreSet& cores, const FilterSettings& settings, int worker,
+                   int job_fd, int result_fd)
+{
+    pinProcess(cores);
+
+    oidn::DeviceRef device;
+    oidn::FilterRef filter;
+    try
+    {
+        device = createDevice(cores.num_threads, false);
+        filter = createFilter(device, settings);
+    }
+    catch (const std::exception& e)
+    {
+        PrintError("[OIDN]: %s", e.what());
+        _exit(EXIT_FAILURE);
+    }
+
+    // The filter only reports its tile overlap once committed, which the coordinator needs
+    // before it can cut the tiles, so it is committed once on a small image first
+    int overlap = 0;
+    try
+    {
+        std::vector<float> probe(3 * 16 * 16);
+        filter.setImage("color", probe.data(), oidn::Format::Float3, 16, 16);
+        filter.setImage("output", probe.data(), oidn::Format::Float3, 16, 16);
+        filter.commit();
+        overlap = filter.get<int>("tileOverlap");
+    }
+    catch (const std::exception& e)
+    {
+        PrintError("[OIDN]: %s", e.what());
+        _exit(EXIT_FAILURE);
+    }
+    if (!writeAll(result_fd, &overlap, sizeof(overlap)))
+        _exit(EXIT_FAILURE);
+
+    // Tiles are denoised into one buffer that grows to the largest padded tile, and the
+    // output and AOVs are only set again when the tile size or frame layout changes. The
+    // inputs are read in place, so each tile still points the filter at its own pixels, but
+    // while the image sizes stay the same the commit only swaps those pointers rather than
+    // setting the filter up again.
+    std::vector<unsigned char> denoised;
+    FrameLayout committed;
+    int committed_width = 0;
+    int committed_height = 0;
+    TileMessage message;
+    while (readAll(job_fd, &message, sizeof(message)) && message.index >= 0)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        const FrameTile& tile = message.tile;
+        const FrameLayout& frame = message.frame;
+        const oidn::Format format = frame.half ? oidn::Format::Half3 : oidn::Format::Float3;
+        const size_t pixel_size = 3 * (frame.half ? sizeof(uint16_t) : sizeof(float));
+        const size_t beauty_pixel = frame.beauty_channels * (frame.half ? sizeof(uint16_t) : sizeof(float));
+        TileResult result = { worker, message.index, 0, 0, 0.0 };
+        try
+        {
+            if (tile.padded_width != committed_width || tile.padded_height != committed_height ||
+                frame.half != committed.half || frame.has_albedo != committed.has_albedo ||
+                frame.has_normal != committed.has_normal)
+            {
+                const size_t size = size_t(tile.padded_width) * tile.padded_height * pixel_size;
+                if (denoised.size() < size)
+                    denoised.resize(size);
+                filter.setImage("output", denoised.data(), format, tile.padded_width, tile.padded_height);
+                if (!frame.has_albedo)
+                    filter.unsetImage("albedo");
+                if (!frame.has_normal)
+                    filter.unsetImage("normal");
+                committed = frame;
+                committed_width = tile.padded_width;
+                committed_height = tile.padded_height;
+            }
+
+            // The inputs are read in place through their row strides
+            const size_t first = size_t(tile.padded_y) * frame.width + tile.padded_x;
+            filter.setImage("color", shared + frame.beauty + first * beauty_pixel, format, tile.padded_width,
+                            tile.padded_height, 0, beauty_pixel, frame.width * beauty_pixel);
+            if (frame.has_albedo)
+                filter.setImage("albedo", shared + frame.albedo + first * pixel_size, format, tile.padded_width,
+                                tile.padded_height, 0, pixel_size, frame.width * pixel_size);
+            if (frame.has_normal)
+                filter.setImage("normal", shared + frame.normal + first * pixel_size, format, tile.padded_width,
+                                tile.padded_height, 0, pixel_size, frame.width * pixel_size);
+            filter.commit();
+            filter.execute();
+
+            for (int y = 0; y < tile.height; y++)
+            {
+                const size_t from = size_t(tile.y - tile.padded_y + y) * tile.padded_width + (tile.x - tile.padded_x);
+                const size_t to = size_t(tile.y + y) * frame.width + tile.x;
+                memcpy(shared + frame.output + to * pixel_size, denoised.data() + from * pixel_size, tile.width * pixel_size);
+            }
+            result.overlap = filter.get<int>("tileOverlap");
+            result.success = 1;
+        }
+        catch (const std::exception& e)
+        {
+            PrintError("[OIDN]: %s", e.what());
+            // Set every image again on the next tile
+            committed_width = 0;
+        }
+        result.busy_ms = elapsedMilliseconds(start);
+        if (!writeAll(result_fd, &result, sizeof(result)))
+            break;
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+class ProcessTransport : public TileTransport
+{
+public:
+    explicit ProcessTransport(int num_workers)
+        : num_workers(num_workers)
+    {
+    }
+    ~ProcessTransport() override { stop(); }
+
+    int start(const DenoiseBuffers& buffers, const FilterSettings& settings, int& overlap) override;
+    bool send(int worker, int index, const FrameTile& tile) override;
+    bool receive(TileResult& result) override;
+    void finish(DenoiseBuffers& buffers) override;
+
+private:
+    struct Worker
+    {
+        pid_t pid = -1;
+        int job_fd = -1;
+        int result_fd = -1;
+        int tile = -1;
+    };
+
+    int startWorkers(size_t size, const FilterSettings& settings);
+    int running() const;
+    void stop();
+
+    int num_workers;
+    std::vector<Worker> workers;
+    int num_started = 0;
+    int tile_overlap = 0;
+    // Memory shared with the workers, and where the current frame is in it
+    unsigned char* shared = nullptr;
+    size_t shared_size = 0;
+    FrameLayout frame;
+};
+
+int ProcessTransport::start(const DenoiseBuffers& buffers, const FilterSettings& settings, int& overlap)
+{
+    FrameLayout layout;
+    layout.width = buffers.width;
+    layout.height = buffers.height;
+    layout.beauty_channels = buffers.beauty_channels;
+    layout.half = buffers.half;
+    layout.has_albedo = buffers.has_albedo;
+    layout.has_normal = buffers.has_normal;
+    layout.beauty = 0;
+    layout.albedo = layout.beauty + buffers.beauty.size();
+    layout.normal = layout.albedo + (buffers.has_albedo ? buffers.albedo.size() : 0);
+    layout.output = layout.normal + (buffers.has_normal ? buffers.normal.size() : 0);
+    const size_t size = layout.output + size_t(buffers.width) * buffers.height * 3 * (buffers.half ? sizeof(uint16_t) : sizeof(float));
+
+    // The workers are kept from frame to frame while the frames fit in the memory they share
+    // and none of them has died. The settings must be the same for every frame.
+    if (size > shared_size || running() < num_started)
+    {
+        stop();
+        if (!startWorkers(size, settings))
+            return 0;
+    }
+
+    // The workers are idle between frames, so the next one can be copied over the last
+    frame = layout;
+    memcpy(shared + frame.beauty, buffers.beauty.data(), buffers.beauty.size());
+    if (buffers.has_albedo)
+        memcpy(shared + frame.albedo, buffers.albedo.data(), buffers.albedo.size());
+    if (buffers.has_normal)
+        memcpy(shared + frame.normal, buffers.normal.data(), buffers.normal.size());
+    overlap = tile_overlap;
+    return running();
+}
+
+int ProcessTransport::startWorkers(size_t size, const FilterSettings& settings)
+{
+    // The frames are copied into an anonymous shared mapping, which the workers inherit
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+    {
+        PrintError("Could not map %.1f MB of shared memory for the frame", size / (1024.0 * 1024.0));
+        return 0;
+    }
+    shared = (unsigned char*)data;
+    shared_size = size;
+
+    // A worker that exits early must not kill us when we send it a tile
+    signal(SIGPIPE, SIG_IGN);
+    std::vector<CoreSet> cores = partitionCores(num_workers);
+    const int parent_verbosity = verbosity;
+    workers.resize(num_workers);
+    num_started = 0;
+    for (int i = 0; i < num_workers; i++)
+    {
+        if (verbosity >= 2)
+            PrintInfo("Worker %d: %d threads, %s", i, cores[i].num_threads, describeCores(cores[i]).c_str());
+        int job_pipe[2], result_pipe[2];
+        if (pipe(job_pipe) != 0 || pipe(result_pipe) != 0)
+        {
+            PrintError("Could not create pipes for worker %d", i);
+            break;
+        }
+        std::cout.flush();
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            // Workers only log errors so their output doesn't interleave
+            verbosity = 0;
+            close(job_pipe[1]);
+            close(result_pipe[0]);
+            for (int j = 0; j < i; j++)
+            {
+                close(workers[j].job_fd);
+                close(workers[j].result_fd);
+            }
+            runTileWorker(shared, cores[i], settings, i, job_pipe[0], result_pipe[1]);
+        }
+        close(job_pipe[0]);
+        close(result_pipe[1]);
+        if (pid < 0)
+        {
+            PrintError("Could not start worker %d", i);
+            close(job_pipe[1]);
+            close(result_pipe[0]);
+            continue;
+        }
+        workers[i].pid = pid;
+        workers[i].job_fd = job_pipe[1];
+        workers[i].result_fd = result_pipe[0];
+        num_started++;
+    }
+    verbosity = parent_verbosity;
+
+    // Each worker reports its filter's tile overlap once it is ready. One that doesn't has
+    // failed to start and gets no tiles.
+    tile_overlap = 0;
+    for (Worker& worker : workers)
+    {
+        int worker_overlap = 0;
+        if (worker.pid <= 0)
+            continue;
+        if (readAll(worker.result_fd, &worker_overlap, sizeof(worker_overlap)))
+        {
+            tile_overlap = std::max(tile_overlap, worker_overlap);
+            continue;
+        }
+        close(worker.job_fd);
+        worker.job_fd = -1;
+        num_started--;
+    }
+    return num_started;
+}
+
+int ProcessTransport::running() const
+{
+    int count = 0;
+    for (const Worker& worker : workers)
+    {
+        if (worker.job_fd >= 0)
+            count++;
+    }
+    return count;
+}
+
+bool ProcessTransport::send(int worker, int index, const FrameTile& tile)
+{
+    Worker& target = workers[worker];
+    TileMessage message = { index, tile, frame };
+    if (target.job_fd < 0 || !writeAll(target.job_fd, &message, sizeof(message)))
+        return false;
+    target.tile = index;
+    return true;
+}
+
+bool ProcessTransport::receive(TileResult& result)
+{
+    while (true)
+    {
+        std::vector<pollfd> fds;
+        std::vector<int> polled;
+        for (int i = 0; i < int(workers.size()); i++)
+        {
+            if (workers[i].tile < 0)
+                continue;
+            fds.push_back({ workers[i].result_fd, POLLIN, 0 });
+            polled.push_back(i);
+        }
+        if (fds.empty())
+            return false;
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            PrintError("poll failed");
+            return false;
+        }
+        for (size_t p = 0; p < fds.size(); p++)
+        {
+            if (!fds[p].revents)
+                continue;
+            Worker& worker = workers[polled[p]];
+            const int tile = worker.tile;
+            worker.tile = -1;
+            if (readAll(worker.result_fd, &result, sizeof(result)))
+                return true;
+            // The worker died, so it gets no more tiles
+            result.worker = polled[p];
+            result.tile = tile;
+            close(worker.job_fd);
+            worker.job_fd = -1;
+            return false;
+        }
+    }
+}
+
+void ProcessTransport::finish(DenoiseBuffers& buffers)
+{
+    const size_t output_size = size_t(frame.width) * frame.height * 3 * (frame.half ? sizeof(uint16_t) : sizeof(float));
+    buffers.output.resize(output_size);
+    memcpy(buffers.output.data(), shared + frame.output, output_size);
+}
+
+void ProcessTransport::stop()
+{
+    for (Worker& worker : workers)
+    {
+        if (worker.pid <= 0)
+            continue;
+        if (worker.job_fd >= 0)
+        {
+            TileMessage message = { -1, FrameTile(), FrameLayout() };
+            writeAll(worker.job_fd, &message, sizeof(message));
+            close(worker.job_fd);
+        }
+        close(worker.result_fd);
+        waitpid(worker.pid, nullptr, 0);
+    }
+    workers.clear();
+    num_started = 0;
+    if (shared)
+        munmap(shared, shared_size);
+    shared = nullptr;
+    shared_size = 0;
+}
+
+struct Instance
+{
+    pid_t pid = -1;
+    int job_fd = -1;
+    int result_fd = -1;
+    int current = -1;
+    int frames = 0;
+    double busy_ms = 0.0;
+};
+
+// Tells the started instances to stop and waits for them
+void stopInstances(std::vector<Instance>& instances)
+{
+    for (Instance& instance : instances)
+    {
+        if (instance.pid <= 0)
+            continue;
+        if (instance.job_fd >= 0)
+        {
+            int stop = -1;
+            writeAll(instance.job_fd, &stop, sizeof(stop));
+            close(instance.job_fd);
+        }
+        close(instance.result_fd);
+        waitpid(instance.pid, nullptr, 0);
+    }
+}
+
+} // namespace
+
+int runInstances(const std::vector<FrameJob>& jobs, int num_instances, const FilterSettings& settings,
+                 const OutputSettings& output)
+{
+    num_instances = std::max(1, std::min(num_instances, int(jobs.size())));
+    std::vector<CoreSet> cores = partitionCores(num_instances);
+
+    // A worker that exits early must not kill us when we send it a frame
+    signal(SIGPIPE, SIG_IGN);
+
+    // Workers only log errors so their output doesn't interleave
+    std::cout.flush();
+    std::cerr.flush();
+    const int parent_verbosity = verbosity;
+
+    std::vector<Instance> instances(num_instances);
+    for (int i = 0; i < num_instances; i++)
+    {
+        PrintInfo("Instance %d: %d threads, %s", i, cores[i].num_threads, describeCores(cores[i]).c_str());
+        int job_pipe[2], result_pipe[2];
+        if (pipe(job_pipe) != 0)
+        {
+            PrintError("Could not create pipes for instance %d", i);
+            verbosity = parent_verbosity;
+            stopInstances(instances);
+            return int(jobs.size());
+        }
+        if (pipe(result_pipe) != 0)
+        {
+            PrintError("Could not create pipes for instance %d", i);
+            close(job_pipe[0]);
+            close(job_pipe[1]);
+            verbosity = parent_verbosity;
+            stopInstances(instances);
+            return int(jobs.size());
+        }
+        std::cout.flush();
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            verbosity = 0;
+            close(job_pipe[1]);
+            close(result_pipe[0]);
+            for (int j = 0; j < i; j++)
+            {
+                close(instances[j].job_fd);
+                close(instances[j].result_fd);
+            }
+            runWorker(jobs, cores[i], settings, output, job_pipe[0], result_pipe[1]);
+        }
+        close(job_pipe[0]);
+        close(result_pipe[1]);
+        if (pid < 0)
+        {
+            PrintError("Could not start instance %d", i);
+            close(job_pipe[1]);
+            close(result_pipe[0]);
+            continue;
+        }
+        instances[i].pid = pid;
+        instances[i].job_fd = job_pipe[1];
+        instances[i].result_fd = result_pipe[0];
+    }
+    verbosity = parent_verbosity;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    int next = 0;
+    int num_failed = 0;
+    int num_busy = 0;
+    auto assign = [&](Instance& instance)
+    {
+        if (next < int(jobs.size()) && writeAll(instance.job_fd, &next, sizeof(next)))
+        {
+            instance.current = next++;
+            num_busy++;
+        }
+    };
+    for (Instance& instance : instances)
+        if (instance.pid > 0)
+            assign(instance);
+
+    // Hand out the remaining frames as instances finish
+    while (num_busy)
+    {
+        std::vector<pollfd> fds;
+        std::vector<Instance*> polled;
+        for (Instance& instance : instances)
+        {
+            if (instance.current < 0)
+                continue;
+            fds.push_back({ instance.result_fd, POLLIN, 0 });
+            polled.push_back(&instance);
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            PrintError("poll failed");
+            break;
+        }
+        for (size_t p = 0; p < fds.size(); p++)
+        {
+            if (!fds[p].revents)
+                continue;
+            Instance& instance = *polled[p];
+            const int instance_index = int(&instance - &instances[0]);
+            FrameResult result;
+            num_busy--;
+            if (!readAll(instance.result_fd, &result, sizeof(result)))
+            {
+                // The worker died, so its frame failed and it gets no more work
+                PrintError("Instance %d exited while denoising frame %d", instance_index, instance.current+1);
+                num_failed++;
+                instance.current = -1;
+                close(instance.job_fd);
+                instance.job_fd = -1;
+                continue;
+            }
+            instance.current = -1;
+            instance.busy_ms += result.busy_ms;
+            if (result.success)
+            {
+                instance.frames++;
+                PrintInfo("Frame %d/%d complete on instance %d in %.3f seconds", result.index+1, int(jobs.size()),
+                          instance_index, result.busy_ms / 1000.0);
+            }
+            else
+            {
+                PrintError("Frame %d failed: %s", result.index+1, jobs[result.index].beauty.c_str());
+                num_failed++;
+            }
+            assign(instance);
+        }
+    }
+    // Frames that no instance was left to take
+    num_failed += int(jobs.size()) - next;
+
+    stopInstances(instances);
+
+    double total_ms = elapsedMilliseconds(start);
+    int num_done = int(jobs.size()) - num_failed;
+    PrintInfo("%d frames on %d instances complete in %.3f seconds (%d failed)", num_done, num_instances, total_ms / 1000.0, num_failed);
+    PrintInfo("Aggregate throughput: %.2f frames/s", num_done / (total_ms / 1000.0));
+    for (int i = 0; i < num_instances; i++)
+        PrintInfo("Instance %d: %d frames, %.0f%% utilisation", i, instances[i].frames,
+                  total_ms > 0.0 ? 100.0 * instances[i].busy_ms / total_ms : 0.0);
+    return num_failed;
+}
+
+std::unique_ptr<TileTransport> createProcessTransport(int num_workers)
+{
+    return std::unique_ptr<TileTransport>(new ProcessTransport(num_workers));
+}
+
+#endif
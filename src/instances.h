@@ -0,0 +1,11 @@
+#pragma once
+
+#include "frame.h"
+#include <vector>
+
+// Denoises the frames with num_instances independent devices, each running in its own
+// worker process pinned to a disjoint set of cores (kept within one NUMA node where
+// possible). Frames are handed to whichever instance is free. Aggregate throughput and
+// the utilisation of each instance are reported. Returns the number of failed frames.
+int runInstances(const std::vector<FrameJob>& jobs, int num_instances, const FilterSettings& settings,
+                 const OutputSettings& output);
@@ -0,0 +1,27 @@
+#include "log.h"
+#include <math.h>
+
+int verbosity = 2;
+
+std::mutex log_mutex;
+
+std::chrono::high_resolution_clock::time_point app_start_time;
+
+std::string getTime()
+{
+    std::chrono::duration<double, std::milli> time_span = std::chrono::high_resolution_clock::now() - app_start_time;
+    double milliseconds = time_span.count();
+    int seconds = floor(milliseconds / 1000.0);
+    int minutes = floor((float(seconds) / 60.f));
+    milliseconds -= seconds * 1000.0;
+    seconds -= minutes * 60;
+    char s[16];
+    snprintf(s, sizeof(s), "%02d:%02d:%03d", minutes, seconds, (int)milliseconds);
+    return std::string(s);
+}
+
+double elapsedMilliseconds(std::chrono::high_resolution_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> time_span = std::chrono::high_resolution_clock::now() - start;
+    return time_span.count();
+}
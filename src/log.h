@@ -0,0 +1,41 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <stdio.h>
+
+// Logging verbosity level
+extern int verbosity;
+
+// Serialises log lines written from several threads
+extern std::mutex log_mutex;
+
+// Application start time
+extern std::chrono::high_resolution_clock::time_point app_start_time;
+
+std::string getTime();
+
+// Milliseconds elapsed since the given time point
+double elapsedMilliseconds(std::chrono::high_resolution_clock::time_point start);
+
+template<typename... Args>
+void PrintInfo(const char *c, Args... args)
+{
+    if (!verbosity)
+        return;
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), c, args...);
+    std::lock_guard<std::mutex> lock(log_mutex);
+    std::cout<<getTime()<<"       | "<<buffer<<std::endl;
+}
+
+template<typename... Args>
+void PrintError(const char *c, Args... args)
+{
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), c, args...);
+    std::lock_guard<std::mutex> lock(log_mutex);
+    std::cerr<<getTime()<<" ERROR | "<<buffer<<std::endl;
+}
@@ -1,11 +1,34 @@
 
+#include "benchmark.h"
+#include "cache.h"
+#include "channels.h"
+#include "deadline.h"
+#include "farm.h"
+#include "frame.h"
+#include "instances.h"
+#include "log.h"
+#include "pipeline.h"
+#include "prefilter.h"
+#include "preview.h"
+#include "server.h"
+#include "shm.h"
+#include "stream.h"
+#include "trace.h"
+#include "watch.h"
+#include "weights.h"
+#include "writer.h"
 #include <OpenImageDenoise/oidn.hpp>
 #include <iostream>
 #include <OpenImageIO/imageio.h>
 #include <OpenImageIO/imagebuf.h>
 #include <stdio.h>
+#include <string.h>
 #include <exception>
-#include <time.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
 #ifdef _WIN32
 #include <thread>
 #include <chrono>
@@ -16,48 +39,6 @@
 #define DENOISER_MAJOR_VERSION 1
 #define DENOISER_MINOR_VERSION 7
 
-// Our global image handles
-OIIO::ImageBuf* input_beauty = nullptr;
-OIIO::ImageBuf* input_albedo = nullptr;
-OIIO::ImageBuf* input_normal = nullptr;
-
-// Logging verbosity level
-int verbosity = 2;
-
-// Application start time
-std::chrono::high_resolution_clock::time_point app_start_time;
-
-std::string getTime()
-{
-    std::chrono::duration<double, std::milli> time_span = std::chrono::high_resolution_clock::now() - app_start_time;
-    double milliseconds = time_span.count();
-    int seconds = floor(milliseconds / 1000.0);
-    int minutes = floor((float(seconds) / 60.f));
-    milliseconds -= seconds * 1000.0;
-    seconds -= minutes * 60;
-    char s[10];
-    sprintf(s, "%02d:%02d:%03d", minutes, seconds, (int)milliseconds);
-    return std::string(s);
-}
-
-template<typename... Args>
-void PrintInfo(const char *c, Args... args)
-{
-    if (!verbosity)
-        return;
-    char buffer[256];
-    sprintf(buffer, c, args...);
-    std::cout<<getTime()<<"       | "<<buffer<<std::endl;
-}
-
-template<typename... Args>
-void PrintError(const char *c, Args... args)
-{
-    char buffer[256];
-    sprintf(buffer, c, args...);
-    std::cerr<<getTime()<<" ERROR | "<<buffer<<std::endl;
-}
-
 #ifdef _WIN32
 int getSysOpType()
 {
@@ -91,81 +72,10 @@ void exitfunc(int exit_code)
         }
     }
 #endif
+    finishTrace();
 	exit(exit_code);
 }
 
-void cleanup()
-{
-    if (input_beauty) delete input_beauty;
-    if (input_albedo) delete input_albedo;
-    if (input_normal) delete input_normal;
-}
-
-bool convertToFormat(void* in_ptr, void* out_ptr, unsigned int in_channels, unsigned int out_channels)
-{
-    switch (in_channels)
-    {
-        case(1):
-        {
-            switch (out_channels)
-            {
-                case(1):
-                case(2):
-                case(3):
-                case(4): memcpy(out_ptr, in_ptr, sizeof(float)); return true;
-                default: return false; // How has this happened?
-            }
-        }
-        case(2):
-        {
-            switch (out_channels)
-            {
-                case(1): memcpy(out_ptr, in_ptr, sizeof(float)); return true;
-                case(2):
-                case(3):
-                case(4): memcpy(out_ptr, in_ptr, 2 * sizeof(float));return true;
-                default: return false; // How has this happened?
-            }
-        }
-        case(3):
-        {
-            switch (out_channels)
-            {
-                case(1): memcpy(out_ptr, in_ptr, 1 * sizeof(float));return true;
-                case(2): memcpy(out_ptr, in_ptr, 2 * sizeof(float)); return true;
-                case(3):
-                case(4): memcpy(out_ptr, in_ptr, 3 * sizeof(float)); return true;
-                default: return false; // How has this happened?
-            }
-        }
-        case(4):
-        {
-            switch (out_channels)
-            {
-                case(1): memcpy(out_ptr, in_ptr, 1 * sizeof(float)); return true;
-                case(2): memcpy(out_ptr, in_ptr, 2 * sizeof(float)); return true;
-                case(3): memcpy(out_ptr, in_ptr, 3 * sizeof(float)); return true;
-                case(4): memcpy(out_ptr, in_ptr, 4 * sizeof(float)); return true;
-                default: return false; // How has this happened?
-            }
-        }
-        default: return false; // How has this happened?
-    }
-    return false; // some unsupported conversion
-}
-
-void errorCallback(void* userPtr, oidn::Error error, const char* message)
-{
-    throw std::runtime_error(message);
-}
-
-bool progressCallback(void* userPtr, double n)
-{
-    if (verbosity >= 2)
-        PrintInfo("%d%% complete", (int)(n*100.0));
-    return true;
-}
-
 void printParams()
 {
     // Always print parameters if needed
@@ -173,20 +83,205 @@ void printParams()
     verbosity = 1;
     PrintInfo("Command line parameters");
     PrintInfo("-v [int]        : log verbosity level 0:disabled 1:simple 2:full (default 2)");
-    PrintInfo("-i [string]     : path to input image");
-    PrintInfo("-o [string]     : path to output image");
+    PrintInfo("-i [string]     : path to input image. Give several -i/-o pairs to denoise more layers with the same AOVs. Images can also be shared memory regions given as shm:/name or fd:N");
+    PrintInfo("                  Any image can be channels of a multi-channel file e.g. render.exr:RGB, render.exr:albedo.* or render.exr:N");
+    PrintInfo("-o [string]     : path to output image, or file.exr:layer to save a copy of the input file with the denoised channels added as layer.R/G/B");
     PrintInfo("-a [string]     : path to input albedo AOV (optional)");
     PrintInfo("-n [string]     : path to input normal AOV (optional, requires albedo AOV)");
+    PrintInfo("-roi [string]   : only denoise the region x,y,w,h (from the top left of the image) and add it to the existing output image. The EXR data window is always respected");
+    PrintInfo("-frames [string]: frame range for a sequence e.g. 1-100; '#' characters in the -i/-a/-n/-o paths are replaced by the zero padded frame number");
+    PrintInfo("-list [string]  : path to a manifest with one frame per line using the -i/-a/-n/-o flags");
     PrintInfo("-hdr [int]      : Image is a HDR image. Disabling with will assume the image is in sRGB (default 1 i.e. enabled)");
     PrintInfo("-srgb [int]     : whether the main input image is encoded with the sRGB (or 2.2 gamma) curve (LDR only) or is linear (default 0 i.e. disabled)");
     PrintInfo("-t [int]        : number of threads to use (defualt is all)");
     PrintInfo("-affinity [int] : Enable affinity. This pins virtual threads to physical cores and can improve performance (default 0 i.e. disabled)");
     PrintInfo("-repeat [int]   : Execute the denoiser N times. Useful for profiling.");
+    PrintInfo("-warmup [int]   : Untimed runs of the denoiser before the timed -repeat runs (default 0, or 1 for benchmarks)");
     PrintInfo("-maxmem [int]   : Maximum memory size used by the denoiser in MB");
     PrintInfo("-clean_aux [int]: Whether the auxiliary feature (albedo, normal) images are noise-free; recommended for highest quality but should *not* be enabled for noisy auxiliary images to avoid residual noise (default 0 i.e. disabled)");
+    PrintInfo("-quality [string]: OIDN quality preset: default, fast, balanced or high. fast is much quicker at some cost in quality, e.g. for previews (default default i.e. high)");
+    PrintInfo("-weights [string]: path to custom trained weights (.tza) for the filter. The file is memory mapped and shared by every filter and process using it");
+    PrintInfo("-compression [string]: output compression e.g. none, zip, piz or dwaa for EXRs (default that of the input)");
+    PrintInfo("-compression_level [int]: output compression level e.g. 1-9 for zip or the dwaa/dwab quality (default that of the format)");
+    PrintInfo("-out_format [string]: output data format: half, float, uint8 or uint16 (default that of the input)");
+    PrintInfo("-async_write [int]: Save each output on a background thread while the next frame is denoised (default 1 i.e. enabled)");
+    PrintInfo("-precision [string]: pixel format given to the denoiser: auto, float or half. auto keeps half float inputs (e.g. half EXRs) as half end to end, halving the memory used (default auto)");
+    PrintInfo("-sanitize [int] : Replace NaN and infinite input values with 0 (default 0 i.e. disabled)");
+    PrintInfo("-normal_remap [int]: Remap normals stored as [0,1], e.g. in 8-bit files, to [-1,1] (default 0 i.e. disabled)");
+    PrintInfo("-exposure [float]: Exposure adjustment of the input beauty in stops, kept in the output (default 0)");
+    PrintInfo("-deadline [int] : Time allowed to read and denoise each frame in ms. A denoise still running at the deadline is stopped and the frame finished with -fallback (default 0 i.e. no limit)");
+    PrintInfo("-fallback [string]: comma separated fallbacks tried in order after a missed deadline: fast (fast quality preset), lowres (half resolution denoise) or noisy (save the input unchanged) (default noisy)");
+    PrintInfo("-prefilter [int]: Denoise noisy albedo and normal AOVs with their own filters first, then the beauty with cleanAux (default 0 i.e. disabled)");
+    PrintInfo("-prefilter_cache [string]: directory to cache prefiltered AOVs in, keyed by the AOV contents, so unchanged AOVs are not prefiltered again");
+    PrintInfo("-result_cache [string]: directory to cache denoised results in, keyed by the input pixels and filter parameters, so unchanged frames are copied instead of denoised again");
+    PrintInfo("-result_cache_mb [int]: size limit of the result cache, the least recently used results are removed past it (default 4096)");
+    PrintInfo("-stream [int]   : Denoise in overlapping bands of rows read and written progressively, so the image never has to fit in memory. -maxmem then limits the memory of the whole run (default 0 i.e. disabled, 1024MB budget if -maxmem is not given)");
+    PrintInfo("-pipeline [int] : Overlap reading, denoising and writing of the frames of a sequence on separate threads. Images must have at least three channels (default 0 i.e. disabled)");
+    PrintInfo("-instances [int]: Denoise the frames with N independent OIDN instances, each pinned to its own share of the cores (and NUMA node where possible). -t and -affinity are ignored (default 0 i.e. disabled)");
+    PrintInfo("-farm [int]     : Cut each frame into overlapping tiles denoised in parallel by N worker processes, each pinned to its own share of the cores, for frames too large for one process to denoise quickly (default 0 i.e. disabled)");
+    PrintInfo("-farm_tiles [int]: number of tiles -farm cuts each frame into (default twice the number of workers)");
+    PrintInfo("-farm_baseline [int]: also denoise each frame in a single process and report the speedup and scaling efficiency of -farm (default 0 i.e. disabled)");
+    PrintInfo("-preview [int]  : Denoise a quick preview at 1/N of the resolution, upsampled guided by the full resolution albedo and normal. Outputs are tagged with a denoiser:preview attribute (default 0 i.e. disabled)");
+    PrintInfo("-preview_baseline [int]: also denoise each frame at full resolution and report the preview's speedup (default 0 i.e. disabled)");
+    PrintInfo("-watch [int]    : Keep running and denoise again every time the inputs change, e.g. as a progressive render updates them. A change during a denoise cancels it (default 0 i.e. disabled)");
+    PrintInfo("-bench [int]    : Benchmark the denoiser on the input image without saving it. Reports min/median/p95/max over -repeat runs (default 10) after -warmup runs (default 0 i.e. disabled)");
+    PrintInfo("-bench_threads [string]: comma separated thread counts to benchmark e.g. 8,16,32 (default -t)");
+    PrintInfo("-bench_maxmem [string] : comma separated maxMemoryMB values to benchmark e.g. 512,2048 (default -maxmem)");
+    PrintInfo("-bench_precision [string]: comma separated precisions to benchmark e.g. float,half (default -precision)");
+    PrintInfo("-bench_quality [string]: comma separated quality presets to benchmark e.g. fast,balanced,high (default -quality)");
+    PrintInfo("-bench_out [string]    : write the benchmark results to a .json or .csv file");
+    PrintInfo("-trace [string] : write a Chrome trace (JSON) of the run's phases, OIDN progress, peak memory and thread count, for Perfetto or chrome://tracing");
+    PrintInfo("-server [string]: run as a denoise server listening on the given Unix domain socket path");
+    PrintInfo("-cache [int]    : number of committed filters the server keeps cached (default 4)");
+    PrintInfo("-client [string]: send the job to the server listening on the given socket path instead of running it here");
+    PrintInfo("-stats          : (client) print the server's cache hit and miss latencies");
+    PrintInfo("-stop           : (client) shut down the server");
     verbosity = old_verbosity;
 }
 
+// Replaces the first run of '#' characters in a path with the zero padded frame number
+std::string expandFramePattern(const std::string& pattern, int frame)
+{
+    size_t first = pattern.find('#');
+    if (first == std::string::npos)
+        return pattern;
+    size_t last = pattern.find_first_not_of('#', first);
+    if (last == std::string::npos)
+        last = pattern.size();
+    char number[32];
+    sprintf(number, "%0*d", int(last - first), frame);
+    return pattern.substr(0, first) + number + pattern.substr(last);
+}
+
+bool isFramePattern(const std::string& path)
+{
+    return path.find('#') != std::string::npos;
+}
+
+// Parses "start-end" or a single frame number
+bool parseFrameRange(const std::string& range, int& start, int& end)
+{
+    try
+    {
+        size_t dash = range.find('-', 1);
+        start = std::stoi(range.substr(0, dash));
+        end = (dash == std::string::npos) ? start : std::stoi(range.substr(dash + 1));
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+    return end >= start;
+}
+
+// Parses a comma separated list of integers
+bool parseIntList(const std::string& list, std::vector<int>& values)
+{
+    std::stringstream stream(list);
+    std::string value;
+    try
+    {
+        while (std::getline(stream, value, ','))
+            values.push_back(std::stoi(value));
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+    return !values.empty();
+}
+
+// Parses a comma separated list of precisions e.g. "float,half"
+bool parsePrecisionList(const std::string& list, std::vector<PixelPrecision>& values)
+{
+    std::stringstream stream(list);
+    std::string value;
+    while (std::getline(stream, value, ','))
+    {
+        PixelPrecision precision;
+        if (!parsePrecision(value, precision))
+            return false;
+        values.push_back(precision);
+    }
+    return !values.empty();
+}
+
+// Parses a comma separated list of quality presets e.g. "fast,balanced,high"
+bool parseQualityList(const std::string& list, std::vector<oidn::Quality>& values)
+{
+    std::stringstream stream(list);
+    std::string value;
+    while (std::getline(stream, value, ','))
+    {
+        oidn::Quality quality;
+        if (!parseQuality(value, quality))
+            return false;
+        values.push_back(quality);
+    }
+    return !values.empty();
+}
+
+// Reads a manifest with one frame per line, using the same flags as the command line,
+// e.g. "-i beauty.0001.exr -a albedo.0001.exr -n normal.0001.exr -o out.0001.exr", optionally with "-roi x,y,w,h".
+// Empty lines and lines starting with '#' are ignored.
+bool readManifest(const std::string& path, std::vector<FrameJob>& jobs)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        PrintError("Could not open manifest %s", path.c_str());
+        return false;
+    }
+    std::string line;
+    int line_number = 0;
+    while (std::getline(file, line))
+    {
+        line_number++;
+        std::istringstream tokens(line);
+        std::string flag;
+        if (!(tokens >> flag) || flag[0] == '#')
+            continue;
+        FrameJob job;
+        do
+        {
+            std::string value;
+            if (!(tokens >> value))
+            {
+                PrintError("Manifest line %d: missing value for flag %s", line_number, flag.c_str());
+                return false;
+            }
+            if (flag == "-i")
+                job.beauty = value;
+            else if (flag == "-a")
+                job.albedo = value;
+            else if (flag == "-n")
+                job.normal = value;
+            else if (flag == "-o")
+                job.output = value;
+            else if (flag == "-roi")
+            {
+                if (!parseRegion(value, job.roi))
+                {
+                    PrintError("Manifest line %d: invalid region %s", line_number, value.c_str());
+                    return false;
+                }
+            }
+            else
+            {
+                PrintError("Manifest line %d: unknown flag %s", line_number, flag.c_str());
+                return false;
+            }
+        } while (tokens >> flag);
+        if (job.beauty.empty() || job.output.empty())
+        {
+            PrintError("Manifest line %d: an input (-i) and output (-o) are required", line_number);
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc > 1)
@@ -208,18 +303,51 @@ int main(int argc, char *argv[])
     PrintInfo("Launching OIDN AI Denoiser command line app v%d.%d", DENOISER_MAJOR_VERSION, DENOISER_MINOR_VERSION);
     PrintInfo("Created by Declan Russell (01/03/2019)");
 
-    bool b_loaded, n_loaded, a_loaded;
-    b_loaded = n_loaded = a_loaded = false;
+    // In client mode the job is forwarded to a running server instead of being run here
+    for (int i=1; i<argc-1; i++)
+    {
+        if (strcmp(argv[i], "-client"))
+            continue;
+        std::string socket_path( argv[i+1] );
+        std::vector<std::string> job_args;
+        for (int j=1; j<argc; j++)
+        {
+            const std::string arg( argv[j] );
+            if (arg == "-client" || arg == "-v")
+                j++;
+            else
+                job_args.push_back(arg);
+        }
+        exitfunc(runClient(socket_path, job_args));
+    }
 
     // Pass our command line args
-    std::string out_path;
+    FrameJob cmd_job;
+    // Extra -i/-o pairs denoised with the same AOVs
+    std::vector<std::string> layer_beauty, layer_output;
+    std::string frame_range;
+    std::string manifest_path;
+    std::string server_socket;
+    int cache_size = 4;
+    bool stream = false;
+    bool pipeline = false;
+    int num_instances = 0;
     bool affinity = false;
-    bool hdr = true;
-    bool srgb = false;
+    bool watch = false;
+    FarmSettings farm;
+    PreviewDenoiser preview;
+    bool preview_baseline = false;
+    bool prefilter_aux = false;
+    std::string prefilter_cache;
+    ResultCache results;
+    FilterSettings settings;
+    OutputSettings output_settings;
+    bool async_write = true;
     unsigned int num_runs = 1;
+    int num_warmup = -1;
+    bool benchmark = false;
+    BenchmarkSettings bench;
     int num_threads = 0;
-    int maxmem = -1;
-    bool clean_aux = false;
     if (argc == 1)
     {
         printParams();
@@ -231,72 +359,44 @@ int main(int argc, char *argv[])
         if (arg == "-i")
         {
             i++;
-            std::string path( argv[i] );
-            if (verbosity >= 2)
-                PrintInfo("Input image: %s", path.c_str());
-            input_beauty = new OIIO::ImageBuf(path);
-            if (input_beauty->init_spec(path, 0, 0))
-            {
-                if (verbosity >= 2)
-                    PrintInfo("Loaded successfully");
-                b_loaded = true;
-            }
+            if (cmd_job.beauty.empty())
+                cmd_job.beauty = std::string( argv[i] );
             else
-            {
-                PrintError("Failed to load input image");
-                PrintError("[OIIO]: %s", input_beauty->geterror().c_str());
-                cleanup();
-                exitfunc(EXIT_FAILURE);
-            }
+                layer_beauty.push_back(std::string( argv[i] ));
         }
         else if (arg == "-n")
         {
             i++;
-            std::string path( argv[i] );
-            if (verbosity >= 2)
-                PrintInfo("Normal image: %s", path.c_str());
-            input_normal = new OIIO::ImageBuf(path);
-            if (input_normal->init_spec(path, 0, 0))
-            {
-                if (verbosity >= 2)
-                    PrintInfo("Loaded successfully");
-                n_loaded = true;
-            }
-            else
-            {
-                PrintError("Failed to load normal image");
-                PrintError("[OIIO]: %s", input_normal->geterror().c_str());
-                cleanup();
-                exitfunc(EXIT_FAILURE);
-            }
+            cmd_job.normal = std::string( argv[i] );
         }
         else if (arg == "-a")
         {
             i++;
-            std::string path( argv[i] );
-            if (verbosity >= 2)
-                PrintInfo("Albedo image: %s", path.c_str());
-            input_albedo = new OIIO::ImageBuf(path);
-            if (input_albedo->init_spec(path, 0, 0))
-            {
-                if (verbosity >= 2)
-                    PrintInfo("Loaded successfully");
-                a_loaded = true;
-            }
-            else
-            {
-                PrintError("Failed to load albedo image");
-                PrintError("[OIIO]: %s", input_albedo->geterror().c_str());
-                cleanup();
-                exitfunc(EXIT_FAILURE);
-            }
+            cmd_job.albedo = std::string( argv[i] );
         }
         else if(arg == "-o")
         {
             i++;
-            out_path = std::string( argv[i] );
+            if (cmd_job.output.empty())
+                cmd_job.output = std::string( argv[i] );
+            else
+                layer_output.push_back(std::string( argv[i] ));
+            if (verbosity >= 2)
+                PrintInfo("Output image: %s", argv[i]);
+        }
+        else if (arg == "-frames")
+        {
+            i++;
+            frame_range = std::string( argv[i] );
+            if (verbosity >= 2)
+                PrintInfo("Frame range set to %s", frame_range.c_str());
+        }
+        else if (arg == "-list")
+        {
+            i++;
+            manifest_path = std::string( argv[i] );
             if (verbosity >= 2)
-                PrintInfo("Output image: %s", out_path.c_str());
+                PrintInfo("Frame manifest: %s", manifest_path.c_str());
         }
         else if (arg == "-affinity")
         {
@@ -310,22 +410,22 @@ int main(int argc, char *argv[])
         {
             i++;
             std::string hdr_string( argv[i] );
-            hdr = bool(std::stoi(hdr_string));
+            settings.hdr = bool(std::stoi(hdr_string));
             if (verbosity >= 2)
-                PrintInfo((hdr) ? "HDR training data enabled" : "HDR training data disabled");
-            if (!hdr)
+                PrintInfo((settings.hdr) ? "HDR training data enabled" : "HDR training data disabled");
+            if (!settings.hdr)
             {
                 PrintInfo("Enabling sRGB mode due to LDR");
-                srgb = true;
+                settings.srgb = true;
             }
         }
         else if (arg == "-srgb")
         {
             i++;
             std::string srgb_string( argv[i] );
-            srgb = bool(std::stoi(srgb_string));
+            settings.srgb = bool(std::stoi(srgb_string));
             if (verbosity >= 2)
-                PrintInfo((srgb) ? "sRGB mode enabled" : "sRGB mode disabled");
+                PrintInfo((settings.srgb) ? "sRGB mode enabled" : "sRGB mode disabled");
         }
         else if (arg == "-t")
         {
@@ -343,21 +443,326 @@ int main(int argc, char *argv[])
             if (verbosity >= 2)
                 PrintInfo("Number of repeats set to %d", num_runs);
         }
+        else if (arg == "-warmup")
+        {
+            i++;
+            std::string warmup_string( argv[i] );
+            num_warmup = std::max(std::stoi(warmup_string), 0);
+            if (verbosity >= 2)
+                PrintInfo("Number of warmup runs set to %d", num_warmup);
+        }
+        else if (arg == "-bench")
+        {
+            i++;
+            std::string bench_string( argv[i] );
+            benchmark = bool(std::stoi(bench_string));
+            if (verbosity >= 2)
+                PrintInfo((benchmark) ? "Benchmark mode enabled" : "Benchmark mode disabled");
+        }
+        else if (arg == "-bench_threads")
+        {
+            i++;
+            if (!parseIntList(argv[i], bench.threads))
+            {
+                PrintError("Invalid thread count list %s", argv[i]);
+                exitfunc(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "-bench_maxmem")
+        {
+            i++;
+            if (!parseIntList(argv[i], bench.maxmem))
+            {
+                PrintError("Invalid memory limit list %s", argv[i]);
+                exitfunc(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "-bench_out")
+        {
+            i++;
+            bench.output = std::string( argv[i] );
+            if (verbosity >= 2)
+                PrintInfo("Benchmark results file: %s", bench.output.c_str());
+        }
         else if (arg == "-maxmem")
         {
             i++;
             std::string maxmem_string( argv[i] );
-            maxmem = float(std::stoi(maxmem_string));
+            settings.maxmem = std::stoi(maxmem_string);
+            if (verbosity >= 2)
+                PrintInfo("Maximum denoiser memory set to %dMB", settings.maxmem);
+        }
+        else if (arg == "-precision")
+        {
+            i++;
+            if (!parsePrecision(argv[i], settings.precision))
+            {
+                PrintError("Invalid precision %s, expected auto, float or half", argv[i]);
+                exitfunc(EXIT_FAILURE);
+            }
+            if (verbosity >= 2)
+                PrintInfo("Precision set to %s", precisionName(settings.precision));
+        }
+        else if (arg == "-compression")
+        {
+            i++;
+            output_settings.compression = std::string( argv[i] );
+            if (verbosity >= 2)
+                PrintInfo("Output compression set to %s", output_settings.compression.c_str());
+        }
+        else if (arg == "-compression_level")
+        {
+            i++;
+            std::string level_string( argv[i] );
+            output_settings.compression_level = std::stoi(level_string);
+            if (verbosity >= 2)
+                PrintInfo("Output compression level set to %d", output_settings.compression_level);
+        }
+        else if (arg == "-out_format")
+        {
+            i++;
+            if (!parseOutputFormat(argv[i], output_settings.format))
+            {
+                PrintError("Invalid output format %s, expected half, float, uint8 or uint16", argv[i]);
+                exitfunc(EXIT_FAILURE);
+            }
+            if (verbosity >= 2)
+                PrintInfo("Output format set to %s", argv[i]);
+        }
+        else if (arg == "-async_write")
+        {
+            i++;
+            std::string async_string( argv[i] );
+            async_write = bool(std::stoi(async_string));
             if (verbosity >= 2)
-                PrintInfo("Maximum denoiser memory set to %dMB", maxmem);
+                PrintInfo((async_write) ? "Background writing enabled" : "Background writing disabled");
+        }
+        else if (arg == "-bench_precision")
+        {
+            i++;
+            if (!parsePrecisionList(argv[i], bench.precision))
+            {
+                PrintError("Invalid precision list %s", argv[i]);
+                exitfunc(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "-bench_quality")
+        {
+            i++;
+            if (!parseQualityList(argv[i], bench.quality))
+            {
+                PrintError("Invalid quality list %s", argv[i]);
+                exitfunc(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "-quality")
+        {
+            i++;
+            if (!parseQuality(argv[i], settings.quality))
+            {
+                PrintError("Invalid quality %s, expected default, fast, balanced or high", argv[i]);
+                exitfunc(EXIT_FAILURE);
+            }
+            if (verbosity >= 2)
+                PrintInfo("Quality set to %s", qualityName(settings.quality));
+        }
+        else if (arg == "-weights")
+        {
+            i++;
+            settings.weights = std::string( argv[i] );
+            if (verbosity >= 2)
+                PrintInfo("Custom weights: %s", settings.weights.c_str());
         }
         else if (arg == "-clean_aux")
         {
             i++;
             std::string clean_aux_string( argv[i] );
-            clean_aux = bool(std::stoi(clean_aux_string));
+            settings.clean_aux = bool(std::stoi(clean_aux_string));
+            if (verbosity >= 2)
+                PrintInfo((settings.clean_aux) ? "cleanAux enabled" : "cleanAux disabled");
+        }
+        else if (arg == "-roi")
+        {
+            i++;
+            if (!parseRegion(argv[i], cmd_job.roi))
+            {
+                PrintError("Invalid region %s, expected x,y,w,h", argv[i]);
+                exitfunc(EXIT_FAILURE);
+            }
+        }
+        else if (arg == "-sanitize")
+        {
+            i++;
+            std::string sanitize_string( argv[i] );
+            settings.preprocess.sanitize = bool(std::stoi(sanitize_string));
+            if (verbosity >= 2)
+                PrintInfo((settings.preprocess.sanitize) ? "Input sanitising enabled" : "Input sanitising disabled");
+        }
+        else if (arg == "-normal_remap")
+        {
+            i++;
+            std::string remap_string( argv[i] );
+            settings.preprocess.normal_remap = bool(std::stoi(remap_string));
+            if (verbosity >= 2)
+                PrintInfo((settings.preprocess.normal_remap) ? "Normal remapping enabled" : "Normal remapping disabled");
+        }
+        else if (arg == "-exposure")
+        {
+            i++;
+            std::string exposure_string( argv[i] );
+            settings.preprocess.exposure = std::stof(exposure_string);
+            if (verbosity >= 2)
+                PrintInfo("Exposure set to %.2f stops", settings.preprocess.exposure);
+        }
+        else if (arg == "-deadline")
+        {
+            i++;
+            std::string deadline_string( argv[i] );
+            settings.deadline_ms = std::stod(deadline_string);
+            if (verbosity >= 2)
+                PrintInfo("Deadline set to %.0f ms", settings.deadline_ms);
+        }
+        else if (arg == "-fallback")
+        {
+            i++;
+            std::string fallback_string( argv[i] );
+            if (!parseFallbacks(fallback_string, settings.fallbacks))
+            {
+                PrintError("Unknown fallback in %s, expected fast, lowres or noisy", fallback_string.c_str());
+                exitfunc(EXIT_FAILURE);
+            }
+            if (verbosity >= 2)
+                PrintInfo("Fallbacks set to %s", fallback_string.c_str());
+        }
+        else if (arg == "-prefilter")
+        {
+            i++;
+            std::string prefilter_string( argv[i] );
+            prefilter_aux = bool(std::stoi(prefilter_string));
+            if (verbosity >= 2)
+                PrintInfo((prefilter_aux) ? "AOV prefiltering enabled" : "AOV prefiltering disabled");
+        }
+        else if (arg == "-prefilter_cache")
+        {
+            i++;
+            prefilter_cache = std::string( argv[i] );
+            if (verbosity >= 2)
+                PrintInfo("Prefiltered AOV cache: %s", prefilter_cache.c_str());
+        }
+        else if (arg == "-result_cache")
+        {
+            i++;
+            results.dir = std::string( argv[i] );
+            if (verbosity >= 2)
+                PrintInfo("Result cache: %s", results.dir.c_str());
+        }
+        else if (arg == "-result_cache_mb")
+        {
+            i++;
+            std::string mb_string( argv[i] );
+            results.max_mb = std::max(std::stoll(mb_string), 0LL);
+            if (verbosity >= 2)
+                PrintInfo("Result cache limited to %lld MB", (long long)results.max_mb);
+        }
+        else if (arg == "-stream")
+        {
+            i++;
+            std::string stream_string( argv[i] );
+            stream = bool(std::stoi(stream_string));
             if (verbosity >= 2)
-                PrintInfo((clean_aux) ? "cleanAux enabled" : "cleanAux disabled");
+                PrintInfo((stream) ? "Streaming enabled" : "Streaming disabled");
+        }
+        else if (arg == "-pipeline")
+        {
+            i++;
+            std::string pipeline_string( argv[i] );
+            pipeline = bool(std::stoi(pipeline_string));
+            if (verbosity >= 2)
+                PrintInfo((pipeline) ? "Pipelined sequence enabled" : "Pipelined sequence disabled");
+        }
+        else if (arg == "-instances")
+        {
+            i++;
+            std::string instances_string( argv[i] );
+            num_instances = std::stoi(instances_string);
+            if (verbosity >= 2)
+                PrintInfo("Number of instances set to %d", num_instances);
+        }
+        else if (arg == "-farm")
+        {
+            i++;
+            std::string farm_string( argv[i] );
+            farm.num_workers = std::stoi(farm_string);
+            if (verbosity >= 2)
+                PrintInfo("Tile farm workers set to %d", farm.num_workers);
+        }
+        else if (arg == "-farm_tiles")
+        {
+            i++;
+            std::string tiles_string( argv[i] );
+            farm.num_tiles = std::stoi(tiles_string);
+            if (verbosity >= 2)
+                PrintInfo("Tile farm tiles set to %d", farm.num_tiles);
+        }
+        else if (arg == "-farm_baseline")
+        {
+            i++;
+            std::string baseline_string( argv[i] );
+            farm.baseline = bool(std::stoi(baseline_string));
+            if (verbosity >= 2)
+                PrintInfo((farm.baseline) ? "Tile farm baseline enabled" : "Tile farm baseline disabled");
+        }
+        else if (arg == "-preview")
+        {
+            i++;
+            std::string preview_string( argv[i] );
+            preview.factor = std::stoi(preview_string);
+            if (preview.factor < 2)
+                preview.factor = 0;
+            if (verbosity >= 2)
+            {
+                if (preview.factor)
+                    PrintInfo("Previews at 1/%d resolution", preview.factor);
+                else
+                    PrintInfo("Previews disabled");
+            }
+        }
+        else if (arg == "-preview_baseline")
+        {
+            i++;
+            std::string baseline_string( argv[i] );
+            preview_baseline = bool(std::stoi(baseline_string));
+            if (verbosity >= 2)
+                PrintInfo((preview_baseline) ? "Preview baseline enabled" : "Preview baseline disabled");
+        }
+        else if (arg == "-watch")
+        {
+            i++;
+            std::string watch_string( argv[i] );
+            watch = bool(std::stoi(watch_string));
+            if (verbosity >= 2)
+                PrintInfo((watch) ? "Watch mode enabled" : "Watch mode disabled");
+        }
+        else if (arg == "-trace")
+        {
+            i++;
+            std::string trace_path( argv[i] );
+            startTrace(trace_path);
+            if (verbosity >= 2)
+                PrintInfo("Writing trace to %s", trace_path.c_str());
+        }
+        else if (arg == "-server")
+        {
+            i++;
+            server_socket = std::string( argv[i] );
+        }
+        else if (arg == "-cache")
+        {
+            i++;
+            std::string cache_string( argv[i] );
+            cache_size = std::max(std::stoi(cache_string), 1);
+            if (verbosity >= 2)
+                PrintInfo("Filter cache size set to %d", cache_size);
         }
         else if (arg == "-h" || arg == "--help")
         {
@@ -365,258 +770,376 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (srgb && hdr)
+    // Only the frame by frame path prefilters. The prefiltered AOVs are noise-free.
+    if (prefilter_aux && (stream || pipeline || num_instances > 0 || benchmark || farm.num_workers > 0))
+    {
+        PrintInfo("Ignoring -prefilter, it is not supported with -stream, -pipeline, -instances, -bench or -farm");
+        prefilter_aux = false;
+    }
+    if (prefilter_aux)
+        settings.clean_aux = true;
+
+    if (settings.srgb && settings.hdr)
     {
         PrintInfo("Disbaling sRGB, incompatble with HDR input");
-        srgb = false;
+        settings.srgb = false;
     }
 
-    // Check if a beauty has been loaded
-    if (!b_loaded)
+    setEncodeThreads(num_threads);
+
+    if (!server_socket.empty())
+        exitfunc(runServer(server_socket, num_threads, affinity, cache_size));
+
+    // Build the list of frames to denoise
+    std::vector<FrameJob> jobs;
+    if (!manifest_path.empty())
     {
-        PrintError("No input image could be loaded");
-        cleanup();
+        if (!readManifest(manifest_path, jobs))
+        {
+            exitfunc(EXIT_FAILURE);
+        }
+    }
+    else if (layer_beauty.size() != layer_output.size())
+    {
+        PrintError("Each -i layer needs its own -o");
         exitfunc(EXIT_FAILURE);
     }
+    else if (!frame_range.empty() || isFramePattern(cmd_job.beauty))
+    {
+        int first_frame, last_frame;
+        if (frame_range.empty() || !parseFrameRange(frame_range, first_frame, last_frame))
+        {
+            PrintError("A frame sequence requires a valid frame range e.g. -frames 1-100");
+            exitfunc(EXIT_FAILURE);
+        }
+        layer_beauty.insert(layer_beauty.begin(), cmd_job.beauty);
+        layer_output.insert(layer_output.begin(), cmd_job.output);
+        for (size_t l = 0; l < layer_beauty.size(); l++)
+        {
+            if (!isFramePattern(layer_beauty[l]) || !isFramePattern(layer_output[l]))
+            {
+                PrintError("Input and output paths must contain a frame pattern e.g. beauty.####.exr");
+                exitfunc(EXIT_FAILURE);
+            }
+        }
+        // All the layers of a frame are denoised together so they share its AOVs
+        for (int frame = first_frame; frame <= last_frame; frame++)
+        {
+            for (size_t l = 0; l < layer_beauty.size(); l++)
+            {
+                FrameJob job;
+                job.beauty = expandFramePattern(layer_beauty[l], frame);
+                job.albedo = expandFramePattern(cmd_job.albedo, frame);
+                job.normal = expandFramePattern(cmd_job.normal, frame);
+                job.output = expandFramePattern(layer_output[l], frame);
+                job.roi = cmd_job.roi;
+                jobs.push_back(job);
+            }
+        }
+    }
+    else if (!cmd_job.beauty.empty())
+    {
+        jobs.push_back(cmd_job);
+        for (size_t l = 0; l < layer_beauty.size(); l++)
+        {
+            FrameJob job = cmd_job;
+            job.beauty = layer_beauty[l];
+            job.output = layer_output[l];
+            jobs.push_back(job);
+        }
+    }
+    const bool layers = !layer_beauty.empty();
+
+    // Streaming and pipelining read and write the files directly
+    if (stream || pipeline)
+    {
+        for (const FrameJob& job : jobs)
+        {
+            if (job.roi.defined())
+            {
+                PrintError("-roi is not supported with -stream or -pipeline");
+                exitfunc(EXIT_FAILURE);
+            }
+            if (hasChannelSelector(job.beauty) || hasChannelSelector(job.albedo) ||
+                hasChannelSelector(job.normal) || hasChannelSelector(job.output))
+            {
+                PrintError("Channel selection is not supported with -stream or -pipeline");
+                exitfunc(EXIT_FAILURE);
+            }
+        }
+    }
 
-    // If a normal AOV is loaded then we also require an albedo AOV
-    if (n_loaded && !a_loaded)
+    // Check if a beauty has been given
+    if (jobs.empty())
     {
-        PrintError("You cannot use a normal AOV without an albedo");
-        cleanup();
+        PrintError("No input image could be loaded");
         exitfunc(EXIT_FAILURE);
     }
 
-    // Check for a file extension
-    int x = (int)out_path.find_last_of(".");
-    x++;
-    const char* ext_c = out_path.c_str()+x;
-    std::string ext(ext_c);
-    if (!ext.size())
+    // Watching keeps denoising the layers of one frame
+    if (watch && (stream || pipeline || num_instances > 0 || benchmark || !frame_range.empty() || !manifest_path.empty()))
     {
-        PrintError("No output file extension");
-        cleanup();
+        PrintError("-watch is not supported with -stream, -pipeline, -instances, -bench, -frames or -list");
         exitfunc(EXIT_FAILURE);
     }
 
-    OIIO::ROI beauty_roi, albedo_roi, normal_roi;
-    beauty_roi = OIIO::get_roi_full(input_beauty->spec());
-    int b_width = beauty_roi.width();
-    int b_height = beauty_roi.height();
-    if (a_loaded)
+    // The farm splits frames across its own processes
+    if (farm.num_workers > 0 && (stream || pipeline || num_instances > 0 || watch || benchmark))
     {
-        albedo_roi = OIIO::get_roi_full(input_albedo->spec());
-        if (n_loaded)
-            normal_roi = OIIO::get_roi_full(input_normal->spec());
+        PrintError("-farm is not supported with -stream, -pipeline, -instances, -watch or -bench");
+        exitfunc(EXIT_FAILURE);
     }
 
-    // Check that our feature buffers are the same resolution as our beauty
-    int a_width = (a_loaded) ? albedo_roi.width() : 0;
-    int a_height = (a_loaded) ? albedo_roi.height() : 0;
-    if (a_loaded)
+    // Shared memory images are denoised where they are, one whole frame at a time
+    bool shared = false;
+    for (const FrameJob& job : jobs)
     {
-        if (a_width != b_width || a_height != b_height)
+        if (!isSharedJob(job))
+            continue;
+        shared = true;
+        if (job.roi.defined())
         {
-            PrintError("Aldedo image not same resolution as beauty");
-            cleanup();
+            PrintError("-roi is not supported with shared memory images");
             exitfunc(EXIT_FAILURE);
         }
     }
+    if (shared && (stream || pipeline || num_instances > 0 || watch || benchmark || farm.num_workers > 0 || layers))
+    {
+        PrintError("Shared memory images are not supported with -stream, -pipeline, -instances, -watch, -bench, -farm or extra layers");
+        exitfunc(EXIT_FAILURE);
+    }
+    if (shared && (prefilter_aux || settings.preprocess.enabled()))
+    {
+        PrintInfo("Ignoring -prefilter and preprocessing, shared memory images are denoised without copying them");
+        // The AOVs were only going to be clean once prefiltered
+        if (prefilter_aux)
+            settings.clean_aux = false;
+        prefilter_aux = false;
+        settings.preprocess = PreprocessSettings();
+    }
 
-    int n_width = (n_loaded) ? normal_roi.width() : 0;
-    int n_height = (n_loaded) ? normal_roi.height() : 0;
-    if (n_loaded)
+    // Previews are denoised frame by frame with their own reduced resolution filter
+    if (preview.factor > 0 && (stream || pipeline || num_instances > 0 || watch || benchmark || farm.num_workers > 0 || shared))
     {
-        if (n_width != b_width || n_height != b_height)
-        {
-            PrintError("Normal image not same resolution as beauty");
-            cleanup();
-            exitfunc(EXIT_FAILURE);
-        }
+        PrintError("-preview is not supported with -stream, -pipeline, -instances, -watch, -bench, -farm or shared memory images");
+        exitfunc(EXIT_FAILURE);
+    }
+    if (preview.factor > 0 && (prefilter_aux || settings.deadline_ms > 0.0 || !results.dir.empty()))
+    {
+        PrintInfo("Ignoring -prefilter, -deadline and -result_cache for previews");
+        if (prefilter_aux)
+            settings.clean_aux = false;
+        prefilter_aux = false;
+        settings.deadline_ms = 0.0;
+        results.dir.clear();
     }
+    output_settings.preview = preview.factor;
 
-    // Create our output buffer
-    std::vector<float> output_pixels(b_width * b_height * 3);
+    // Results are cached for whole frames denoised one at a time
+    if (!results.dir.empty() && (stream || pipeline || num_instances > 0 || watch || benchmark || farm.num_workers > 0 || shared))
+    {
+        PrintInfo("Ignoring -result_cache with -stream, -pipeline, -instances, -watch, -bench, -farm or shared memory images");
+        results.dir.clear();
+    }
+    if (!results.dir.empty() && num_runs + std::max(num_warmup, 0) > 1)
+        PrintInfo("The result cache is not used for repeated runs");
 
-    // Get our pixel data
-    std::vector<float> beauty_pixels(b_width * b_height * beauty_roi.nchannels());
-    input_beauty->get_pixels(beauty_roi, OIIO::TypeDesc::FLOAT, &beauty_pixels[0]);
-    std::vector<float> beauty_pixels_float3(b_width * b_height * 3);
-    // Convert buffer to float3
-    float* in = (float*)beauty_pixels.data();
-    float* out = (float*)beauty_pixels_float3.data();
-    for (unsigned int i = 0; i < beauty_pixels.size(); i+=beauty_roi.nchannels())
+    // Deadlines stop the execution of whole frames
+    if (settings.deadline_ms > 0.0 && (stream || pipeline || watch || benchmark || farm.num_workers > 0 || shared))
     {
-        if (!convertToFormat(in, out, beauty_roi.nchannels(), 3))
-        {
-            PrintError("Failed to convert beauty to float3");
-            cleanup();
-            exitfunc(EXIT_FAILURE);
-        }
-        in += beauty_roi.nchannels();
-        out += 3;
+        PrintInfo("Ignoring -deadline with -stream, -pipeline, -watch, -bench, -farm or shared memory images");
+        settings.deadline_ms = 0.0;
     }
 
+    if (benchmark)
+    {
+        if (bench.threads.empty())
+            bench.threads.push_back(num_threads);
+        if (bench.precision.empty())
+            bench.precision.push_back(settings.precision);
+        bench.num_runs = (num_runs > 1) ? num_runs : 10;
+        bench.num_warmup = (num_warmup >= 0) ? num_warmup : 1;
+        exitfunc(runBenchmark(jobs[0], bench, settings, affinity));
+    }
+    if (num_warmup < 0)
+        num_warmup = 0;
 
-    std::vector<float> albedo_pixels;
-    if (a_loaded)
+    // Every other mode saves its result
+    for (const FrameJob& job : jobs)
     {
-        std::vector<float> albedo_pixels_temp(a_width * a_height * albedo_roi.nchannels());
-        input_albedo->get_pixels(albedo_roi, OIIO::TypeDesc::FLOAT, &albedo_pixels_temp[0]);
-        albedo_pixels.resize(a_width * a_height * 3);
-        in = (float*)albedo_pixels_temp.data();
-        out = (float*)albedo_pixels.data();
-        // Convert buffer to float3
-        for (unsigned int i = 0; i < albedo_pixels_temp.size(); i+=albedo_roi.nchannels())
+        if (job.output.empty())
         {
-            if (!convertToFormat(in, out, albedo_roi.nchannels(), 3))
-            {
-                PrintError("Failed to convert albedo to float3");
-                cleanup();
-                exitfunc(EXIT_FAILURE);
-            }
-            in += albedo_roi.nchannels();
-            out += 3;
+            PrintError("No output image given");
+            exitfunc(EXIT_FAILURE);
         }
     }
 
-    std::vector<float> normal_pixels;
-    if (n_loaded)
+    // The farm workers are separate processes too, and the farm doesn't initialize OIDN itself
+    if (farm.num_workers > 0)
     {
-        std::vector<float> normal_pixels_temp(n_width * n_height * normal_roi.nchannels());
-        input_normal->get_pixels(normal_roi, OIIO::TypeDesc::FLOAT, &normal_pixels_temp[0]);
-        normal_pixels.resize(n_width * n_height * 3);
-        in = (float*)normal_pixels_temp.data();
-        out = (float*)normal_pixels.data();
-        // Convert buffer to float3
-        for (unsigned int i = 0; i < normal_pixels_temp.size(); i+=normal_roi.nchannels())
-        {
-            if (!convertToFormat(in, out, normal_roi.nchannels(), 3))
-            {
-                PrintError("Failed to convert normal to float3");
-                cleanup();
-                exitfunc(EXIT_FAILURE);
-            }
-            in += normal_roi.nchannels();
-            out += 3;
-        }
+        if (num_runs > 1)
+            PrintInfo("Ignoring -repeat for a tile farm");
+        int num_failed = runTileFarm(jobs, farm, settings, output_settings);
+        exitfunc(num_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    // The instances are separate processes, so they must be started before OIDN is initialized here
+    if (num_instances > 0)
+    {
+        int num_failed = runInstances(jobs, num_instances, settings, output_settings);
+        exitfunc(num_failed ? EXIT_FAILURE : EXIT_SUCCESS);
     }
 
     // Catch exceptions
+    oidn::DeviceRef device;
+    oidn::FilterRef filter;
+    DeadlineFallbacks deadlines;
     try
     {
         PrintInfo("Initializing OIDN");
-        // Create our device. We explicitly request the CPU device: the app feeds
-        // OIDN shared images backed by host (OIIO) memory, which GPU devices can't
-        // access. OIDN >= 2.0 would otherwise auto-select a GPU back-end if present.
-        oidn::DeviceRef device = oidn::newDevice(oidn::DeviceType::CPU);
-        const char* errorMessage;
-        if (device.getError(errorMessage) != oidn::Error::None)
-           throw std::runtime_error(errorMessage);
-        device.setErrorFunction(errorCallback);
-        // Set our device parameters
-        if (num_threads)
-            device.set("numThreads", num_threads);
-        if (affinity)
-            device.set("setAffinity", affinity);
-
-        // Commit the changes to the device
-        device.commit();
+        device = createDevice(num_threads, affinity);
         const int versionMajor = device.get<int>("versionMajor");
         const int versionMinor = device.get<int>("versionMinor");
         const int versionPatch = device.get<int>("versionPatch");
 
         PrintInfo("Using OIDN version %d.%d.%d", versionMajor, versionMinor, versionPatch);
 
-        // Create the AI filter
-        oidn::FilterRef filter = device.newFilter("RT");
-
-        // Set our progress callback
-        filter.setProgressMonitorFunction((oidn::ProgressMonitorFunction)progressCallback);
-
-        // Set our filter paramaters
-
-        // Set our the filter images
-        filter.setImage("color", (void*)&beauty_pixels_float3[0], oidn::Format::Float3, b_width, b_height);
-        if (a_loaded)
-            filter.setImage("albedo", (void*)&albedo_pixels[0], oidn::Format::Float3, a_width, a_height);
-        if (n_loaded)
-            filter.setImage("normal", (void*)&normal_pixels[0], oidn::Format::Float3, n_width, n_height);
-        filter.setImage("output", (void*)&output_pixels[0], oidn::Format::Float3, b_width, b_height);
-
-        filter.set("hdr", hdr);
-        filter.set("srgb", srgb);
-        if (maxmem >= 0)
-            filter.set("maxMemoryMB", maxmem);
-        filter.set("cleanAux", clean_aux);
-
-        // Commit changes to the filter
-        filter.commit();
-
-        // Execute denoise
-        int sum = 0;
-        for (unsigned int i = 0; i < num_runs; i++)
-        {
-            PrintInfo("Denoising...");
-            clock_t start = clock(), diff;
-            filter.execute();
-            diff = clock() - start;
-            int msec = diff * 1000 / CLOCKS_PER_SEC;
-            if (num_runs > 1)
-                PrintInfo("Denoising run %d complete in %d.%03d seconds", i+1, msec/1000, msec%1000);
-            else
-                PrintInfo("Denoising complete in %d.%03d seconds", msec/1000, msec%1000);
-            sum += msec;
-        }
-        if (num_runs > 1)
-        {
-            sum /= num_runs;
-            PrintInfo("Denoising avg of %d complete in %d.%03d seconds", num_runs, sum/1000, sum%1000);
-        }
-
+        // Results are keyed by the weights the filter was actually given, however the file changes later
+        WeightsBlob weights;
+        filter = createFilter(device, settings, &deadlines.control, &weights);
+        if (weights.data && !results.dir.empty())
+            results.weights = hashWeights(weights);
+        deadlines.device = device;
+        preview.device = device;
     }
     catch (const std::exception& e)
     {
         PrintError("[OIDN]: %s", e.what());
-        cleanup();
         exitfunc(EXIT_FAILURE);
     }
 
+    if (pipeline && !stream)
+    {
+        if (num_runs > 1)
+            PrintInfo("Ignoring -repeat for a pipelined sequence");
+        int num_failed = runPipeline(jobs, filter, settings.preprocess, output_settings);
+        exitfunc(num_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    AuxPrefilter prefilter;
+    prefilter.device = device;
+    prefilter.settings = settings;
+    prefilter.cache_dir = prefilter_cache;
+    prefilter.control = &deadlines.control;
+    results.version = device.get<int>("version");
 
-    // If the image already exists delete it
-    remove(out_path.c_str());
+    if (watch)
+    {
+        if (num_runs > 1)
+            PrintInfo("Ignoring -repeat in watch mode");
+        exitfunc(runWatch(jobs, device, settings, output_settings, prefilter_aux ? &prefilter : nullptr));
+    }
 
-    // Convert the image back to the original format
-    in = (float*)output_pixels.data();
-    out = (float*)beauty_pixels.data();
-    // Convert buffer to float3
-    for (unsigned int i = 0; i < output_pixels.size(); i+=3)
+    if (shared)
     {
-        if (!convertToFormat(in, out, 3, beauty_roi.nchannels()))
+        if (num_runs > 1)
+            PrintInfo("Ignoring -repeat for shared memory images");
+        SharedRegions regions;
+        SharedBinding bound;
+        int num_failed = 0;
+        for (size_t f = 0; f < jobs.size(); f++)
         {
-            PrintError("Failed to convert output to original format");
-            cleanup();
-            exitfunc(EXIT_FAILURE);
+            if (jobs.size() > 1)
+                PrintInfo("Frame %d/%d: %s", int(f+1), int(jobs.size()), jobs[f].beauty.c_str());
+            TraceScope trace("frame", jobs[f].beauty);
+            SharedFrame frame;
+            double denoise_ms = 0.0;
+            if (!openSharedFrame(jobs[f], regions, frame) || !denoiseSharedFrame(frame, filter, bound, denoise_ms))
+            {
+                PrintError("Frame %d failed: %s", int(f+1), jobs[f].beauty.c_str());
+                num_failed++;
+            }
+        }
+        exitfunc(num_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if (preview.factor > 0 && num_runs > 1)
+        PrintInfo("Ignoring -repeat for previews");
+
+    // In stream mode -maxmem is the budget for the whole run rather than just OIDN
+    const int stream_budget = (settings.maxmem >= 0) ? settings.maxmem : 1024;
+
+    // Denoise all of our frames, reusing the device, filters and buffers. Each frame is
+    // saved in the background while the next one is denoised.
+    DenoiseBuffers buffers;
+    // Multi-channel files shared by the layers of a frame are only read once
+    SourceFiles sources;
+    FrameWriter writer(output_settings, async_write && !stream);
+    int num_failed = 0;
+    double total_denoise_ms = 0.0;
+    double total_pixels = 0.0;
+    const char* item = layers ? "Layer" : "Frame";
+    auto sequence_start = std::chrono::high_resolution_clock::now();
+    for (size_t f = 0; f < jobs.size(); f++)
+    {
+        if (jobs.size() > 1)
+            PrintInfo("%s %d/%d: %s", item, int(f+1), int(jobs.size()), jobs[f].beauty.c_str());
+        auto frame_start = std::chrono::high_resolution_clock::now();
+        double denoise_ms = 0.0;
+        int width = 0, height = 0;
+        FrameImages images;
+        TraceScope trace("frame", jobs[f].beauty);
+        bool success;
+        if (stream)
+            success = streamDenoise(jobs[f], device, settings, stream_budget, output_settings, width, height, denoise_ms);
+        else if (preview.factor > 0)
+            success = openFrame(jobs[f], images, width, height, &sources) &&
+                      previewFrame(jobs[f], images, preview, buffers, settings, denoise_ms,
+                                   preview_baseline ? &filter : nullptr, &writer);
+        else
+            success = openFrame(jobs[f], images, width, height, &sources) &&
+                      denoiseFrame(jobs[f], images, filter, buffers, settings, num_runs, num_warmup, denoise_ms,
+                                   prefilter_aux ? &prefilter : nullptr, &writer, &deadlines,
+                                   results.dir.empty() ? nullptr : &results);
+        if (!success)
+        {
+            if (jobs.size() == 1)
+            {
+                writer.finish();
+                exitfunc(EXIT_FAILURE);
+            }
+            PrintError("%s %d failed: %s", item, int(f+1), jobs[f].beauty.c_str());
+            num_failed++;
+            continue;
+        }
+        total_denoise_ms += denoise_ms;
+        total_pixels += double(width) * height;
+        if (jobs.size() > 1)
+        {
+            double frame_ms = elapsedMilliseconds(frame_start);
+            PrintInfo("%s %d/%d complete in %.3f seconds (denoise %.3f seconds, %.2f Mpixels/s)",
+                      item, int(f+1), int(jobs.size()), frame_ms / 1000.0, denoise_ms / 1000.0,
+                      double(width) * height / (frame_ms * 1000.0));
         }
-        in += 3;
-        out += beauty_roi.nchannels();
     }
 
-    // Set our OIIO pixels
-    if (!input_beauty->set_pixels(beauty_roi, OIIO::TypeDesc::FLOAT, &beauty_pixels[0]))
-        PrintError("Something went wrong setting pixels");
+    // Wait for the last saves, which count towards the sequence time
+    num_failed += writer.finish();
 
-    // Save the output image
-    PrintInfo("Saving to: %s", out_path.c_str());
-    if (input_beauty->write(out_path))
-        PrintInfo("Done!");
-    else
+    if (jobs.size() > 1)
     {
-        PrintError("Could not save file %s", out_path.c_str());
-        PrintError("[OIIO]: %s", input_beauty->geterror().c_str());
+        double total_s = elapsedMilliseconds(sequence_start) / 1000.0;
+        int num_done = int(jobs.size()) - num_failed;
+        const char* items = layers ? "layers" : "frames";
+        PrintInfo("Sequence of %d %s complete in %.3f seconds (%d failed)", num_done, items, total_s, num_failed);
+        PrintInfo("Throughput: %.2f %s/s, %.2f Mpixels/s, %.3f seconds denoising",
+                  num_done / total_s, items, total_pixels / (total_s * 1000000.0), total_denoise_ms / 1000.0);
     }
 
-    cleanup();
-    exitfunc(EXIT_SUCCESS);
-}
+    if (prefilter_aux && !prefilter_cache.empty() && verbosity >= 2)
+        PrintInfo("Prefilter cache: %d hits, %d misses", prefilter.cache_hits, prefilter.cache_misses);
+    if (!results.dir.empty())
+        PrintInfo("Result cache: %d hits, %d misses", results.hits, results.misses);
 
+    exitfunc(num_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
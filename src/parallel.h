@@ -0,0 +1,32 @@
+#pragma once
+
+#include <algorithm>
+#include <stddef.h>
+#include <thread>
+#include <vector>
+
+// Runs func(chunk_begin, chunk_end) over [begin, end) split into contiguous chunks,
+// one per hardware thread. Ranges smaller than min_chunk per thread use fewer threads.
+template<typename Func>
+void parallelFor(size_t begin, size_t end, Func func, size_t min_chunk = 16384)
+{
+    if (end <= begin)
+        return;
+    const size_t count = end - begin;
+    size_t num_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    num_threads = std::min(num_threads, std::max<size_t>(count / min_chunk, 1));
+    if (num_threads == 1)
+    {
+        func(begin, end);
+        return;
+    }
+
+    const size_t chunk = (count + num_threads - 1) / num_threads;
+    std::vector<std::thread> threads;
+    for (size_t chunk_begin = begin + chunk; chunk_begin < end; chunk_begin += chunk)
+        threads.emplace_back(func, chunk_begin, std::min(chunk_begin + chunk, end));
+    // The first chunk runs on the calling thread
+    func(begin, std::min(begin + chunk, end));
+    for (std::thread& thread : threads)
+        thread.join();
+}
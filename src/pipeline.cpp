@@ -0,0 +1,249 @@
+#include "pipeline.h"
+#include "log.h"
+#include "queue.h"
+#include "trace.h"
+#include <OpenImageIO/imageio.h>
+#include <array>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <stdio.h>
+#include <thread>
+
+namespace
+{
+
+// Number of frames in flight: one loading, one denoising and one writing
+const size_t num_slots = 3;
+
+struct FrameSlot
+{
+    size_t index = 0;
+    bool success = false;
+    OIIO::ImageSpec spec;
+    int channels = 0;
+    bool has_albedo = false;
+    bool has_normal = false;
+    std::vector<float> beauty;
+    std::vector<float> albedo;
+    std::vector<float> normal;
+    double load_ms = 0.0;
+    double denoise_ms = 0.0;
+    double write_ms = 0.0;
+};
+
+// Reads the first channels of an image (all of them if channels is 0) into pixels.
+// The vector keeps its allocation when the size doesn't change.
+bool readImage(const std::string& path, int channels, PixelTransform transform, std::vector<float>& pixels,
+               OIIO::ImageSpec& spec, const char* name)
+{
+    TraceScope trace("read_image", name);
+    std::unique_ptr<OIIO::ImageInput> input = OIIO::ImageInput::open(path);
+    if (!input)
+    {
+        PrintError("Failed to load %s image %s", name, path.c_str());
+        PrintError("[OIIO]: %s", OIIO::geterror().c_str());
+        return false;
+    }
+    spec = input->spec();
+    if (spec.nchannels < 3)
+    {
+        PrintError("Pipelined sequences require the %s image to have at least three channels: %s", name, path.c_str());
+        return false;
+    }
+    if (!channels)
+        channels = spec.nchannels;
+    pixels.resize(size_t(spec.width) * spec.height * channels);
+    if (!input->read_image(0, 0, 0, channels, OIIO::TypeDesc::FLOAT, &pixels[0]))
+    {
+        PrintError("Failed to read %s image %s", name, path.c_str());
+        PrintError("[OIIO]: %s", input->geterror().c_str());
+        return false;
+    }
+    preprocessPixels(&pixels[0], size_t(spec.width) * spec.height, channels, transform);
+    return true;
+}
+
+bool loadSlot(const FrameJob& job, FrameSlot& slot, const PreprocessSettings& preprocess)
+{
+    TraceScope trace("load", job.beauty);
+    auto start = std::chrono::high_resolution_clock::now();
+    slot.has_albedo = !job.albedo.empty();
+    slot.has_normal = !job.normal.empty();
+    if (slot.has_normal && !slot.has_albedo)
+    {
+        PrintError("You cannot use a normal AOV without an albedo");
+        return false;
+    }
+
+    // Each layer is decoded on its own thread
+    OIIO::ImageSpec albedo_spec, normal_spec;
+    std::future<bool> albedo_read, normal_read;
+    if (slot.has_albedo)
+        albedo_read = std::async(std::launch::async, readImage, std::cref(job.albedo), 3,
+                                 layerTransform(preprocess, InputLayer::Albedo), std::ref(slot.albedo),
+                                 std::ref(albedo_spec), "albedo");
+    if (slot.has_normal)
+        normal_read = std::async(std::launch::async, readImage, std::cref(job.normal), 3,
+                                 layerTransform(preprocess, InputLayer::Normal), std::ref(slot.normal),
+                                 std::ref(normal_spec), "normal");
+    bool success = readImage(job.beauty, 0, layerTransform(preprocess, InputLayer::Beauty), slot.beauty, slot.spec, "beauty");
+    if (slot.has_albedo && !albedo_read.get())
+        success = false;
+    if (slot.has_normal && !normal_read.get())
+        success = false;
+    if (!success)
+        return false;
+
+    slot.channels = slot.spec.nchannels;
+    if ((slot.has_albedo && (albedo_spec.width != slot.spec.width || albedo_spec.height != slot.spec.height)) ||
+        (slot.has_normal && (normal_spec.width != slot.spec.width || normal_spec.height != slot.spec.height)))
+    {
+        PrintError("Feature images not same resolution as beauty: %s", job.beauty.c_str());
+        return false;
+    }
+    slot.load_ms = elapsedMilliseconds(start);
+    return true;
+}
+
+// Points the filter at the slot's buffers and denoises the beauty in place. Only the
+// image pointers change between frames of the same resolution, which OIDN handles
+// on commit without rebuilding the network.
+bool denoiseSlot(oidn::FilterRef& filter, FrameSlot& slot)
+{
+    try
+    {
+        const int width = slot.spec.width;
+        const int height = slot.spec.height;
+        const size_t beauty_stride = slot.channels * sizeof(float);
+        filter.setImage("color", (void*)&slot.beauty[0], oidn::Format::Float3, width, height, 0, beauty_stride);
+        filter.setImage("output", (void*)&slot.beauty[0], oidn::Format::Float3, width, height, 0, beauty_stride);
+        if (slot.has_albedo)
+            filter.setImage("albedo", (void*)&slot.albedo[0], oidn::Format::Float3, width, height);
+        else
+            filter.unsetImage("albedo");
+        if (slot.has_normal)
+            filter.setImage("normal", (void*)&slot.normal[0], oidn::Format::Float3, width, height);
+        else
+            filter.unsetImage("normal");
+
+        TraceScope trace("denoise");
+        auto start = std::chrono::high_resolution_clock::now();
+        filter.commit();
+        filter.execute();
+        slot.denoise_ms = elapsedMilliseconds(start);
+    }
+    catch (const std::exception& e)
+    {
+        PrintError("[OIDN]: %s", e.what());
+        return false;
+    }
+    return true;
+}
+
+bool writeSlot(const FrameJob& job, FrameSlot& slot, const OutputSettings& settings)
+{
+    TraceScope trace("write", job.output);
+    auto start = std::chrono::high_resolution_clock::now();
+    std::unique_ptr<OIIO::ImageOutput> output = OIIO::ImageOutput::create(job.output);
+    OIIO::ImageSpec spec = slot.spec;
+    applyOutputSettings(spec, settings);
+    // Written under a temporary name so a failed write leaves the previous output as it was
+    const std::string temp_path = job.output + ".tmp";
+    bool success = output && output->open(temp_path, spec) &&
+                   output->write_image(OIIO::TypeDesc::FLOAT, &slot.beauty[0]);
+    success = output && output->close() && success;
+    std::error_code error;
+    if (success)
+        std::filesystem::rename(temp_path, job.output, error);
+    if (!success || error)
+    {
+        PrintError("Could not save file %s", job.output.c_str());
+        PrintError("[OIIO]: %s", output ? output->geterror().c_str() : OIIO::geterror().c_str());
+        remove(temp_path.c_str());
+        return false;
+    }
+    slot.write_ms = elapsedMilliseconds(start);
+    return true;
+}
+
+} // namespace
+
+int runPipeline(const std::vector<FrameJob>& jobs, oidn::FilterRef& filter, const PreprocessSettings& preprocess,
+                const OutputSettings& output)
+{
+    std::array<FrameSlot, num_slots> slots;
+    BoundedQueue<FrameSlot*> free_slots(num_slots);
+    BoundedQueue<FrameSlot*> to_denoise(num_slots);
+    BoundedQueue<FrameSlot*> to_write(num_slots);
+    for (FrameSlot& slot : slots)
+        free_slots.push(&slot);
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::thread loader([&]
+    {
+        for (size_t f = 0; f < jobs.size(); f++)
+        {
+            FrameSlot* slot;
+            free_slots.pop(slot);
+            slot->index = f;
+            slot->success = loadSlot(jobs[f], *slot, preprocess);
+            to_denoise.push(slot);
+        }
+        to_denoise.close();
+    });
+
+    int num_failed = 0;
+    double total_denoise_ms = 0.0;
+    double total_pixels = 0.0;
+    std::thread writer([&]
+    {
+        FrameSlot* slot;
+        while (to_write.pop(slot))
+        {
+            const FrameJob& job = jobs[slot->index];
+            if (slot->success)
+                slot->success = writeSlot(job, *slot, output);
+            if (slot->success)
+            {
+                total_denoise_ms += slot->denoise_ms;
+                total_pixels += double(slot->spec.width) * slot->spec.height;
+                PrintInfo("Frame %d/%d complete: %s (load %.3f, denoise %.3f, write %.3f seconds)",
+                          int(slot->index+1), int(jobs.size()), job.output.c_str(),
+                          slot->load_ms / 1000.0, slot->denoise_ms / 1000.0, slot->write_ms / 1000.0);
+            }
+            else
+            {
+                PrintError("Frame %d failed: %s", int(slot->index+1), job.beauty.c_str());
+                num_failed++;
+            }
+            free_slots.push(slot);
+        }
+    });
+
+    // The denoise stage runs on this thread
+    FrameSlot* slot;
+    while (to_denoise.pop(slot))
+    {
+        if (slot->success)
+        {
+            if (verbosity >= 2)
+                PrintInfo("Denoising frame %d/%d", int(slot->index+1), int(jobs.size()));
+            slot->success = denoiseSlot(filter, *slot);
+        }
+        to_write.push(slot);
+    }
+    to_write.close();
+    loader.join();
+    writer.join();
+
+    double total_s = elapsedMilliseconds(start) / 1000.0;
+    int num_done = int(jobs.size()) - num_failed;
+    PrintInfo("Pipelined sequence of %d frames complete in %.3f seconds (%d failed)", num_done, total_s, num_failed);
+    PrintInfo("Throughput: %.2f frames/s, %.2f Mpixels/s, %.3f seconds denoising (%.0f%% of wall time)",
+              num_done / total_s, total_pixels / (total_s * 1000000.0), total_denoise_ms / 1000.0,
+              total_s > 0.0 ? 100.0 * total_denoise_ms / (total_s * 1000.0) : 0.0);
+    return num_failed;
+}
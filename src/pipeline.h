@@ -0,0 +1,12 @@
+#pragma once
+
+#include "frame.h"
+#include <vector>
+
+// Denoises a sequence with loading, denoising and writing overlapped on separate threads:
+// while one frame is denoised the next is read and the previous one is written. Frames move
+// between the stages in a fixed set of slots whose buffers are reused, so nothing is
+// reallocated per frame once the resolution is stable. Returns the number of failed frames.
+// The inputs are preprocessed as set by preprocess and the outputs encoded as set by output.
+int runPipeline(const std::vector<FrameJob>& jobs, oidn::FilterRef& filter, const PreprocessSettings& preprocess,
+                const OutputSettings& output);
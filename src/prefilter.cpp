@@ -0,0 +1,83 @@
+#include "prefilter.h"
+#include "cache.h"
+#include "log.h"
+#include "trace.h"
+#include <stdint.h>
+
+namespace
+{
+
+// Results from another resolution, format, OIDN version or quality are never reused
+uint64_t auxKey(const std::vector<unsigned char>& pixels, const DenoiseBuffers& buffers, int version, oidn::Quality quality)
+{
+    const int header[5] = { buffers.width, buffers.height, int(buffers.half), version, int(quality) };
+    return hashPixels(pixels, hashBytes((const unsigned char*)header, sizeof(header)));
+}
+
+void prefilterLayer(AuxPrefilter& prefilter, oidn::FilterRef& filter, const void*& bound_ptr,
+                    std::vector<unsigned char>& pixels, const DenoiseBuffers& buffers, const char* name)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    std::string path;
+    if (!prefilter.cache_dir.empty())
+    {
+        path = cachePath(prefilter.cache_dir, auxKey(pixels, buffers, prefilter.device.get<int>("version"), prefilter.settings.quality), name);
+        if (readCache(path, pixels))
+        {
+            prefilter.cache_hits++;
+            if (verbosity >= 2)
+                PrintInfo("Loaded prefiltered %s from %s", name, path.c_str());
+            return;
+        }
+        prefilter.cache_misses++;
+    }
+
+    // The filter only takes the AOV, which is denoised in place
+    if (!filter)
+    {
+        filter = prefilter.device.newFilter("RT");
+        filter.setProgressMonitorFunction((oidn::ProgressMonitorFunction)progressCallback, (void*)prefilter.control);
+        if (prefilter.settings.maxmem >= 0)
+            filter.set("maxMemoryMB", prefilter.settings.maxmem);
+        if (prefilter.settings.quality != oidn::Quality::Default)
+            filter.set("quality", prefilter.settings.quality);
+        bound_ptr = nullptr;
+    }
+    if (bound_ptr != pixels.data())
+    {
+        const oidn::Format format = buffers.half ? oidn::Format::Half3 : oidn::Format::Float3;
+        filter.setImage(name, (void*)pixels.data(), format, buffers.width, buffers.height);
+        filter.setImage("output", (void*)pixels.data(), format, buffers.width, buffers.height);
+        filter.commit();
+        bound_ptr = pixels.data();
+    }
+    {
+        TraceScope trace("prefilter", name);
+        filter.execute();
+    }
+    if (verbosity >= 2)
+        PrintInfo("Prefiltered %s in %.3f seconds", name, elapsedMilliseconds(start) / 1000.0);
+
+    if (!path.empty())
+        writeCache(path, pixels);
+}
+
+} // namespace
+
+void prefilterAux(AuxPrefilter& prefilter, DenoiseBuffers& buffers)
+{
+    // AOVs kept from the previous frame are already prefiltered
+    if (!buffers.has_albedo || buffers.aux_prefiltered)
+        return;
+    // A new layout needs the images set again, even if the buffers were reallocated at the same address
+    if (prefilter.width != buffers.width || prefilter.height != buffers.height || prefilter.half != buffers.half)
+        prefilter.albedo_ptr = prefilter.normal_ptr = nullptr;
+    prefilter.width = buffers.width;
+    prefilter.height = buffers.height;
+    prefilter.half = buffers.half;
+
+    prefilterLayer(prefilter, prefilter.albedo_filter, prefilter.albedo_ptr, buffers.albedo, buffers, "albedo");
+    if (buffers.has_normal)
+        prefilterLayer(prefilter, prefilter.normal_filter, prefilter.normal_ptr, buffers.normal, buffers, "normal");
+    buffers.aux_prefiltered = true;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "frame.h"
+#include <string>
+
+// Denoises noisy albedo and normal AOVs with their own filters before the beauty is
+// denoised with cleanAux, as recommended by OIDN for noisy auxiliary images. The
+// prefiltered AOVs can be cached on disk, keyed by a hash of the noisy AOV pixels, so
+// re-renders that only change the lighting skip the prefilters entirely.
+struct AuxPrefilter
+{
+    oidn::DeviceRef device;
+    FilterSettings settings;
+    // Directory of the prefiltered AOV cache, disabled when empty
+    std::string cache_dir;
+    // Stops the prefilters when the frame is cancelled or passes its deadline, if given
+    const ExecutionControl* control = nullptr;
+    oidn::FilterRef albedo_filter;
+    oidn::FilterRef normal_filter;
+    // The images the filters were last committed with
+    const void* albedo_ptr = nullptr;
+    const void* normal_ptr = nullptr;
+    int width = 0;
+    int height = 0;
+    bool half = false;
+    int cache_hits = 0;
+    int cache_misses = 0;
+};
+
+// Replaces the albedo and normal in buffers with their prefiltered versions, from the
+// cache if possible. Does nothing for frames without AOVs. Throws on OIDN errors and
+// DenoiseCancelled when stopped through control.
+void prefilterAux(AuxPrefilter& prefilter, DenoiseBuffers& buffers);
@@ -0,0 +1,146 @@
+#include "preprocess.h"
+#include "parallel.h"
+#include "trace.h"
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+#include <vector>
+
+namespace
+{
+
+// Pixels are transformed in blocks of this many, so that the scale and offset of each value
+// repeat with a fixed pattern and the inner loop has no per channel branches or modulo.
+// The compiler vectorises it with whatever SIMD the build targets (SSE2, AVX2 or AVX-512).
+const size_t block_pixels = 16;
+
+// Pixels per chunk of the fused conversion, small enough for the float scratch to stay in cache
+const size_t chunk_pixels = 4096;
+
+struct BlockPattern
+{
+    std::vector<float> scale;
+    std::vector<float> offset;
+};
+
+BlockPattern blockPattern(int channels, const PixelTransform& transform)
+{
+    BlockPattern pattern;
+    pattern.scale.resize(block_pixels * channels);
+    pattern.offset.resize(block_pixels * channels);
+    for (size_t i = 0; i < pattern.scale.size(); i++)
+    {
+        const bool colour = int(i % channels) < 3;
+        pattern.scale[i] = colour ? transform.scale : 1.0f;
+        pattern.offset[i] = colour ? transform.offset : 0.0f;
+    }
+    return pattern;
+}
+
+// x - x is 0 for finite values and NaN otherwise, which compiles to a compare and blend.
+// This relies on IEEE semantics, so the pixel loops must not be built with -ffast-math.
+template<bool Sanitize>
+void transformValues(float* __restrict values, size_t count, const float* __restrict scale,
+                     const float* __restrict offset)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        float value = values[i];
+        if (Sanitize)
+            value = (value - value == 0.0f) ? value : 0.0f;
+        values[i] = value * scale[i] + offset[i];
+    }
+}
+
+void transformRange(float* pixels, size_t num_pixels, int channels, const PixelTransform& transform,
+                    const BlockPattern& pattern)
+{
+    for (size_t begin = 0; begin < num_pixels; begin += block_pixels)
+    {
+        const size_t count = std::min(block_pixels, num_pixels - begin) * channels;
+        float* values = pixels + begin * channels;
+        if (transform.sanitize)
+            transformValues<true>(values, count, pattern.scale.data(), pattern.offset.data());
+        else
+            transformValues<false>(values, count, pattern.scale.data(), pattern.offset.data());
+    }
+}
+
+} // namespace
+
+PixelTransform layerTransform(const PreprocessSettings& settings, InputLayer layer)
+{
+    PixelTransform transform;
+    transform.sanitize = settings.sanitize;
+    if (layer == InputLayer::Beauty)
+        transform.scale = std::exp2(settings.exposure);
+    else if (layer == InputLayer::Normal && settings.normal_remap)
+    {
+        transform.scale = 2.0f;
+        transform.offset = -1.0f;
+    }
+    return transform;
+}
+
+void preprocessPixels(float* pixels, size_t num_pixels, int channels, const PixelTransform& transform)
+{
+    if (transform.identity())
+        return;
+    TraceScope trace("preprocess");
+    const BlockPattern pattern = blockPattern(channels, transform);
+    // Chunks start on a block boundary so each one repeats the pattern from its start
+    parallelFor(0, (num_pixels + block_pixels - 1) / block_pixels, [&](size_t begin, size_t end)
+    {
+        const size_t first = begin * block_pixels;
+        const size_t last = std::min(end * block_pixels, num_pixels);
+        transformRange(pixels + first * channels, last - first, channels, transform, pattern);
+    }, 1024);
+}
+
+void preprocessConvert(const float* in, void* out, size_t num_pixels, int in_channels, int out_channels,
+                       OIIO::TypeDesc format, const PixelTransform& transform)
+{
+    TraceScope trace("preprocess");
+    const BlockPattern pattern = blockPattern(out_channels, transform);
+    const size_t out_pixel = out_channels * format.size();
+    const int copied = std::min(in_channels, out_channels);
+    parallelFor(0, (num_pixels + chunk_pixels - 1) / chunk_pixels, [&](size_t begin, size_t end)
+    {
+        std::vector<float> scratch(chunk_pixels * out_channels);
+        for (size_t chunk = begin; chunk < end; chunk++)
+        {
+            const size_t first = chunk * chunk_pixels;
+            const size_t count = std::min(chunk_pixels, num_pixels - first);
+            const float* src = in + first * in_channels;
+            if (in_channels == out_channels)
+                memcpy(scratch.data(), src, count * in_channels * sizeof(float));
+            else
+            {
+                std::fill(scratch.begin(), scratch.begin() + count * out_channels, 0.0f);
+                for (size_t p = 0; p < count; p++)
+                    memcpy(&scratch[p * out_channels], &src[p * in_channels], copied * sizeof(float));
+            }
+            transformRange(scratch.data(), count, out_channels, transform, pattern);
+            unsigned char* dst = (unsigned char*)out + first * out_pixel;
+            if (format == OIIO::TypeDesc::FLOAT)
+                memcpy(dst, scratch.data(), count * out_pixel);
+            else
+                OIIO::convert_pixel_values(OIIO::TypeDesc::FLOAT, scratch.data(), format, dst, int(count * out_channels));
+        }
+    }, 1);
+}
+
+void preprocessScalar(float* pixels, size_t num_pixels, int channels, const PixelTransform& transform)
+{
+    for (size_t p = 0; p < num_pixels; p++)
+    {
+        float* pixel = pixels + p * channels;
+        for (int c = 0; c < channels; c++)
+        {
+            if (transform.sanitize && !std::isfinite(pixel[c]))
+                pixel[c] = 0.0f;
+            if (c < 3)
+                pixel[c] = pixel[c] * transform.scale + transform.offset;
+        }
+    }
+}
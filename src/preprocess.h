@@ -0,0 +1,49 @@
+#pragma once
+
+#include <OpenImageIO/imageio.h>
+#include <stddef.h>
+
+// Fixes applied to the inputs as they are read, so they don't need a separate pass
+struct PreprocessSettings
+{
+    // Replace NaN and infinite values with 0
+    bool sanitize = false;
+    // Remap normals stored as [0,1] (e.g. in 8-bit files) to [-1,1]
+    bool normal_remap = false;
+    // Exposure adjustment of the beauty in stops
+    float exposure = 0.0f;
+
+    bool enabled() const { return sanitize || normal_remap || exposure != 0.0f; }
+};
+
+enum class InputLayer
+{
+    Beauty,
+    Albedo,
+    Normal
+};
+
+// What is done to the pixels of one layer: value * scale + offset on the first three
+// channels, after replacing non-finite values in every channel if sanitize is set
+struct PixelTransform
+{
+    float scale = 1.0f;
+    float offset = 0.0f;
+    bool sanitize = false;
+
+    bool identity() const { return scale == 1.0f && offset == 0.0f && !sanitize; }
+};
+
+PixelTransform layerTransform(const PreprocessSettings& settings, InputLayer layer);
+
+// Transforms interleaved float pixels in place, split across threads
+void preprocessPixels(float* pixels, size_t num_pixels, int channels, const PixelTransform& transform);
+
+// Converts interleaved float pixels from in_channels to out_channels (missing channels are 0)
+// and stores them as format (float or half), transforming them on the way in the same pass.
+// Split across threads.
+void preprocessConvert(const float* in, void* out, size_t num_pixels, int in_channels, int out_channels,
+                       OIIO::TypeDesc format, const PixelTransform& transform);
+
+// The same as preprocessPixels as a plain per pixel loop on one thread, as a baseline for benchmarks
+void preprocessScalar(float* pixels, size_t num_pixels, int channels, const PixelTransform& transform);
@@ -0,0 +1,128 @@
+#include "preview.h"
+#include "benchmark.h"
+#include "log.h"
+#include "resample.h"
+#include "trace.h"
+#include <exception>
+
+namespace
+{
+
+// How far apart guide values can be before pixels stop being mixed. Albedo is in [0,1]
+// and normals in [-1,1].
+const float albedo_sigma = 0.1f;
+const float normal_sigma = 0.5f;
+
+void denoisePreview(PreviewDenoiser& preview, const FilterSettings& settings, DenoiseBuffers& buffers)
+{
+    const int factor = preview.factor;
+    const int width = (buffers.width + factor - 1) / factor;
+    const int height = (buffers.height + factor - 1) / factor;
+    std::vector<float> full;
+    {
+        TraceScope trace("downsample");
+        readFloat3(buffers.beauty, buffers.beauty_channels, buffers, full);
+        downsample(full, buffers.width, buffers.height, factor, preview.beauty, width, height);
+        if (buffers.has_albedo)
+        {
+            readFloat3(buffers.albedo, 3, buffers, preview.full_albedo);
+            downsample(preview.full_albedo, buffers.width, buffers.height, factor, preview.albedo, width, height);
+        }
+        if (buffers.has_normal)
+        {
+            readFloat3(buffers.normal, 3, buffers, preview.full_normal);
+            downsample(preview.full_normal, buffers.width, buffers.height, factor, preview.normal, width, height);
+        }
+        preview.output.resize(preview.beauty.size());
+    }
+
+    // Previews use the fast quality preset unless another was asked for
+    FilterSettings filter_settings = settings;
+    if (filter_settings.quality == oidn::Quality::Default)
+        filter_settings.quality = oidn::Quality::Fast;
+    if (!preview.filter || !sameFilterParams(filter_settings, preview.settings))
+    {
+        preview.filter = createFilter(preview.device, filter_settings);
+        preview.settings = filter_settings;
+        preview.width = 0;
+    }
+    // The buffers keep their allocation at the same size, so only a new size needs a commit
+    if (preview.width != width || preview.height != height || preview.has_albedo != buffers.has_albedo ||
+        preview.has_normal != buffers.has_normal)
+    {
+        oidn::FilterRef& filter = preview.filter;
+        filter.setImage("color", preview.beauty.data(), oidn::Format::Float3, width, height);
+        filter.setImage("output", preview.output.data(), oidn::Format::Float3, width, height);
+        if (buffers.has_albedo)
+            filter.setImage("albedo", preview.albedo.data(), oidn::Format::Float3, width, height);
+        else
+            filter.unsetImage("albedo");
+        if (buffers.has_normal)
+            filter.setImage("normal", preview.normal.data(), oidn::Format::Float3, width, height);
+        else
+            filter.unsetImage("normal");
+        TraceScope trace("filter commit (preview)");
+        filter.commit();
+        preview.width = width;
+        preview.height = height;
+        preview.has_albedo = buffers.has_albedo;
+        preview.has_normal = buffers.has_normal;
+    }
+    {
+        TraceScope trace("execute (preview)");
+        preview.filter.execute();
+    }
+
+    TraceScope trace("upsample");
+    std::vector<UpsampleGuide> guides;
+    if (buffers.has_albedo)
+        guides.push_back({ &preview.albedo, &preview.full_albedo, albedo_sigma });
+    if (buffers.has_normal)
+        guides.push_back({ &preview.normal, &preview.full_normal, normal_sigma });
+    upsample(preview.output, width, height, factor, buffers.width, buffers.height, full, guides);
+    writeOutput(full, buffers);
+}
+
+} // namespace
+
+bool previewFrame(const FrameJob& job, FrameImages& images, PreviewDenoiser& preview, DenoiseBuffers& buffers,
+                  const FilterSettings& settings, double& denoise_ms, oidn::FilterRef* baseline, FrameWriter* writer)
+{
+    // A region is read with enough margin for its edges, once the filter's overlap is known
+    if (images.region != OIIO::get_roi(images.beauty->spec()))
+        padRegion(images, buffers.overlap > 0 ? buffers.overlap : default_overlap);
+
+    // The full resolution beauty is kept for the downsample, so the result goes to the output buffer
+    if (!readFrame(images, buffers, false, settings))
+        return false;
+
+    try
+    {
+        double baseline_ms = 0.0;
+        if (baseline)
+        {
+            bindFilter(*baseline, buffers);
+            baseline_ms = timeExecute(*baseline, 0, 1)[0];
+        }
+        auto start = std::chrono::high_resolution_clock::now();
+        denoisePreview(preview, settings, buffers);
+        denoise_ms = elapsedMilliseconds(start);
+        if (baseline)
+            PrintInfo("Preview at 1/%d resolution denoised in %.3f seconds, %.1fx faster than %.3f seconds at full resolution",
+                      preview.factor, denoise_ms / 1000.0, denoise_ms > 0.0 ? baseline_ms / denoise_ms : 0.0,
+                      baseline_ms / 1000.0);
+        else
+            PrintInfo("Preview at 1/%d resolution denoised in %.3f seconds", preview.factor, denoise_ms / 1000.0);
+    }
+    catch (const std::exception& e)
+    {
+        PrintError("[OIDN]: %s", e.what());
+        // Force the images to be set again on the next frame
+        buffers.dirty = true;
+        buffers.aux_source.clear();
+        preview.width = 0;
+        return false;
+    }
+
+    return writeFrame(job, images, buffers, writer);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "frame.h"
+#include <vector>
+
+class FrameWriter;
+
+// Denoises frames at 1/factor of their resolution for quick look-dev previews. The beauty,
+// albedo and normal are box filtered down and denoised, then the result is upsampled
+// guided by the full resolution albedo and normal so edges stay sharp. The filter and
+// buffers are kept between frames.
+struct PreviewDenoiser
+{
+    oidn::DeviceRef device;
+    int factor = 0;
+    oidn::FilterRef filter;
+    FilterSettings settings;
+    // The size and AOVs the filter was last committed with
+    int width = 0;
+    int height = 0;
+    bool has_albedo = false;
+    bool has_normal = false;
+    std::vector<float> beauty;
+    std::vector<float> albedo;
+    std::vector<float> normal;
+    std::vector<float> output;
+    // Full resolution guides
+    std::vector<float> full_albedo;
+    std::vector<float> full_normal;
+};
+
+// Reads, denoises and saves a preview of a frame previously opened with openFrame.
+// denoise_ms is set to the time from the downsample to the end of the upsample. With
+// baseline given the frame is first denoised at full resolution with it, without saving
+// the result, and the preview's latency is compared against it.
+bool previewFrame(const FrameJob& job, FrameImages& images, PreviewDenoiser& preview, DenoiseBuffers& buffers,
+                  const FilterSettings& settings, double& denoise_ms, oidn::FilterRef* baseline = nullptr,
+                  FrameWriter* writer = nullptr);
@@ -0,0 +1,126 @@
+#include "resample.h"
+#include "frame.h"
+#include "parallel.h"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+void readFloat3(const std::vector<unsigned char>& pixels, int channels, const DenoiseBuffers& buffers,
+                std::vector<float>& result)
+{
+    const size_t num_pixels = size_t(buffers.width) * buffers.height;
+    std::vector<float> converted;
+    const float* values = (const float*)pixels.data();
+    if (buffers.half)
+    {
+        converted.resize(num_pixels * channels);
+        OIIO::convert_pixel_values(OIIO::TypeDesc::HALF, pixels.data(), OIIO::TypeDesc::FLOAT, converted.data(),
+                                   int(converted.size()));
+        values = converted.data();
+    }
+    result.resize(num_pixels * 3);
+    parallelFor(0, num_pixels, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+            memcpy(&result[i * 3], &values[i * channels], 3 * sizeof(float));
+    });
+}
+
+void downsample(const std::vector<float>& in, int width, int height, int factor, std::vector<float>& out,
+                int out_width, int out_height)
+{
+    out.resize(size_t(out_width) * out_height * 3);
+    const float scale = 1.0f / float(factor * factor);
+    parallelFor(0, size_t(out_height), [&](size_t begin, size_t end)
+    {
+        for (size_t y = begin; y < end; y++)
+        {
+            for (int x = 0; x < out_width; x++)
+            {
+                float sum[3] = { 0.0f, 0.0f, 0.0f };
+                for (int j = 0; j < factor; j++)
+                {
+                    const size_t row = size_t(std::min(int(y) * factor + j, height - 1)) * width;
+                    for (int i = 0; i < factor; i++)
+                    {
+                        const float* pixel = &in[(row + std::min(x * factor + i, width - 1)) * 3];
+                        sum[0] += pixel[0];
+                        sum[1] += pixel[1];
+                        sum[2] += pixel[2];
+                    }
+                }
+                float* result = &out[(y * out_width + x) * 3];
+                result[0] = sum[0] * scale;
+                result[1] = sum[1] * scale;
+                result[2] = sum[2] * scale;
+            }
+        }
+    }, 16);
+}
+
+void upsample(const std::vector<float>& in, int in_width, int in_height, int factor, int width, int height,
+              std::vector<float>& out, const std::vector<UpsampleGuide>& guides)
+{
+    out.resize(size_t(width) * height * 3);
+    const float step = 1.0f / float(factor);
+    parallelFor(0, size_t(height), [&](size_t begin, size_t end)
+    {
+        for (size_t y = begin; y < end; y++)
+        {
+            const float fy = std::clamp((y + 0.5f) * step - 0.5f, 0.0f, float(in_height - 1));
+            const int y0 = int(fy);
+            const int y1 = std::min(y0 + 1, in_height - 1);
+            const float ty = fy - y0;
+            for (int x = 0; x < width; x++)
+            {
+                const float fx = std::clamp((x + 0.5f) * step - 0.5f, 0.0f, float(in_width - 1));
+                const int x0 = int(fx);
+                const int x1 = std::min(x0 + 1, in_width - 1);
+                const float tx = fx - x0;
+                const size_t taps[4] = { size_t(y0) * in_width + x0, size_t(y0) * in_width + x1,
+                                         size_t(y1) * in_width + x0, size_t(y1) * in_width + x1 };
+                float weights[4] = { (1.0f - tx) * (1.0f - ty), tx * (1.0f - ty), (1.0f - tx) * ty, tx * ty };
+                const size_t pixel = y * width + x;
+                if (!guides.empty())
+                {
+                    float total = 0.0f;
+                    float guided[4];
+                    for (int t = 0; t < 4; t++)
+                    {
+                        float distance = 0.0f;
+                        for (const UpsampleGuide& guide : guides)
+                        {
+                            const float* low = &(*guide.low)[taps[t] * 3];
+                            const float* full = &(*guide.full)[pixel * 3];
+                            const float d = ((low[0] - full[0]) * (low[0] - full[0]) + (low[1] - full[1]) * (low[1] - full[1]) +
+                                             (low[2] - full[2]) * (low[2] - full[2])) / (guide.sigma * guide.sigma);
+                            distance += d;
+                        }
+                        guided[t] = weights[t] * expf(-distance);
+                        total += guided[t];
+                    }
+                    // Details finer than the reduced resolution match none of the taps and stay bilinear
+                    if (total > 1e-4f)
+                    {
+                        for (int t = 0; t < 4; t++)
+                            weights[t] = guided[t] / total;
+                    }
+                }
+                for (int c = 0; c < 3; c++)
+                {
+                    out[pixel * 3 + c] = in[taps[0] * 3 + c] * weights[0] + in[taps[1] * 3 + c] * weights[1] +
+                                         in[taps[2] * 3 + c] * weights[2] + in[taps[3] * 3 + c] * weights[3];
+                }
+            }
+        }
+    }, 16);
+}
+
+void writeOutput(const std::vector<float>& result, DenoiseBuffers& buffers)
+{
+    if (buffers.half)
+        OIIO::convert_pixel_values(OIIO::TypeDesc::FLOAT, result.data(), OIIO::TypeDesc::HALF, buffers.output.data(),
+                                   int(result.size()));
+    else
+        memcpy(buffers.output.data(), result.data(), result.size() * sizeof(float));
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+
+struct DenoiseBuffers;
+
+// Resampling of three channel float images for denoising at reduced resolution
+
+// Reads the first three channels of each pixel of a buffer as float
+void readFloat3(const std::vector<unsigned char>& pixels, int channels, const DenoiseBuffers& buffers,
+                std::vector<float>& result);
+
+// Averages each factor x factor block of a three channel image. Blocks past the edge repeat the last pixels.
+void downsample(const std::vector<float>& in, int width, int height, int factor, std::vector<float>& out,
+                int out_width, int out_height);
+
+// A full resolution image steering the upsampling, with its downsampled version. sigma is
+// how far apart guide values can be before pixels stop being mixed.
+struct UpsampleGuide
+{
+    const std::vector<float>* low;
+    const std::vector<float>* full;
+    float sigma;
+};
+
+// Upsamples a three channel image by factor to width x height. Without guides it is
+// bilinear; with guides each of the bilinear taps is also weighted by how closely its
+// guide values match those of the full resolution pixel, so edges in the guides stay sharp.
+void upsample(const std::vector<float>& in, int in_width, int in_height, int factor, int width, int height,
+              std::vector<float>& out, const std::vector<UpsampleGuide>& guides = {});
+
+// Copies a three channel float image the size of buffers to its output, as half if the buffers are half
+void writeOutput(const std::vector<float>& result, DenoiseBuffers& buffers);
@@ -0,0 +1,551 @@
+#include "server.h"
+#include "channels.h"
+#include "deadline.h"
+#include "frame.h"
+#include "log.h"
+#include "shm.h"
+#include "trace.h"
+#include "writer.h"
+#include <OpenImageIO/imagecache.h>
+#include <exception>
+#include <filesystem>
+#include <algorithm>
+#include <list>
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Requests are sent as one command line argument per line, terminated by an empty line.
+// The server replies with a single line starting with either "OK" or "ERROR".
+
+#ifdef _WIN32
+
+int runServer(const std::string& socket_path, int num_threads, bool affinity, int cache_size)
+{
+    PrintError("Server mode is not supported on this platform");
+    return EXIT_FAILURE;
+}
+
+int runClient(const std::string& socket_path, const std::vector<std::string>& args)
+{
+    PrintError("Server mode is not supported on this platform");
+    return EXIT_FAILURE;
+}
+
+#else
+
+namespace
+{
+
+// Filter parameters that need a separate committed filter
+struct FilterKey
+{
+    int width;
+    int height;
+    bool has_albedo;
+    bool has_normal;
+    // Shared memory jobs bind the filter to their regions rather than to the entry's buffers
+    bool shared;
+    FilterSettings settings;
+
+    bool operator==(const FilterKey& other) const
+    {
+        return width == other.width && height == other.height &&
+               has_albedo == other.has_albedo && has_normal == other.has_normal && shared == other.shared &&
+               sameFilterParams(settings, other.settings);
+    }
+};
+
+// A committed filter and the buffers its images point at. Entries live in a
+// std::list so the buffers never move while the filter references them.
+struct CacheEntry
+{
+    FilterKey key;
+    oidn::FilterRef filter;
+    DenoiseBuffers buffers;
+    // The shared memory images the filter was last committed with
+    SharedBinding shared_binding;
+};
+
+struct LatencyStats
+{
+    int count = 0;
+    double total_ms = 0.0;
+    double max_ms = 0.0;
+
+    void add(double ms)
+    {
+        count++;
+        total_ms += ms;
+        max_ms = std::max(max_ms, ms);
+    }
+    double average() const { return count ? total_ms / count : 0.0; }
+};
+
+volatile sig_atomic_t stop_requested = 0;
+
+void stopHandler(int)
+{
+    stop_requested = 1;
+}
+
+bool writeAll(int fd, const std::string& data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = write(fd, data.data() + sent, data.size() - sent);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        sent += size_t(n);
+    }
+    return true;
+}
+
+// Reads lines until an empty line or the connection closes
+bool readRequest(int fd, std::vector<std::string>& lines)
+{
+    std::string buffer;
+    char chunk[4096];
+    while (true)
+    {
+        size_t end;
+        while ((end = buffer.find('\n')) != std::string::npos)
+        {
+            std::string line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            if (line.empty())
+                return true;
+            lines.push_back(line);
+        }
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buffer.append(chunk, size_t(n));
+    }
+}
+
+bool fillAddress(const std::string& socket_path, sockaddr_un& address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+    {
+        PrintError("Socket path too long: %s", socket_path.c_str());
+        return false;
+    }
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+    return true;
+}
+
+// Parses the per job flags of a request
+bool parseJob(const std::vector<std::string>& args, FrameJob& job, FilterSettings& settings, OutputSettings& output,
+              std::string& error)
+{
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        const std::string& arg = args[i];
+        if (i + 1 >= args.size())
+        {
+            error = "missing value for flag " + arg;
+            return false;
+        }
+        const std::string& value = args[++i];
+        try
+        {
+            if (arg == "-i")
+                job.beauty = value;
+            else if (arg == "-a")
+                job.albedo = value;
+            else if (arg == "-n")
+                job.normal = value;
+            else if (arg == "-o")
+                job.output = value;
+            else if (arg == "-roi")
+            {
+                if (!parseRegion(value, job.roi))
+                {
+                    error = "invalid value for flag " + arg;
+                    return false;
+                }
+            }
+            else if (arg == "-hdr")
+            {
+                settings.hdr = bool(std::stoi(value));
+                if (!settings.hdr)
+                    settings.srgb = true;
+            }
+            else if (arg == "-srgb")
+                settings.srgb = bool(std::stoi(value));
+            else if (arg == "-clean_aux")
+                settings.clean_aux = bool(std::stoi(value));
+            else if (arg == "-maxmem")
+                settings.maxmem = std::stoi(value);
+            else if (arg == "-quality")
+            {
+                if (!parseQuality(value, settings.quality))
+                {
+                    error = "invalid value for flag " + arg;
+                    return false;
+                }
+            }
+            else if (arg == "-weights")
+                settings.weights = value;
+            else if (arg == "-precision")
+            {
+                if (!parsePrecision(value, settings.precision))
+                {
+                    error = "invalid value for flag " + arg;
+                    return false;
+                }
+            }
+            else if (arg == "-sanitize")
+                settings.preprocess.sanitize = bool(std::stoi(value));
+            else if (arg == "-normal_remap")
+                settings.preprocess.normal_remap = bool(std::stoi(value));
+            else if (arg == "-exposure")
+                settings.preprocess.exposure = std::stof(value);
+            else if (arg == "-deadline")
+                settings.deadline_ms = std::stod(value);
+            else if (arg == "-fallback")
+            {
+                if (!parseFallbacks(value, settings.fallbacks))
+                {
+                    error = "invalid value for flag " + arg;
+                    return false;
+                }
+            }
+            else if (arg == "-compression")
+                output.compression = value;
+            else if (arg == "-compression_level")
+                output.compression_level = std::stoi(value);
+            else if (arg == "-out_format")
+            {
+                if (!parseOutputFormat(value, output.format))
+                {
+                    error = "invalid value for flag " + arg;
+                    return false;
+                }
+            }
+            else
+            {
+                error = "unsupported flag " + arg;
+                return false;
+            }
+        }
+        catch (const std::exception&)
+        {
+            error = "invalid value for flag " + arg;
+            return false;
+        }
+    }
+    if (settings.srgb && settings.hdr)
+        settings.srgb = false;
+    if (job.beauty.empty() || job.output.empty())
+    {
+        error = "an input (-i) and output (-o) are required";
+        return false;
+    }
+    if (isSharedJob(job))
+    {
+        // Descriptors are only meaningful in the process they were passed to
+        for (const std::string* path : { &job.beauty, &job.albedo, &job.normal, &job.output })
+        {
+            if (path->compare(0, 3, "fd:") == 0)
+            {
+                error = "fd: images can't be sent to a server, use shm: instead";
+                return false;
+            }
+        }
+        if (job.roi.defined())
+        {
+            error = "-roi is not supported with shared memory images";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Files may have been rendered again since an earlier job read them through OIIO's cache,
+// including an output that a region is added to
+void invalidateFiles(const FrameJob& job)
+{
+    auto cache = OIIO::ImageCache::create(true);
+    for (const std::string* path : { &job.beauty, &job.albedo, &job.normal, &job.output })
+    {
+        if (path->empty())
+            continue;
+        std::string file, selector;
+        splitChannelSelector(*path, file, selector);
+        cache->invalidate(OIIO::ustring(file));
+    }
+}
+
+std::string statsReply(const LatencyStats& hits, const LatencyStats& misses)
+{
+    char reply[256];
+    snprintf(reply, sizeof(reply), "OK hits=%d hit_avg_ms=%.3f hit_max_ms=%.3f misses=%d miss_avg_ms=%.3f miss_max_ms=%.3f\n",
+             hits.count, hits.average(), hits.max_ms, misses.count, misses.average(), misses.max_ms);
+    return reply;
+}
+
+} // namespace
+
+int runServer(const std::string& socket_path, int num_threads, bool affinity, int cache_size)
+{
+    cache_size = std::max(cache_size, 1);
+
+    oidn::DeviceRef device;
+    // Jobs are run one at a time, so the cached filters share one deadline and its fallbacks
+    DeadlineFallbacks deadlines;
+    // Shared memory images stay mapped between jobs while their regions are unchanged
+    SharedRegions shared_regions;
+    try
+    {
+        PrintInfo("Initializing OIDN");
+        device = createDevice(num_threads, affinity);
+        deadlines.device = device;
+        PrintInfo("Using OIDN version %d.%d.%d", device.get<int>("versionMajor"),
+                  device.get<int>("versionMinor"), device.get<int>("versionPatch"));
+    }
+    catch (const std::exception& e)
+    {
+        PrintError("[OIDN]: %s", e.what());
+        return EXIT_FAILURE;
+    }
+
+    sockaddr_un address;
+    if (!fillAddress(socket_path, address))
+        return EXIT_FAILURE;
+
+    // Remove a stale socket left behind by a previous server, but never any other kind of file
+    struct stat socket_stat;
+    if (stat(socket_path.c_str(), &socket_stat) == 0)
+    {
+        if (!S_ISSOCK(socket_stat.st_mode))
+        {
+            PrintError("%s exists and is not a socket", socket_path.c_str());
+            return EXIT_FAILURE;
+        }
+        unlink(socket_path.c_str());
+    }
+
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0 ||
+        bind(server_fd, (sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(server_fd, 16) < 0)
+    {
+        PrintError("Could not listen on %s: %s", socket_path.c_str(), strerror(errno));
+        if (server_fd >= 0)
+            close(server_fd);
+        return EXIT_FAILURE;
+    }
+
+    // Stop cleanly on SIGINT/SIGTERM. SA_RESTART is not set so accept() is interrupted.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopHandler;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    PrintInfo("Listening on %s (filter cache size %d)", socket_path.c_str(), cache_size);
+
+    // Most recently used entries are at the front
+    std::list<CacheEntry> cache;
+    LatencyStats hits, misses;
+
+    while (!stop_requested)
+    {
+        int client_fd = accept(server_fd, nullptr, nullptr);
+        if (client_fd < 0)
+        {
+            if (errno != EINTR)
+                PrintError("accept failed: %s", strerror(errno));
+            continue;
+        }
+
+        std::vector<std::string> request;
+        if (!readRequest(client_fd, request))
+        {
+            close(client_fd);
+            continue;
+        }
+
+        if (request.size() == 1 && request[0] == "-stats")
+        {
+            writeAll(client_fd, statsReply(hits, misses));
+            close(client_fd);
+            continue;
+        }
+        if (request.size() == 1 && request[0] == "-stop")
+        {
+            writeAll(client_fd, "OK stopping\n");
+            close(client_fd);
+            break;
+        }
+
+        auto job_start = std::chrono::high_resolution_clock::now();
+        FrameJob job;
+        FilterSettings settings;
+        OutputSettings output;
+        std::string error;
+        if (!parseJob(request, job, settings, output, error))
+        {
+            PrintError("Bad request: %s", error.c_str());
+            writeAll(client_fd, "ERROR " + error + "\n");
+            close(client_fd);
+            continue;
+        }
+
+        PrintInfo("Job: %s -> %s", job.beauty.c_str(), job.output.c_str());
+        // Shared memory images are denoised where they are rather than read and saved
+        const bool shared = isSharedJob(job);
+        int width, height;
+        FrameImages images;
+        SharedFrame shared_frame;
+        if (!shared)
+            invalidateFiles(job);
+        if (shared ? !openSharedFrame(job, shared_regions, shared_frame) : !openFrame(job, images, width, height))
+        {
+            writeAll(client_fd, "ERROR could not open input images, see server log\n");
+            close(client_fd);
+            continue;
+        }
+        if (shared)
+        {
+            width = shared_frame.width;
+            height = shared_frame.height;
+        }
+
+        // Find a committed filter for this job or create a new one, evicting the least recently used
+        FilterKey key = { width, height, shared ? shared_frame.has_albedo : images.albedo != nullptr,
+                          shared ? shared_frame.has_normal : images.normal != nullptr, shared, settings };
+        auto entry = std::find_if(cache.begin(), cache.end(), [&key](const CacheEntry& e) { return e.key == key; });
+        const bool hit = entry != cache.end();
+        if (hit)
+        {
+            cache.splice(cache.begin(), cache, entry);
+        }
+        else
+        {
+            if (int(cache.size()) >= cache_size)
+                cache.pop_back();
+            try
+            {
+                cache.emplace_front();
+                cache.front().key = key;
+                cache.front().filter = createFilter(device, settings, &deadlines.control);
+            }
+            catch (const std::exception& e)
+            {
+                PrintError("[OIDN]: %s", e.what());
+                cache.pop_front();
+                writeAll(client_fd, std::string("ERROR ") + e.what() + "\n");
+                close(client_fd);
+                continue;
+            }
+        }
+
+        double denoise_ms = 0.0;
+        TraceScope trace(hit ? "job (cache hit)" : "job (cache miss)", job.beauty);
+        // The reply is only sent once the output is saved
+        FrameWriter writer(output, false);
+        bool success;
+        if (shared)
+            success = denoiseSharedFrame(shared_frame, cache.front().filter, cache.front().shared_binding, denoise_ms);
+        else
+            success = denoiseFrame(job, images, cache.front().filter, cache.front().buffers, settings, 1, 0, denoise_ms,
+                                   nullptr, &writer, &deadlines) && writer.flushLayers();
+        double job_ms = elapsedMilliseconds(job_start);
+
+        char reply[256];
+        if (success)
+        {
+            (hit ? hits : misses).add(job_ms);
+            PrintInfo("Job complete in %.3f ms (cache %s, denoise %.3f ms)", job_ms, hit ? "hit" : "miss", denoise_ms);
+            snprintf(reply, sizeof(reply), "OK %s total_ms=%.3f denoise_ms=%.3f\n", hit ? "hit" : "miss", job_ms, denoise_ms);
+        }
+        else
+        {
+            // The filter may be in an unknown state so don't keep it
+            cache.pop_front();
+            snprintf(reply, sizeof(reply), "ERROR denoise failed, see server log\n");
+        }
+        writeAll(client_fd, reply);
+        close(client_fd);
+    }
+
+    close(server_fd);
+    unlink(socket_path.c_str());
+    PrintInfo("Cache hits: %d (avg %.3f ms, max %.3f ms)", hits.count, hits.average(), hits.max_ms);
+    PrintInfo("Cache misses: %d (avg %.3f ms, max %.3f ms)", misses.count, misses.average(), misses.max_ms);
+    return EXIT_SUCCESS;
+}
+
+int runClient(const std::string& socket_path, const std::vector<std::string>& args)
+{
+    // Paths are resolved here as the server may run in a different working directory
+    std::string request;
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        std::string arg = args[i];
+        if (i > 0 && (args[i-1] == "-i" || args[i-1] == "-a" || args[i-1] == "-n" || args[i-1] == "-o" || args[i-1] == "-weights") &&
+            !isSharedImage(arg))
+            arg = std::filesystem::absolute(arg).string();
+        request += arg + "\n";
+    }
+    request += "\n";
+
+    sockaddr_un address;
+    if (!fillAddress(socket_path, address))
+        return EXIT_FAILURE;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) < 0)
+    {
+        PrintError("Could not connect to %s: %s", socket_path.c_str(), strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return EXIT_FAILURE;
+    }
+
+    std::string reply;
+    if (writeAll(fd, request))
+    {
+        char chunk[256];
+        ssize_t n;
+        while ((n = read(fd, chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR))
+        {
+            if (n > 0)
+                reply.append(chunk, size_t(n));
+        }
+    }
+    close(fd);
+
+    while (!reply.empty() && reply.back() == '\n')
+        reply.pop_back();
+    if (reply.compare(0, 2, "OK") != 0)
+    {
+        PrintError("Server: %s", reply.empty() ? "no reply" : reply.c_str());
+        return EXIT_FAILURE;
+    }
+    PrintInfo("Server: %s", reply.c_str());
+    PrintInfo("Round trip %.3f ms", elapsedMilliseconds(start));
+    return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Runs the denoise server on a Unix domain socket until it is asked to stop.
+// The device is created once and committed filters are kept in an LRU cache of
+// cache_size entries keyed by resolution, AOV layout and filter settings.
+// Returns the process exit code.
+int runServer(const std::string& socket_path, int num_threads, bool affinity, int cache_size);
+
+// Sends a job (the command line flags in args) to a running server and waits for the result.
+// Returns the process exit code.
+int runClient(const std::string& socket_path, const std::vector<std::string>& args);
@@ -0,0 +1,257 @@
+#include "shm.h"
+#include "log.h"
+#include "trace.h"
+#include <errno.h>
+#include <exception>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct SharedRegion
+{
+    unsigned char* data = nullptr;
+    size_t size = 0;
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    bool writable = false;
+
+    ~SharedRegion()
+    {
+#ifndef _WIN32
+        if (data)
+            munmap(data, size);
+#endif
+    }
+};
+
+SharedRegions::SharedRegions() = default;
+SharedRegions::~SharedRegions() = default;
+
+bool isSharedImage(const std::string& path)
+{
+    return path.compare(0, 4, "shm:") == 0 || path.compare(0, 3, "fd:") == 0;
+}
+
+bool isSharedJob(const FrameJob& job)
+{
+    return isSharedImage(job.beauty) || isSharedImage(job.albedo) || isSharedImage(job.normal) || isSharedImage(job.output);
+}
+
+#ifdef _WIN32
+
+bool openSharedFrame(const FrameJob& job, SharedRegions& regions, SharedFrame& frame)
+{
+    PrintError("Shared memory images are not supported on this platform");
+    return false;
+}
+
+#else
+
+namespace
+{
+
+// Maps the region behind path, or returns its existing mapping if the object is unchanged
+SharedRegion* mapRegion(SharedRegions& regions, const std::string& path, bool writable)
+{
+    // Shared memory objects are opened by name, while descriptors belong to whoever passed them
+    int fd = -1;
+    bool owned = false;
+    if (path.compare(0, 4, "shm:") == 0)
+    {
+        fd = shm_open(path.substr(4).c_str(), writable ? O_RDWR : O_RDONLY, 0);
+        owned = true;
+    }
+    else
+    {
+        try
+        {
+            fd = std::stoi(path.substr(3));
+        }
+        catch (const std::exception&)
+        {
+        }
+    }
+    struct stat region_stat;
+    if (fd < 0 || fstat(fd, &region_stat) != 0)
+    {
+        PrintError("Could not open shared image %s: %s", path.c_str(), strerror(errno));
+        if (owned && fd >= 0)
+            close(fd);
+        return nullptr;
+    }
+
+    std::unique_ptr<SharedRegion>& region = regions.mapped[path];
+    if (!region || region->device != uint64_t(region_stat.st_dev) || region->inode != uint64_t(region_stat.st_ino) ||
+        region->size != size_t(region_stat.st_size) || (writable && !region->writable))
+    {
+        region.reset();
+        void* data = MAP_FAILED;
+        if (region_stat.st_size >= off_t(sizeof(denoiser::SharedImageHeader)))
+            data = mmap(nullptr, size_t(region_stat.st_size), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            PrintError("Could not map shared image %s", path.c_str());
+            if (owned)
+                close(fd);
+            regions.mapped.erase(path);
+            return nullptr;
+        }
+        region.reset(new SharedRegion());
+        region->data = (unsigned char*)data;
+        region->size = size_t(region_stat.st_size);
+        region->device = uint64_t(region_stat.st_dev);
+        region->inode = uint64_t(region_stat.st_ino);
+        region->writable = writable;
+        if (verbosity >= 2)
+            PrintInfo("Mapped shared image %s (%.1f MB)", path.c_str(), region->size / (1024.0 * 1024.0));
+    }
+    if (owned)
+        close(fd);
+    return region.get();
+}
+
+// Reads the header of a region and checks its pixels lie within it
+bool sharedImage(const SharedRegion& region, const std::string& path, int& width, int& height, SharedImage& image)
+{
+    // Copied out so a producer writing the next header can't change it under us
+    denoiser::SharedImageHeader header;
+    memcpy(&header, region.data, sizeof(header));
+    if (header.magic != denoiser::shared_image_magic || header.version != denoiser::shared_image_version)
+    {
+        PrintError("%s is not a shared image of version %u", path.c_str(), denoiser::shared_image_version);
+        return false;
+    }
+    if (header.width <= 0 || header.height <= 0 || header.channels < 3 ||
+        (header.pixel_type != denoiser::SharedFloat && header.pixel_type != denoiser::SharedHalf))
+    {
+        PrintError("Shared image %s has an invalid header", path.c_str());
+        return false;
+    }
+    const bool half = header.pixel_type == denoiser::SharedHalf;
+    const uint64_t channel_size = half ? sizeof(uint16_t) : sizeof(float);
+    image.format = half ? oidn::Format::Half3 : oidn::Format::Float3;
+    image.pixel_stride = size_t(header.channels) * channel_size;
+
+    // Checked by division so values from a bad header can't overflow past the region
+    bool fits = header.data_offset >= sizeof(header) && header.data_offset <= region.size &&
+                header.data_offset % channel_size == 0 && header.row_stride % channel_size == 0;
+    const uint64_t available = fits ? region.size - header.data_offset : 0;
+    fits = fits && uint64_t(header.width) <= available / image.pixel_stride;
+    const uint64_t row_bytes = uint64_t(header.width) * image.pixel_stride;
+    const uint64_t row_stride = header.row_stride ? header.row_stride : row_bytes;
+    fits = fits && row_stride >= row_bytes &&
+           (header.height == 1 || row_stride <= available / uint64_t(header.height - 1)) &&
+           row_bytes <= available - uint64_t(header.height - 1) * row_stride;
+    if (!fits)
+    {
+        PrintError("The pixels of shared image %s don't fit in its region", path.c_str());
+        return false;
+    }
+    image.row_stride = size_t(row_stride);
+    image.data = region.data + header.data_offset;
+    width = header.width;
+    height = header.height;
+    return true;
+}
+
+} // namespace
+
+bool openSharedFrame(const FrameJob& job, SharedRegions& regions, SharedFrame& frame)
+{
+    if (!isSharedImage(job.beauty) || !isSharedImage(job.output) || (!job.albedo.empty() && !isSharedImage(job.albedo)) ||
+        (!job.normal.empty() && !isSharedImage(job.normal)))
+    {
+        PrintError("Shared images can't be mixed with files");
+        return false;
+    }
+    if (!job.normal.empty() && job.albedo.empty())
+    {
+        PrintError("A normal image needs an albedo image");
+        return false;
+    }
+
+    TraceScope trace("map shared images");
+    const std::string* paths[4] = { &job.beauty, &job.albedo, &job.normal, &job.output };
+    SharedImage* images[4] = { &frame.color, &frame.albedo, &frame.normal, &frame.output };
+    for (int i = 0; i < 4; i++)
+    {
+        *images[i] = SharedImage();
+        if (paths[i]->empty())
+            continue;
+        // The color is written too when denoising in place
+        const bool writable = *paths[i] == job.output;
+        SharedRegion* region = mapRegion(regions, *paths[i], writable);
+        int width, height;
+        if (!region || !sharedImage(*region, *paths[i], width, height, *images[i]))
+            return false;
+        if (i == 0)
+        {
+            frame.width = width;
+            frame.height = height;
+        }
+        else if (width != frame.width || height != frame.height)
+        {
+            PrintError("Shared image %s is %dx%d but the color is %dx%d", paths[i]->c_str(), width, height,
+                       frame.width, frame.height);
+            return false;
+        }
+    }
+    frame.has_albedo = frame.albedo.data != nullptr;
+    frame.has_normal = frame.normal.data != nullptr;
+    return true;
+}
+
+#endif
+
+bool denoiseSharedFrame(const SharedFrame& frame, oidn::FilterRef& filter, SharedBinding& bound, double& denoise_ms)
+{
+    const SharedImage* images[4] = { &frame.color, &frame.albedo, &frame.normal, &frame.output };
+    const char* names[4] = { "color", "albedo", "normal", "output" };
+    SharedBinding binding = { uintptr_t(frame.width), uintptr_t(frame.height) };
+    for (const SharedImage* image : images)
+    {
+        binding.push_back(uintptr_t(image->data));
+        binding.push_back(uintptr_t(image->format));
+        binding.push_back(image->pixel_stride);
+        binding.push_back(image->row_stride);
+    }
+
+    try
+    {
+        if (binding != bound)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                if (images[i]->data)
+                    filter.setImage(names[i], images[i]->data, images[i]->format, frame.width, frame.height, 0,
+                                    images[i]->pixel_stride, images[i]->row_stride);
+                else
+                    filter.unsetImage(names[i]);
+            }
+            TraceScope trace("filter commit");
+            filter.commit();
+            bound = binding;
+        }
+        PrintInfo("Denoising...");
+        auto start = std::chrono::high_resolution_clock::now();
+        {
+            TraceScope trace("execute");
+            filter.execute();
+        }
+        denoise_ms = elapsedMilliseconds(start);
+        PrintInfo("Denoising complete in %.3f seconds", denoise_ms / 1000.0);
+    }
+    catch (const std::exception& e)
+    {
+        // Bound again from scratch next time
+        bound.clear();
+        PrintError("[OIDN]: %s", e.what());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "frame.h"
+#include <shared_image.h>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Images can be given as shared memory regions written by another process, e.g. a renderer,
+// instead of files: "shm:/name" for a POSIX shared memory object or "fd:N" for an inherited
+// file descriptor such as a memfd. Each region starts with a denoiser::SharedImageHeader
+// (include/shared_image.h) and the pixels are given to OIDN where they are, with no copies.
+
+bool isSharedImage(const std::string& path);
+
+// Whether any image of the job is shared. A job can't mix shared images and files.
+bool isSharedJob(const FrameJob& job);
+
+struct SharedRegion;
+
+// Mapped shared regions by name. Regions stay mapped between frames while the object behind
+// each name is unchanged, so a renderer that reuses its regions keeps the same pointers and
+// the filter isn't committed again.
+struct SharedRegions
+{
+    SharedRegions();
+    ~SharedRegions();
+    std::map<std::string, std::unique_ptr<SharedRegion>> mapped;
+};
+
+// An image of a frame in a mapped region, as given to the filter
+struct SharedImage
+{
+    void* data = nullptr;
+    oidn::Format format = oidn::Format::Float3;
+    size_t pixel_stride = 0;
+    size_t row_stride = 0;
+};
+
+struct SharedFrame
+{
+    int width = 0;
+    int height = 0;
+    bool has_albedo = false;
+    bool has_normal = false;
+    SharedImage color;
+    SharedImage albedo;
+    SharedImage normal;
+    SharedImage output;
+};
+
+// The images a filter was last committed with, so it is only committed again when they change
+typedef std::vector<uintptr_t> SharedBinding;
+
+// Maps the shared images of a job and checks their headers. The output is mapped writable
+// and may be the color region, to denoise in place.
+bool openSharedFrame(const FrameJob& job, SharedRegions& regions, SharedFrame& frame);
+
+// Denoises a frame opened by openSharedFrame straight from and to its regions. Returns false
+// on OIDN errors.
+bool denoiseSharedFrame(const SharedFrame& frame, oidn::FilterRef& filter, SharedBinding& bound, double& denoise_ms);
@@ -0,0 +1,244 @@
+#include "stream.h"
+#include "log.h"
+#include "trace.h"
+#include <OpenImageIO/imageio.h>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdio.h>
+
+namespace
+{
+
+struct StreamInput
+{
+    std::unique_ptr<OIIO::ImageInput> file;
+    std::vector<float> window;
+    int channels = 0;
+    // Preprocessing applied to the rows as they are read
+    PixelTransform transform;
+};
+
+bool openInput(const std::string& path, const char* name, StreamInput& input)
+{
+    if (verbosity >= 2)
+        PrintInfo("%s image: %s", name, path.c_str());
+    input.file = OIIO::ImageInput::open(path);
+    if (!input.file)
+    {
+        PrintError("Failed to load %s image", name);
+        PrintError("[OIIO]: %s", OIIO::geterror().c_str());
+        return false;
+    }
+    if (input.file->spec().nchannels < 3)
+    {
+        PrintError("Streaming requires the %s image to have at least three channels", name);
+        return false;
+    }
+    return true;
+}
+
+// Reads rows [y, y + rows) of the data window into the input's window buffer
+bool readRows(StreamInput& input, int y, int rows, const char* name)
+{
+    TraceScope trace("read_scanlines", name);
+    const OIIO::ImageSpec& spec = input.file->spec();
+    if (!input.file->read_scanlines(0, 0, spec.y + y, spec.y + y + rows, 0, 0, input.channels,
+                                    OIIO::TypeDesc::FLOAT, &input.window[0]))
+    {
+        PrintError("Failed to read %s rows %d-%d", name, y, y + rows);
+        PrintError("[OIIO]: %s", input.file->geterror().c_str());
+        return false;
+    }
+    preprocessPixels(&input.window[0], size_t(spec.width) * rows, input.channels, input.transform);
+    return true;
+}
+
+bool samePath(const std::string& a, const std::string& b)
+{
+    std::error_code error;
+    return !b.empty() && std::filesystem::equivalent(a, b, error);
+}
+
+} // namespace
+
+bool streamDenoise(const FrameJob& job, oidn::DeviceRef& device, FilterSettings settings, int budget_mb,
+                   const OutputSettings& output_settings, int& width, int& height, double& denoise_ms)
+{
+    // Rows are written while the inputs are still being read, so they must be different files
+    if (samePath(job.output, job.beauty) || samePath(job.output, job.albedo) || samePath(job.output, job.normal))
+    {
+        PrintError("Streaming cannot write over one of its inputs: %s", job.output.c_str());
+        return false;
+    }
+    if (!job.normal.empty() && job.albedo.empty())
+    {
+        PrintError("You cannot use a normal AOV without an albedo");
+        return false;
+    }
+
+    StreamInput beauty, albedo, normal;
+    if (!openInput(job.beauty, "Input", beauty))
+        return false;
+    const bool a_loaded = !job.albedo.empty();
+    const bool n_loaded = !job.normal.empty();
+    if (a_loaded && !openInput(job.albedo, "Albedo", albedo))
+        return false;
+    if (n_loaded && !openInput(job.normal, "Normal", normal))
+        return false;
+
+    const OIIO::ImageSpec& spec = beauty.file->spec();
+    width = spec.width;
+    height = spec.height;
+    if ((a_loaded && (albedo.file->spec().width != width || albedo.file->spec().height != height)) ||
+        (n_loaded && (normal.file->spec().width != width || normal.file->spec().height != height)))
+    {
+        PrintError("Feature images not same resolution as beauty");
+        return false;
+    }
+    beauty.channels = spec.nchannels;
+    albedo.channels = normal.channels = 3;
+    beauty.transform = layerTransform(settings.preprocess, InputLayer::Beauty);
+    albedo.transform = layerTransform(settings.preprocess, InputLayer::Albedo);
+    normal.transform = layerTransform(settings.preprocess, InputLayer::Normal);
+
+    // Half of the budget is given to OIDN, which tiles internally to stay within it,
+    // and the rest holds the rows of the current band for each layer.
+    budget_mb = std::max(budget_mb, 2);
+    settings.maxmem = budget_mb / 2;
+    const size_t row_bytes = size_t(width) * sizeof(float) *
+        (beauty.channels + (a_loaded ? albedo.channels : 0) + (n_loaded ? normal.channels : 0));
+    const int rows_in_budget = int(std::min<size_t>(size_t(budget_mb - settings.maxmem) * 1024 * 1024 / row_bytes, height));
+
+    int overlap = default_overlap;
+    int window_rows = 0;
+    int band_rows = 0;
+    oidn::FilterRef filter;
+    try
+    {
+        filter = createFilter(device, settings);
+
+        // Every band uses a window of the same height so the filter is only committed
+        // once. The overlap is only known after a commit, so if it turns out to be larger
+        // than our guess the bands are laid out again.
+        for (int attempt = 0; attempt < 2; attempt++)
+        {
+            window_rows = rows_in_budget;
+            band_rows = (window_rows == height) ? height : window_rows - 2 * overlap;
+            if (band_rows < 1)
+            {
+                PrintError("A memory budget of %dMB is too small to stream an image %d pixels wide", budget_mb, width);
+                return false;
+            }
+
+            beauty.window.resize(size_t(window_rows) * width * beauty.channels);
+            if (a_loaded)
+                albedo.window.resize(size_t(window_rows) * width * albedo.channels);
+            if (n_loaded)
+                normal.window.resize(size_t(window_rows) * width * normal.channels);
+
+            // The band is denoised in place, so alpha and other channels pass straight through
+            const size_t beauty_stride = beauty.channels * sizeof(float);
+            filter.setImage("color", (void*)&beauty.window[0], oidn::Format::Float3, width, window_rows, 0, beauty_stride);
+            filter.setImage("output", (void*)&beauty.window[0], oidn::Format::Float3, width, window_rows, 0, beauty_stride);
+            if (a_loaded)
+                filter.setImage("albedo", (void*)&albedo.window[0], oidn::Format::Float3, width, window_rows);
+            if (n_loaded)
+                filter.setImage("normal", (void*)&normal.window[0], oidn::Format::Float3, width, window_rows);
+            filter.commit();
+
+            const int needed = filter.get<int>("tileOverlap");
+            if (needed <= overlap || window_rows == height)
+                break;
+            overlap = needed;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        PrintError("[OIDN]: %s", e.what());
+        return false;
+    }
+
+    // Write the output as scanlines in the beauty's format and metadata, unless set otherwise
+    remove(job.output.c_str());
+    std::unique_ptr<OIIO::ImageOutput> output = OIIO::ImageOutput::create(job.output);
+    OIIO::ImageSpec out_spec = spec;
+    out_spec.tile_width = out_spec.tile_height = out_spec.tile_depth = 0;
+    applyOutputSettings(out_spec, output_settings);
+    if (!output || !output->open(job.output, out_spec))
+    {
+        PrintError("Could not save file %s", job.output.c_str());
+        PrintError("[OIIO]: %s", output ? output->geterror().c_str() : OIIO::geterror().c_str());
+        return false;
+    }
+
+    const int num_bands = (height + band_rows - 1) / band_rows;
+    PrintInfo("Streaming %dx%d image in %d bands of %d rows (%d rows overlap, %.1fMB buffers, %dMB for OIDN)",
+              width, height, num_bands, band_rows, overlap,
+              double(row_bytes) * window_rows / (1024.0 * 1024.0), settings.maxmem);
+
+    denoise_ms = 0.0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int band = 0; band < num_bands; band++)
+    {
+        // The rows finished by this band and the window around them
+        const int y_begin = band * band_rows;
+        const int y_end = std::min(y_begin + band_rows, height);
+        const int window_begin = std::clamp(y_begin - overlap, 0, height - window_rows);
+        if (verbosity >= 2)
+            PrintInfo("Band %d/%d: rows %d-%d", band + 1, num_bands, y_begin, y_end);
+
+        // Each layer is decoded on its own thread
+        std::future<bool> albedo_read, normal_read;
+        if (a_loaded)
+            albedo_read = std::async(std::launch::async, readRows, std::ref(albedo), window_begin, window_rows, "albedo");
+        if (n_loaded)
+            normal_read = std::async(std::launch::async, readRows, std::ref(normal), window_begin, window_rows, "normal");
+        bool read_success = readRows(beauty, window_begin, window_rows, "beauty");
+        if (a_loaded && !albedo_read.get())
+            read_success = false;
+        if (n_loaded && !normal_read.get())
+            read_success = false;
+        if (!read_success)
+        {
+            output->close();
+            return false;
+        }
+
+        try
+        {
+            TraceScope trace("execute");
+            auto denoise_start = std::chrono::high_resolution_clock::now();
+            filter.execute();
+            denoise_ms += elapsedMilliseconds(denoise_start);
+        }
+        catch (const std::exception& e)
+        {
+            PrintError("[OIDN]: %s", e.what());
+            output->close();
+            return false;
+        }
+
+        TraceScope trace("write_scanlines");
+        const float* rows = &beauty.window[size_t(y_begin - window_begin) * width * beauty.channels];
+        if (!output->write_scanlines(spec.y + y_begin, spec.y + y_end, 0, OIIO::TypeDesc::FLOAT, rows))
+        {
+            PrintError("Could not write rows %d-%d of %s", y_begin, y_end, job.output.c_str());
+            PrintError("[OIIO]: %s", output->geterror().c_str());
+            output->close();
+            return false;
+        }
+    }
+
+    if (!output->close())
+    {
+        PrintError("Could not save file %s", job.output.c_str());
+        PrintError("[OIIO]: %s", output->geterror().c_str());
+        return false;
+    }
+    PrintInfo("Streamed in %.3f seconds (denoise %.3f seconds)", elapsedMilliseconds(start) / 1000.0, denoise_ms / 1000.0);
+    PrintInfo("Done!");
+    return true;
+}
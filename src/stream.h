@@ -0,0 +1,11 @@
+#pragma once
+
+#include "frame.h"
+
+// Denoises a frame in horizontal bands without ever holding the whole image in memory.
+// Each band is read with enough extra rows above and below to cover the receptive field
+// of the network, so the finished rows written to the output have no seams. The pixel
+// buffers and OIDN's scratch memory together stay within budget_mb.
+// The output is encoded as set by output_settings. width and height are set to the image resolution.
+bool streamDenoise(const FrameJob& job, oidn::DeviceRef& device, FilterSettings settings, int budget_mb,
+                   const OutputSettings& output_settings, int& width, int& height, double& denoise_ms);
@@ -0,0 +1,184 @@
+#include "trace.h"
+#include "log.h"
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+struct TraceEvent
+{
+    char phase;
+    std::string name;
+    std::string detail;
+    double timestamp_us;
+    double duration_us;
+    double value;
+    int thread;
+};
+
+bool enabled = false;
+std::string trace_path;
+std::mutex trace_mutex;
+std::vector<TraceEvent> events;
+std::map<std::thread::id, int> thread_ids;
+
+double microseconds(std::chrono::high_resolution_clock::time_point time)
+{
+    std::chrono::duration<double, std::micro> span = time - app_start_time;
+    return span.count();
+}
+
+// Small sequential ids read better in the trace viewer than native thread ids
+int threadId()
+{
+    auto id = thread_ids.find(std::this_thread::get_id());
+    if (id != thread_ids.end())
+        return id->second;
+    int next = int(thread_ids.size()) + 1;
+    thread_ids[std::this_thread::get_id()] = next;
+    return next;
+}
+
+void addEvent(TraceEvent event)
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    event.thread = threadId();
+    events.push_back(std::move(event));
+}
+
+std::string jsonString(const std::string& value)
+{
+    std::string escaped = "\"";
+    for (char c : value)
+    {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        if (c >= 0 && c < 0x20)
+            continue;
+        escaped += c;
+    }
+    return escaped + "\"";
+}
+
+} // namespace
+
+void startTrace(const std::string& path)
+{
+    trace_path = path;
+    enabled = true;
+    events.reserve(4096);
+    traceCounter("hardware threads", double(std::thread::hardware_concurrency()));
+}
+
+bool traceEnabled()
+{
+    return enabled;
+}
+
+double peakRssMB()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return double(counters.PeakWorkingSetSize) / (1024.0 * 1024.0);
+    return 0.0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0.0;
+#ifdef __APPLE__
+    return double(usage.ru_maxrss) / (1024.0 * 1024.0); // bytes
+#else
+    return double(usage.ru_maxrss) / 1024.0; // kilobytes
+#endif
+#endif
+}
+
+void traceCounter(const char* name, double value)
+{
+    if (!enabled)
+        return;
+    addEvent({ 'C', name, "", microseconds(std::chrono::high_resolution_clock::now()), 0.0, value, 0 });
+}
+
+TraceScope::TraceScope(const char* name)
+    : TraceScope(name, std::string())
+{
+}
+
+TraceScope::TraceScope(const char* name, const std::string& detail)
+    : enabled(::enabled)
+{
+    if (!enabled)
+        return;
+    this->name = name;
+    this->detail = detail;
+    start = std::chrono::high_resolution_clock::now();
+}
+
+TraceScope::~TraceScope()
+{
+    if (!enabled)
+        return;
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::micro> duration = end - start;
+    addEvent({ 'X', name, detail, microseconds(start), duration.count(), 0.0, 0 });
+    traceCounter("peak RSS (MB)", peakRssMB());
+}
+
+void finishTrace()
+{
+    if (!enabled)
+        return;
+    traceCounter("peak RSS (MB)", peakRssMB());
+    enabled = false;
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    std::ofstream file(trace_path);
+    if (!file)
+    {
+        PrintError("Could not write trace to %s", trace_path.c_str());
+        return;
+    }
+#ifdef _WIN32
+    const int pid = int(GetCurrentProcessId());
+#else
+    const int pid = int(getpid());
+#endif
+    char line[256];
+    file << "{\"traceEvents\":[\n";
+    file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"args\":{\"name\":\"Denoiser\"}}";
+    for (const TraceEvent& event : events)
+    {
+        file << ",\n{\"name\":" << jsonString(event.name);
+        if (event.phase == 'X')
+        {
+            snprintf(line, sizeof(line), ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                     event.timestamp_us, event.duration_us, pid, event.thread);
+            file << line;
+            if (!event.detail.empty())
+                file << ",\"args\":{\"detail\":" << jsonString(event.detail) << "}";
+        }
+        else
+        {
+            snprintf(line, sizeof(line), ",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,\"args\":{\"value\":%.3f}",
+                     event.timestamp_us, pid, event.value);
+            file << line;
+        }
+        file << "}";
+    }
+    file << "\n]}\n";
+    PrintInfo("Trace written to %s (%d events, peak RSS %.1fMB)", trace_path.c_str(), int(events.size()), peakRssMB());
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+// Collects timed phases and counters of a run and writes them as a Chrome trace
+// (JSON) that can be opened in Perfetto or chrome://tracing. Nothing is recorded
+// until startTrace is called.
+
+void startTrace(const std::string& path);
+
+// Writes the trace file if tracing was started. Safe to call more than once.
+void finishTrace();
+
+bool traceEnabled();
+
+// Records a counter sample, e.g. OIDN progress or memory use
+void traceCounter(const char* name, double value);
+
+// Peak resident set size of the process in MB
+double peakRssMB();
+
+// Records the time from construction to destruction as a phase on the calling thread
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* name);
+    TraceScope(const char* name, const std::string& detail);
+    ~TraceScope();
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    std::string name;
+    std::string detail;
+    std::chrono::high_resolution_clock::time_point start;
+    bool enabled;
+};
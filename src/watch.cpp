@@ -0,0 +1,321 @@
+#include "watch.h"
+#include "channels.h"
+#include "log.h"
+#include "prefilter.h"
+#include "trace.h"
+#include "writer.h"
+#include <OpenImageIO/imagecache.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <exception>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+// Time without changes before the inputs are read, so a burst of writes gives one update
+const int debounce_ms = 250;
+// How often the watcher wakes up to check on the denoise and for Ctrl+C
+const int poll_ms = 50;
+// Files modified but never closed, e.g. by writers that keep them open or write through
+// mmap, are taken as written once they have been quiet for this long
+const int open_timeout_ms = 2000;
+
+volatile std::sig_atomic_t stop_requested = 0;
+
+void requestStop(int)
+{
+    stop_requested = 1;
+}
+
+std::string normalisedPath(const std::string& path)
+{
+    std::error_code error;
+    std::filesystem::path absolute = std::filesystem::absolute(path, error);
+    return (error ? std::filesystem::path(path) : absolute).lexically_normal().string();
+}
+
+// The files a path is read from or saved to, without any channel selector
+std::string fileOf(const std::string& path)
+{
+    std::string file, selector;
+    splitChannelSelector(path, file, selector);
+    return normalisedPath(file);
+}
+
+// Reports changes to a set of files. On Linux this uses inotify on their directories, so
+// files replaced by renaming a temporary file are seen too. Elsewhere the modification
+// times and sizes are polled.
+class FileWatcher
+{
+public:
+    ~FileWatcher()
+    {
+#ifdef __linux__
+        if (fd >= 0)
+            close(fd);
+#endif
+    }
+
+    bool start(const std::set<std::string>& paths)
+    {
+        files = paths;
+#ifdef __linux__
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0)
+        {
+            PrintError("Could not start watching the inputs: %s", strerror(errno));
+            return false;
+        }
+        for (const std::string& file : files)
+        {
+            const std::string directory = std::filesystem::path(file).parent_path().string();
+            int wd = inotify_add_watch(fd, directory.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+            if (wd < 0)
+            {
+                PrintError("Could not watch %s: %s", directory.c_str(), strerror(errno));
+                return false;
+            }
+            directories[wd] = directory;
+        }
+#else
+        for (const std::string& file : files)
+            stamps[file] = stampOf(file);
+#endif
+        return true;
+    }
+
+    // Waits up to timeout_ms and returns whether any of the files changed. writing is set
+    // while a file is open for writing, so it isn't read half written.
+    bool wait(int timeout_ms, bool& writing)
+    {
+        bool changed = false;
+#ifdef __linux__
+        pollfd request = { fd, POLLIN, 0 };
+        if (poll(&request, 1, timeout_ms) <= 0)
+        {
+            writing = stillWriting();
+            return false;
+        }
+        alignas(inotify_event) char buffer[16384];
+        ssize_t length;
+        while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+        {
+            for (char* ptr = buffer; ptr < buffer + length;)
+            {
+                const inotify_event* event = (const inotify_event*)ptr;
+                ptr += sizeof(inotify_event) + event->len;
+                if (!event->len || !directories.count(event->wd))
+                    continue;
+                const std::string path = (std::filesystem::path(directories[event->wd]) / event->name).string();
+                if (!files.count(path))
+                    continue;
+                changed = true;
+                if (event->mask & IN_MODIFY)
+                    open_files[path] = std::chrono::steady_clock::now();
+                else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                    open_files.erase(path);
+            }
+        }
+        writing = stillWriting();
+#else
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+        for (auto& stamp : stamps)
+        {
+            const std::string current = stampOf(stamp.first);
+            if (current != stamp.second)
+            {
+                stamp.second = current;
+                changed = true;
+            }
+        }
+        writing = false;
+#endif
+        return changed;
+    }
+
+private:
+    std::set<std::string> files;
+#ifdef __linux__
+    int fd = -1;
+    std::map<int, std::string> directories;
+    // Files open for writing and when they were last modified
+    std::map<std::string, std::chrono::steady_clock::time_point> open_files;
+
+    // Forgets the files that have been quiet for open_timeout_ms and returns whether any are left
+    bool stillWriting()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        for (auto it = open_files.begin(); it != open_files.end();)
+        {
+            if (now - it->second >= std::chrono::milliseconds(open_timeout_ms))
+                it = open_files.erase(it);
+            else
+                ++it;
+        }
+        return !open_files.empty();
+    }
+#else
+    std::map<std::string, std::string> stamps;
+
+    static std::string stampOf(const std::string& file)
+    {
+        std::error_code time_error, size_error;
+        auto time = std::filesystem::last_write_time(file, time_error);
+        auto size = std::filesystem::file_size(file, size_error);
+        if (time_error || size_error)
+            return std::string();
+        return std::to_string(time.time_since_epoch().count()) + "|" + std::to_string(size);
+    }
+#endif
+};
+
+} // namespace
+
+int runWatch(const std::vector<FrameJob>& jobs, oidn::DeviceRef& device, const FilterSettings& settings,
+             const OutputSettings& output, AuxPrefilter* prefilter)
+{
+    std::set<std::string> inputs;
+    for (const FrameJob& job : jobs)
+    {
+        for (const std::string* path : { &job.beauty, &job.albedo, &job.normal })
+        {
+            if (!path->empty())
+                inputs.insert(fileOf(*path));
+        }
+    }
+    for (const FrameJob& job : jobs)
+    {
+        if (inputs.count(fileOf(job.output)))
+        {
+            PrintError("-watch needs the output %s to be a different file from the inputs", job.output.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The filter's executions are cancelled through the progress callback when the inputs change
+    ExecutionControl control;
+    if (prefilter)
+        prefilter->control = &control;
+    oidn::FilterRef filter;
+    try
+    {
+        filter = createFilter(device, settings, &control);
+    }
+    catch (const std::exception& e)
+    {
+        PrintError("[OIDN]: %s", e.what());
+        return EXIT_FAILURE;
+    }
+
+    FileWatcher watcher;
+    if (!watcher.start(inputs))
+        return EXIT_FAILURE;
+    std::signal(SIGINT, requestStop);
+    PrintInfo("Watching %d files for changes, press Ctrl+C to stop", int(inputs.size()));
+
+    // Denoises every job once with the inputs as they are now. Outputs are saved before the
+    // update finishes so its latency covers the write.
+    DenoiseBuffers buffers;
+    FrameWriter writer(output, false);
+    auto update = [&]() -> bool
+    {
+        TraceScope trace("update");
+        // Images read before may still be held by OIIO's cache
+        auto cache = OIIO::ImageCache::create(true);
+        for (const std::string& file : inputs)
+            cache->invalidate(OIIO::ustring(file));
+        // Files are read once per update however many layers use them
+        SourceFiles sources;
+        bool success = true;
+        for (const FrameJob& job : jobs)
+        {
+            FrameImages images;
+            int width = 0, height = 0;
+            double denoise_ms = 0.0;
+            if (control.cancel || !openFrame(job, images, width, height, &sources) ||
+                !denoiseFrame(job, images, filter, buffers, settings, 1, 0, denoise_ms, prefilter, &writer))
+            {
+                success = false;
+                break;
+            }
+        }
+        // Layers held for the last file are saved with this update too
+        return writer.flushLayers() && success;
+    };
+
+    // The first update is made straight away
+    bool pending = true;
+    bool writing = false;
+    auto last_change = std::chrono::high_resolution_clock::now();
+    auto update_change = last_change;
+    auto update_start = last_change;
+    std::future<bool> running;
+    int num_updates = 0;
+    int num_saved = 0;
+    while (!stop_requested)
+    {
+        if (watcher.wait(poll_ms, writing))
+        {
+            last_change = std::chrono::high_resolution_clock::now();
+            pending = true;
+            if (running.valid() && !control.cancel)
+            {
+                if (verbosity >= 2)
+                    PrintInfo("Inputs changed, cancelling update %d", num_updates);
+                control.cancel = true;
+            }
+        }
+
+        if (running.valid() && running.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        {
+            if (running.get())
+            {
+                num_saved++;
+                PrintInfo("Update %d saved in %.3f seconds, %.3f seconds after the inputs changed", num_updates,
+                          elapsedMilliseconds(update_start) / 1000.0, elapsedMilliseconds(update_change) / 1000.0);
+            }
+            else if (control.cancel)
+                PrintInfo("Update %d cancelled by newer inputs", num_updates);
+            else
+                PrintInfo("Update %d skipped, waiting for the inputs to change again", num_updates);
+        }
+
+        // Start the next update once the inputs have settled and the last one has finished
+        if (pending && !running.valid() && !writing && elapsedMilliseconds(last_change) >= debounce_ms)
+        {
+            pending = false;
+            control.cancel = false;
+            num_updates++;
+            update_change = last_change;
+            update_start = std::chrono::high_resolution_clock::now();
+            if (verbosity >= 2)
+                PrintInfo("Update %d", num_updates);
+            running = std::async(std::launch::async, update);
+        }
+    }
+
+    if (running.valid())
+    {
+        control.cancel = true;
+        running.get();
+    }
+    PrintInfo("Stopped watching after %d updates (%d saved)", num_updates, num_saved);
+    return EXIT_SUCCESS;
+}
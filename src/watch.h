@@ -0,0 +1,14 @@
+#pragma once
+
+#include "frame.h"
+#include <vector>
+
+struct AuxPrefilter;
+
+// Denoises the jobs again every time one of their input files changes, e.g. as a progressive
+// render keeps overwriting its output, until interrupted with Ctrl+C. The device and committed
+// filter are kept between updates. Changes are debounced and files still being written are
+// waited for; a change during a denoise cancels it so the newer inputs are denoised instead.
+// The time from the change to the output being saved is reported for each update.
+int runWatch(const std::vector<FrameJob>& jobs, oidn::DeviceRef& device, const FilterSettings& settings,
+             const OutputSettings& output, AuxPrefilter* prefilter);
@@ -0,0 +1,109 @@
+#include "weights.h"
+#include "cache.h"
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+// A mapped weights file, with the time and size it had when it was mapped
+struct MappedWeights
+{
+    WeightsBlob blob;
+    long long mtime = 0;
+    uintmax_t size = 0;
+};
+
+std::mutex mapped_mutex;
+std::map<std::string, MappedWeights> mapped;
+
+WeightsBlob mapFile(const std::string& path)
+{
+    WeightsBlob blob;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("could not open weights " + path);
+    LARGE_INTEGER size;
+    HANDLE mapping = nullptr;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping)
+    {
+        blob.data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        blob.size = size_t(size.QuadPart);
+        // The view keeps the mapping alive
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    if (!blob.data)
+        throw std::runtime_error("could not map weights " + path);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("could not open weights " + path);
+    struct stat file_stat;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+        data = mmap(nullptr, size_t(file_stat.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file open
+    close(fd);
+    if (data == MAP_FAILED)
+        throw std::runtime_error("could not map weights " + path);
+    // The whole blob is read when the filter is committed
+    madvise(data, size_t(file_stat.st_size), MADV_WILLNEED);
+    blob.data = data;
+    blob.size = size_t(file_stat.st_size);
+#endif
+    return blob;
+}
+
+// The mapping of the file at path, mapped again if the file changed since. Called with mapped_mutex held.
+MappedWeights& mappedWeights(const std::string& path)
+{
+    std::error_code error;
+    std::filesystem::path canonical = std::filesystem::canonical(path, error);
+    const std::string key = error ? path : canonical.string();
+    std::error_code time_error, size_error;
+    const auto mtime = std::filesystem::last_write_time(key, time_error);
+    const uintmax_t size = std::filesystem::file_size(key, size_error);
+    if (time_error || size_error)
+        throw std::runtime_error("could not open weights " + path);
+
+    MappedWeights& entry = mapped[key];
+    const long long time = (long long)mtime.time_since_epoch().count();
+    if (entry.blob.data && entry.mtime == time && entry.size == size)
+        return entry;
+    // Retrained weights saved to the same path get a new mapping. The old one is kept as
+    // filters created before may still use it.
+    MappedWeights updated;
+    updated.blob = mapFile(key);
+    updated.mtime = time;
+    updated.size = size;
+    entry = updated;
+    return entry;
+}
+
+} // namespace
+
+WeightsBlob mapWeights(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(mapped_mutex);
+    return mappedWeights(path).blob;
+}
+
+uint64_t hashWeights(const WeightsBlob& blob)
+{
+    return hashBytes((const unsigned char*)blob.data, blob.size);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// A custom weights blob (.tza) mapped read only into memory
+struct WeightsBlob
+{
+    const void* data = nullptr;
+    size_t size = 0;
+};
+
+// Maps the weights file at path, or returns the mapping of an earlier call, so every filter
+// in the process shares one copy. The pages come from the page cache, so other processes
+// mapping the same file share them too. A file that changed since is mapped again.
+// Mappings are kept until the process exits as filters refer to them directly. Doesn't
+// log, as the embedding API uses it too. Throws on failure.
+WeightsBlob mapWeights(const std::string& path);
+
+// Hash of the contents of a mapping, as given to a filter
+uint64_t hashWeights(const WeightsBlob& blob);
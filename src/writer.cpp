@@ -0,0 +1,100 @@
+#include "writer.h"
+#include "log.h"
+#include <algorithm>
+#include <OpenImageIO/imageio.h>
+
+FrameWriter::FrameWriter(const OutputSettings& output, bool background)
+    : output(output), num_failed(0)
+{
+    if (!background)
+        return;
+    queue.reset(new BoundedQueue<std::function<bool()>>(2));
+    thread = std::thread([this]
+    {
+        std::function<bool()> save;
+        while (queue->pop(save))
+        {
+            if (!save())
+                num_failed++;
+        }
+    });
+}
+
+FrameWriter::~FrameWriter()
+{
+    finish();
+}
+
+bool FrameWriter::submit(std::function<bool()> save)
+{
+    saveHeldLayers(true);
+    if (!thread.joinable())
+        return save();
+    queue->push(std::move(save));
+    return true;
+}
+
+bool FrameWriter::addLayer(const std::string& path, const std::string& name, std::shared_ptr<OIIO::ImageBuf> source,
+                           std::shared_ptr<OIIO::ImageBuf> layer)
+{
+    if (!layers.layers.empty() && layers.path != path)
+        saveHeldLayers(true);
+    if (layers.layers.empty())
+    {
+        layers.path = path;
+        layers.source = source;
+    }
+    // A layer given again replaces the one held
+    auto found = std::find(layers.names.begin(), layers.names.end(), name);
+    if (found != layers.names.end())
+        layers.layers[found - layers.names.begin()] = layer;
+    else
+    {
+        layers.names.push_back(name);
+        layers.layers.push_back(layer);
+    }
+    return true;
+}
+
+bool FrameWriter::flushLayers()
+{
+    return saveHeldLayers(false);
+}
+
+bool FrameWriter::saveHeldLayers(bool count)
+{
+    if (layers.layers.empty())
+        return true;
+    auto file = std::make_shared<LayerFile>(std::move(layers));
+    layers = LayerFile();
+    const OutputSettings settings = output;
+    std::function<bool()> save = [file, settings]()
+    {
+        return saveLayers(*file, settings);
+    };
+    if (thread.joinable())
+    {
+        queue->push(std::move(save));
+        return true;
+    }
+    const bool success = save();
+    if (!success && count)
+        num_failed++;
+    return success;
+}
+
+int FrameWriter::finish()
+{
+    saveHeldLayers(true);
+    if (thread.joinable())
+    {
+        queue->close();
+        thread.join();
+    }
+    return num_failed;
+}
+
+void setEncodeThreads(int num_threads)
+{
+    OIIO::attribute("exr_threads", num_threads ? num_threads : int(std::thread::hardware_concurrency()));
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "frame.h"
+#include "queue.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+
+// Saves output images with the chosen compression and data format. With background set the
+// saves run on their own thread, in order, so the next frame can be denoised while the
+// previous one is encoded. At most two saves wait in the queue, bounding the memory held.
+class FrameWriter
+{
+public:
+    FrameWriter(const OutputSettings& output, bool background);
+    ~FrameWriter();
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter& operator=(const FrameWriter&) = delete;
+
+    const OutputSettings& settings() const { return output; }
+    bool background() const { return thread.joinable(); }
+
+    // Runs save now and returns its result, or queues it and returns true. Layers held
+    // are saved first.
+    bool submit(std::function<bool()> save);
+
+    // Holds a denoised layer for the file at path, which is saved as a copy of source with
+    // the layer added. Layers for the same file in a row are saved together, in one write,
+    // when a layer for another file or another save comes, or on flushLayers() or finish().
+    // A failure to save the layers held before is counted by finish().
+    bool addLayer(const std::string& path, const std::string& name, std::shared_ptr<OIIO::ImageBuf> source,
+                  std::shared_ptr<OIIO::ImageBuf> layer);
+
+    // Saves the layers held now, or queues them and returns true
+    bool flushLayers();
+
+    // Saves the layers held, then waits for the queued saves and returns how many failed
+    int finish();
+
+private:
+    // Saves or queues the layers held, counting a failure if count is set
+    bool saveHeldLayers(bool count);
+
+    OutputSettings output;
+    LayerFile layers;
+    std::unique_ptr<BoundedQueue<std::function<bool()>>> queue;
+    std::thread thread;
+    std::atomic<int> num_failed;
+};
+
+// Sizes the OpenEXR encoder's thread pool, 0 for all hardware threads
+void setEncodeThreads(int num_threads);
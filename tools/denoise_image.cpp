@@ -0,0 +1,101 @@
+// Example of embedding the denoiser. Reads a beauty image and optional albedo and normal
+// into memory as an application would hold them, denoises the beauty in place through
+// denoiser.h and saves it. Channels after the first three, such as alpha, are kept.
+//
+//   denoise_image beauty.exr denoised.exr
+//   denoise_image beauty.exr denoised.exr albedo.exr normal.exr
+
+#include <denoiser.h>
+#include <OpenImageIO/imageio.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+struct Pixels
+{
+    std::vector<float> data;
+    OIIO::ImageSpec spec;
+
+    denoiser::Image image()
+    {
+        denoiser::Image result;
+        result.data = data.data();
+        result.width = spec.width;
+        result.height = spec.height;
+        result.format = denoiser::PixelFormat::Float;
+        result.pixel_stride = spec.nchannels * sizeof(float);
+        result.row_stride = result.pixel_stride * spec.width;
+        return result;
+    }
+};
+
+bool readPixels(const std::string& path, Pixels& pixels)
+{
+    std::unique_ptr<OIIO::ImageInput> input = OIIO::ImageInput::open(path);
+    if (!input)
+    {
+        fprintf(stderr, "Couldn't open %s: %s\n", path.c_str(), OIIO::geterror().c_str());
+        return false;
+    }
+    pixels.spec = input->spec();
+    if (pixels.spec.nchannels < 3)
+    {
+        fprintf(stderr, "%s has %d channels, at least 3 are needed\n", path.c_str(), pixels.spec.nchannels);
+        return false;
+    }
+    pixels.data.resize(size_t(pixels.spec.width) * pixels.spec.height * pixels.spec.nchannels);
+    if (!input->read_image(0, 0, 0, pixels.spec.nchannels, OIIO::TypeDesc::FLOAT, pixels.data.data()))
+    {
+        fprintf(stderr, "Couldn't read %s: %s\n", path.c_str(), input->geterror().c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    if (argc != 3 && argc != 4 && argc != 5)
+    {
+        fprintf(stderr, "Usage: %s beauty output [albedo [normal]]\n", argv[0]);
+        return 1;
+    }
+
+    Pixels color;
+    Pixels albedo;
+    Pixels normal;
+    if (!readPixels(argv[1], color) || (argc > 3 && !readPixels(argv[3], albedo)) ||
+        (argc > 4 && !readPixels(argv[4], normal)))
+        return 1;
+
+    denoiser::Denoiser denoiser;
+    if (!denoiser.init())
+    {
+        fprintf(stderr, "%s\n", denoiser.error().c_str());
+        return 1;
+    }
+
+    denoiser::Image albedo_image = albedo.image();
+    denoiser::Image normal_image = normal.image();
+    denoiser::Image color_image = color.image();
+    if (!denoiser.denoise(color_image, argc > 3 ? &albedo_image : nullptr, argc > 4 ? &normal_image : nullptr,
+                          color_image))
+    {
+        fprintf(stderr, "%s\n", denoiser.error().c_str());
+        return 1;
+    }
+
+    std::unique_ptr<OIIO::ImageOutput> output = OIIO::ImageOutput::create(argv[2]);
+    if (!output || !output->open(argv[2], color.spec) ||
+        !output->write_image(OIIO::TypeDesc::FLOAT, color.data.data()) || !output->close())
+    {
+        fprintf(stderr, "Couldn't write %s: %s\n", argv[2],
+                output ? output->geterror().c_str() : OIIO::geterror().c_str());
+        return 1;
+    }
+    return 0;
+}
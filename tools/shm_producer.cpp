@@ -0,0 +1,272 @@
+// Test producer for shared memory images. Creates color, albedo, normal and output regions
+// as a renderer would, fills them with a noisy test pattern, has the denoiser denoise them
+// and reports how much of the noise was removed.
+//
+//   shm_producer -w 1920 -h 1080 -run ./Denoiser
+//   shm_producer -client /tmp/denoiser.sock -run ./Denoiser -repeat 10
+
+#include <shared_image.h>
+#include <fcntl.h>
+#include <math.h>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+
+struct Region
+{
+    std::string name;
+    unsigned char* data = nullptr;
+    size_t size = 0;
+    denoiser::SharedImageHeader header;
+
+    unsigned char* pixel(int x, int y) const
+    {
+        const size_t channel_size = (header.pixel_type == denoiser::SharedHalf) ? 2 : 4;
+        const size_t row_stride = header.row_stride ? header.row_stride : header.width * header.channels * channel_size;
+        return data + header.data_offset + y * row_stride + x * header.channels * channel_size;
+    }
+};
+
+uint16_t floatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    const int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+    if (exponent <= 0)
+        return uint16_t(sign);
+    if (exponent >= 31)
+        return uint16_t(sign | 0x7c00);
+    // Round to nearest
+    mantissa += 0x1000;
+    if (mantissa & 0x800000)
+        return uint16_t(sign | ((exponent + 1) << 10));
+    return uint16_t(sign | (exponent << 10) | (mantissa >> 13));
+}
+
+float halfToFloat(uint16_t value)
+{
+    const uint32_t sign = uint32_t(value & 0x8000) << 16;
+    const int exponent = (value >> 10) & 0x1f;
+    const uint32_t mantissa = value & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0)
+        bits = sign;
+    else if (exponent == 31)
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    else
+        bits = sign | uint32_t(exponent - 15 + 127) << 23 | (mantissa << 13);
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+void setPixel(const Region& region, int x, int y, const float* values)
+{
+    unsigned char* pixel = region.pixel(x, y);
+    for (int c = 0; c < region.header.channels; c++)
+    {
+        if (region.header.pixel_type == denoiser::SharedHalf)
+        {
+            uint16_t half = floatToHalf(values[c]);
+            memcpy(pixel + c * 2, &half, 2);
+        }
+        else
+            memcpy(pixel + c * 4, &values[c], 4);
+    }
+}
+
+float getChannel(const Region& region, int x, int y, int c)
+{
+    const unsigned char* pixel = region.pixel(x, y);
+    if (region.header.pixel_type == denoiser::SharedHalf)
+    {
+        uint16_t half;
+        memcpy(&half, pixel + c * 2, 2);
+        return halfToFloat(half);
+    }
+    float value;
+    memcpy(&value, pixel + c * 4, 4);
+    return value;
+}
+
+bool createRegion(Region& region, const std::string& name, int width, int height, int channels, bool half)
+{
+    region.name = name;
+    region.header.width = width;
+    region.header.height = height;
+    region.header.channels = channels;
+    region.header.pixel_type = half ? denoiser::SharedHalf : denoiser::SharedFloat;
+    region.size = region.header.data_offset + size_t(width) * height * channels * (half ? 2 : 4);
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0 || ftruncate(fd, off_t(region.size)) != 0)
+    {
+        fprintf(stderr, "Could not create %s: %s\n", name.c_str(), strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    void* data = mmap(nullptr, region.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map %s: %s\n", name.c_str(), strerror(errno));
+        return false;
+    }
+    region.data = (unsigned char*)data;
+    memcpy(region.data, &region.header, sizeof(region.header));
+    return true;
+}
+
+// A smooth pattern of coloured tiles with gradients, the clean image the noise is added to
+void cleanPixel(int x, int y, int width, int height, float* rgb)
+{
+    const int tile = ((x * 8 / width) + (y * 8 / height)) % 4;
+    const float u = float(x) / width;
+    const float v = float(y) / height;
+    const float base[4][3] = { { 0.8f, 0.2f, 0.2f }, { 0.2f, 0.7f, 0.3f }, { 0.2f, 0.3f, 0.9f }, { 0.9f, 0.8f, 0.4f } };
+    for (int c = 0; c < 3; c++)
+        rgb[c] = base[tile][c] * (0.5f + 0.5f * u) * (0.6f + 0.4f * v);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    int width = 1920;
+    int height = 1080;
+    bool half = false;
+    float noise = 0.2f;
+    int repeat = 1;
+    bool keep = false;
+    std::string prefix = "/denoiser_test";
+    std::string denoiser;
+    std::string client;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const std::string arg = argv[i];
+        const std::string value = argv[i + 1];
+        if (arg == "-w")
+            width = atoi(value.c_str());
+        else if (arg == "-h")
+            height = atoi(value.c_str());
+        else if (arg == "-half")
+            half = atoi(value.c_str()) != 0;
+        else if (arg == "-noise")
+            noise = float(atof(value.c_str()));
+        else if (arg == "-name")
+            prefix = value;
+        else if (arg == "-run")
+            denoiser = value;
+        else if (arg == "-client")
+            client = value;
+        else if (arg == "-repeat")
+            repeat = std::max(atoi(value.c_str()), 1);
+        else if (arg == "-keep")
+            keep = atoi(value.c_str()) != 0;
+        else
+        {
+            fprintf(stderr, "Unknown flag %s\n", arg.c_str());
+            fprintf(stderr, "Usage: shm_producer [-w int] [-h int] [-half 0|1] [-noise float] [-name /prefix] [-run denoiser] [-client socket] [-repeat int] [-keep 0|1]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (width <= 0 || height <= 0)
+    {
+        fprintf(stderr, "Invalid size %dx%d\n", width, height);
+        return EXIT_FAILURE;
+    }
+
+    // The color and output have an alpha channel, which the denoiser must leave alone
+    Region color, albedo, normal, output;
+    if (!createRegion(color, prefix + "_color", width, height, 4, half) ||
+        !createRegion(albedo, prefix + "_albedo", width, height, 3, half) ||
+        !createRegion(normal, prefix + "_normal", width, height, 3, half) ||
+        !createRegion(output, prefix + "_output", width, height, 4, half))
+        return EXIT_FAILURE;
+
+    std::mt19937 random(1);
+    std::normal_distribution<float> gaussian(0.0f, noise);
+    double noisy_error = 0.0;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            float clean[3];
+            cleanPixel(x, y, width, height, clean);
+            float values[4] = { 0.0f, 0.0f, 0.0f, 0.5f };
+            for (int c = 0; c < 3; c++)
+            {
+                values[c] = std::max(clean[c] + gaussian(random), 0.0f);
+                noisy_error += (values[c] - clean[c]) * (values[c] - clean[c]);
+            }
+            setPixel(color, x, y, values);
+            setPixel(albedo, x, y, clean);
+            const float up[3] = { 0.0f, 0.0f, 1.0f };
+            setPixel(normal, x, y, up);
+            const float cleared[4] = { 0.0f, 0.0f, 0.0f, 0.25f };
+            setPixel(output, x, y, cleared);
+        }
+    }
+
+    std::string command = (denoiser.empty() ? std::string("./Denoiser") : denoiser) + " -v 1";
+    if (!client.empty())
+        command += " -client " + client;
+    command += " -i shm:" + color.name + " -a shm:" + albedo.name + " -n shm:" + normal.name + " -o shm:" + output.name;
+    if (denoiser.empty())
+    {
+        printf("Regions created, denoise them with:\n%s\nthen press enter\n", command.c_str());
+        getchar();
+    }
+    else
+    {
+        for (int r = 0; r < repeat; r++)
+        {
+            printf("%s\n", command.c_str());
+            fflush(stdout);
+            if (system(command.c_str()) != 0)
+            {
+                fprintf(stderr, "The denoiser failed\n");
+                keep = true;
+                break;
+            }
+        }
+    }
+
+    double denoised_error = 0.0;
+    bool alpha_kept = true;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            float clean[3];
+            cleanPixel(x, y, width, height, clean);
+            for (int c = 0; c < 3; c++)
+            {
+                const float difference = getChannel(output, x, y, c) - clean[c];
+                denoised_error += difference * difference;
+            }
+            alpha_kept = alpha_kept && getChannel(output, x, y, 3) == 0.25f;
+        }
+    }
+    const double count = 3.0 * width * height;
+    printf("RMS error: noisy %.4f, denoised %.4f\n", sqrt(noisy_error / count), sqrt(denoised_error / count));
+    printf("Output alpha %s\n", alpha_kept ? "kept" : "overwritten");
+
+    for (Region* region : { &color, &albedo, &normal, &output })
+    {
+        munmap(region->data, region->size);
+        if (!keep)
+            shm_unlink(region->name.c_str());
+    }
+    return (alpha_kept && denoised_error < noisy_error) ? EXIT_SUCCESS : EXIT_FAILURE;
+}